@@ -28,14 +28,6 @@ namespace pcl
 {
   namespace simulation
   {
-    typedef struct _SinglePoly
-    {
-      float* vertices_;
-      float* colors_;
-      GLenum mode_;
-      GLuint nvertices_;
-    } SinglePoly;
-
     struct Vertex
     {
       Vertex () {}
@@ -58,17 +50,46 @@ namespace pcl
     };
 
     typedef std::vector<Vertex> Vertices;
-    typedef std::vector<size_t> Indices;
+    // Must match the GL_UNSIGNED_INT index type used by glDrawElements.
+    typedef std::vector<GLuint> Indices;
 
     class Model
     {
       public:
+        virtual
+        ~Model () {}
+
         virtual void draw () = 0;
 
+        /**
+         * CPU copy of the triangle geometry in model coordinates, for
+         * renderers that do not go through OpenGL. Models that cannot provide
+         * it return NULL and are skipped by those renderers.
+         */
+        virtual const Vertices* getVertices () const { return NULL; }
+        virtual const Indices* getIndices () const { return NULL; }
+
+        /**
+         * Axis aligned bounding box of the geometry in model coordinates.
+         * Returns false if the model does not know its extent.
+         */
+        virtual bool
+        getBoundingBox (Eigen::Vector3f& /*min_pt*/, Eigen::Vector3f& /*max_pt*/) const { return false; }
+
+        /** Model to world transform that draw () applies to the geometry. */
+        virtual Eigen::Matrix4f getTransform () const { return Eigen::Matrix4f::Identity (); }
+
         typedef boost::shared_ptr<Model> Ptr;
         typedef boost::shared_ptr<const Model> ConstPtr;
     };
 
+    /**
+     * Indexed triangle mesh. Polygons are fan-triangulated at construction,
+     * vertices are shared between faces, and the whole mesh is stored in a
+     * static VBO/IBO pair that is drawn with a single glDrawElements call.
+     * The buffers are uploaded on the first draw, so the model can also be
+     * built and used without an OpenGL context (see SoftwareRasterizer).
+     */
     class PCL_EXPORTS TriangleMeshModel : public Model
     {
       public:
@@ -83,14 +104,32 @@ namespace pcl
         virtual void
         draw ();
 
+        virtual const Vertices*
+        getVertices () const { return &vertices_; }
+
+        virtual const Indices*
+        getIndices () const { return &indices_; }
+
+        virtual bool
+        getBoundingBox (Eigen::Vector3f& min_pt, Eigen::Vector3f& max_pt) const;
+
       private:
+        void
+        upload ();
+
         GLuint vbo_;
         GLuint ibo_;
         GLuint size_;
-        //Vertices vertices_;
-        //Indices indices_;
+        Vertices vertices_;
+        Indices indices_;
+        Eigen::Vector3f min_pt_;
+        Eigen::Vector3f max_pt_;
     };
 
+    /**
+     * Polygon mesh whose vertices are uploaded once into a static VBO at
+     * construction. Each polygon is drawn from its offset in that buffer.
+     */
     class PCL_EXPORTS PolygonMeshModel : public Model
     {
       public:
@@ -101,7 +140,10 @@ namespace pcl
         typedef boost::shared_ptr<PolygonMeshModel> Ptr;
         typedef boost::shared_ptr<const PolygonMeshModel> ConstPtr;
       private:
-        std::vector<SinglePoly> polygons;
+        GLuint vbo_;
+        // Offset of the first vertex and vertex count of each polygon.
+        std::vector<GLint> first_;
+        std::vector<GLsizei> count_;
 
         /*
           GL_POINTS;
@@ -118,6 +160,44 @@ namespace pcl
         GLenum mode_;
     };
 
+    /**
+     * Draws a shared model with a model matrix applied. This lets the
+     * GPU-resident geometry of a model be rendered at any number of poses
+     * without copying or re-uploading the mesh.
+     */
+    class PCL_EXPORTS TransformedModel : public Model
+    {
+      public:
+        typedef boost::shared_ptr<TransformedModel> Ptr;
+        typedef boost::shared_ptr<const TransformedModel> ConstPtr;
+
+        TransformedModel (const Model::Ptr& model, const Eigen::Matrix4f& transform);
+
+        virtual void
+        draw ();
+
+        const Model::Ptr&
+        getModel () const { return model_; }
+
+        virtual const Vertices*
+        getVertices () const { return model_->getVertices (); }
+
+        virtual const Indices*
+        getIndices () const { return model_->getIndices (); }
+
+        virtual bool
+        getBoundingBox (Eigen::Vector3f& min_pt, Eigen::Vector3f& max_pt) const
+        { return model_->getBoundingBox (min_pt, max_pt); }
+
+        virtual Eigen::Matrix4f
+        getTransform () const { return transform_ * model_->getTransform (); }
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+      private:
+        Model::Ptr model_;
+        Eigen::Matrix4f transform_;
+    };
+
     class PCL_EXPORTS PointCloudModel : public Model
     {
       public:
@@ -28,6 +28,7 @@
 #include <kinect_sim/scene.h>
 #include <kinect_sim/glsl_shader.h>
 #include <kinect_sim/sum_reduce.h>
+#include <kinect_sim/software_rasterizer.h>
 
 namespace pcl {
 namespace simulation {
@@ -50,13 +51,18 @@ class PCL_EXPORTS RangeLikelihood {
    * @param col_width  - width of the image for a single particle.
    * @param scene - a pointer to the scene that should be rendered when
    *                computing likelihoods.
+   * @param use_software_rasterizer - render depth on the CPU with a
+   *                SoftwareRasterizer instead of OpenGL. No GL context is
+   *                needed in this mode, the color buffer is left black and
+   *                likelihoods are always computed on the CPU.
    *
    */
   RangeLikelihood (int rows,
                    int cols,
                    int row_height,
                    int col_width,
-                   Scene::Ptr scene);
+                   Scene::Ptr scene,
+                   bool use_software_rasterizer = false);
 
   /**
    * Destroy the RangeLikelihood object and release any memory allocated.
@@ -77,6 +83,65 @@ class PCL_EXPORTS RangeLikelihood {
                       poses,
                       std::vector<float> &scores);
 
+  /**
+   * Renders a batch of scenes into the tiles of the framebuffer in a single
+   * pass. Tile n (row n / cols, column n % cols, counted from the bottom left
+   * of the framebuffer) shows scenes[n] as seen from poses[n]. At most
+   * rows * cols scenes are rendered and any remaining tiles are left empty.
+   * The result is read back with getDepthBuffer () or getColorBuffer ().
+   *
+   * @param scenes is the scene to draw in each tile.
+   * @param poses is the camera pose for each tile.
+   */
+  void
+  renderScenes (const std::vector<Scene::Ptr> &scenes,
+                const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+                &poses);
+
+  /**
+   * Like renderScenes (scenes, poses), but tile n is only cleared and drawn
+   * inside the rectangle (x, y, width, height) = rois[4 * n .. 4 * n + 3], in
+   * the top-down pixel coordinates of a tile (see renderPose (pose, x, y,
+   * width, height)). Pixels outside of it are left undefined and tiles with
+   * an empty rectangle are not drawn at all. The software rasterizer always
+   * renders full tiles.
+   */
+  void
+  renderScenes (const std::vector<Scene::Ptr> &scenes,
+                const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+                &poses,
+                const std::vector<int> &rois);
+
+  /**
+   * Render scene_ as seen from pose into the first tile, without computing
+   * any likelihoods. The result is read back with getDepthBuffer (),
+   * getDepthBufferMillimeters () or getColorBuffer (). Nothing is allocated
+   * per call.
+   */
+  void
+  renderPose (const Eigen::Isometry3d &pose);
+
+  /**
+   * Like renderPose (pose), but only clears and draws the rectangle
+   * (x, y, width, height) of the first tile, in the top-down pixel
+   * coordinates of getDepthBufferMillimeters (). Pixels outside of it are
+   * left undefined. The software rasterizer always renders the full tile.
+   */
+  void
+  renderPose (const Eigen::Isometry3d &pose, int x, int y, int width,
+              int height);
+
+  /**
+   * Screen space bounding box of scene seen from pose, in top-down pixel
+   * coordinates of a single tile. It is the projection of the bounding
+   * boxes of all models, so every pixel the scene covers lies inside it.
+   * Returns false if a model has no bounding box or reaches behind the
+   * near plane; the whole tile should be used then.
+   */
+  bool
+  getScreenBoundingBox (const Scene &scene, const Eigen::Isometry3d &pose,
+                        int &x, int &y, int &width, int &height) const;
+
   /**
    * Set the basic camera intrinsic parameters
    */
@@ -126,6 +191,35 @@ class PCL_EXPORTS RangeLikelihood {
   int getHeight () {
     return height_;
   }
+  float getCameraFX () const {
+    return camera_fx_;
+  }
+  float getCameraFY () const {
+    return camera_fy_;
+  }
+  float getCameraCX () const {
+    return camera_cx_;
+  }
+  float getCameraCY () const {
+    return camera_cy_;
+  }
+
+  bool usesSoftwareRasterizer () const {
+    return static_cast<bool> (software_rasterizer_);
+  }
+
+  /**
+   * OpenGL projection matrix of a single tile, built from the camera
+   * intrinsics scaled to the tile size.
+   */
+  Eigen::Matrix4f
+  getProjectionMatrix () const;
+
+  /**
+   * World to OpenGL eye transform for a camera at pose (X forward, Z up).
+   */
+  static Eigen::Matrix4f
+  getViewMatrix (const Eigen::Isometry3d &pose);
 
   // Convenience function to return simulated RGB-D PointCloud
   // Two modes:
@@ -179,6 +273,135 @@ class PCL_EXPORTS RangeLikelihood {
   const float *
   getScoreBuffer ();
 
+  /**
+   * Depth of the last render as Kinect style range in millimetres, with
+   * z_far (in mm) where nothing was hit. Unlike getDepthBuffer () each tile
+   * is in top-down row order: row y of tile (r, c) starts at element
+   * (r * row_height + y) * width + c * col_width.
+   *
+   * On the GL path the conversion is a shader pass into a 16 bit integer
+   * texture, so only half the data of getDepthBuffer () is read back.
+   */
+  const unsigned short *
+  getDepthBufferMillimeters ();
+
+  /**
+   * Read only the rectangle (x, y, width, height) of
+   * getDepthBufferMillimeters () into depth_mm, row major with width values
+   * per row. The rectangle must lie within a single tile.
+   */
+  void
+  getDepthBufferMillimeters (int x, int y, int width, int height,
+                             unsigned short *depth_mm);
+
+  /**
+   * Set the number of pixel buffer objects used for asynchronous depth
+   * readback, i.e. how many readbacks can be in flight at once (minimum 2).
+   */
+  void
+  setNumReadbackBuffers (int num_buffers);
+
+  int
+  getNumReadbackBuffers () const {
+    return num_readback_buffers_;
+  }
+
+  /**
+   * Queue a copy of the depth buffer of the last render into the next
+   * readback buffer and return its slot without waiting for the transfer.
+   * More frames can be rendered before the slot is mapped, which overlaps
+   * the transfer with the following renders. Slots are reused round-robin,
+   * so a slot must be unmapped before getNumReadbackBuffers () more
+   * readbacks are started.
+   */
+  int
+  beginDepthReadback ();
+
+  /**
+   * Wait for the readback in slot to complete and return the depth buffer
+   * (same layout as getDepthBuffer ()). The pointer stays valid until
+   * unmapDepthReadback (slot) is called.
+   */
+  const float *
+  mapDepthReadback (int slot);
+
+  /**
+   * Same as beginDepthReadback () / mapDepthReadback (), but for the
+   * millimetre depth of getDepthBufferMillimeters (). Both kinds share the
+   * same slots and are released with unmapDepthReadback ().
+   */
+  int
+  beginDepthReadbackMillimeters ();
+
+  /**
+   * Like beginDepthReadbackMillimeters (), but only converts and reads back
+   * the rectangle (x, y, width, height) of getDepthBufferMillimeters ().
+   * mapDepthReadbackMillimeters (slot) then returns its height rows of
+   * width values.
+   */
+  int
+  beginDepthReadbackMillimeters (int x, int y, int width, int height);
+
+  const unsigned short *
+  mapDepthReadbackMillimeters (int slot);
+
+  void
+  unmapDepthReadback (int slot);
+
+  /**
+   * Set the depth image (in mm, the size and layout of one tile of
+   * getDepthBufferMillimeters ()) that countOccludingPixels () tests
+   * against. Values of z_far (in mm) mean no return.
+   */
+  void
+  setOcclusionReference (const unsigned short *depth_mm);
+
+  /**
+   * Number of pixels where scene, seen from pose, would be rendered closer
+   * (after rounding to millimetres) than a valid pixel of the occlusion
+   * reference. On the GL path the reference is loaded as the depth buffer,
+   * scene is drawn with a GL_LESS test and no depth writes, and the passing
+   * fragments are counted with an occlusion query, so nothing is read back.
+   * The GL count only includes pixels more than 1 mm in front of the
+   * reference, so it never exceeds the exact count of the software path.
+   * Both passes are scissored to the screen bounding box of scene.
+   *
+   * Overwrites the first tile of the depth buffer.
+   */
+  int
+  countOccludingPixels (const Scene::Ptr &scene, const Eigen::Isometry3d &pose);
+
+  /**
+   * Set the observed depth image (in mm, one tile in the layout of
+   * getDepthBufferMillimeters ()) and the mask that assigns its pixels to
+   * the counts of countUnexplainedPoints () (0 to ignore a pixel).
+   */
+  void
+  setObservedDepth (const unsigned short *depth_mm);
+
+  void
+  setObservedMask (const uint8_t *mask);
+
+  /**
+   * PERCH costs of the first tile of the last render, all in one pass.
+   * The child image scored is that render composited (per pixel minimum)
+   * with the occlusion reference (the parent image), so it is enough to
+   * render only the objects the parent is missing.
+   * counts[0] is the target cost: the number of child points on pixels
+   * where the reference has no return, and that have no observed point
+   * within radius (in metres). counts[k], for k = 1, 2, 3, is the number of
+   * observed points on pixels with mask value k that have no child point
+   * within radius. Points are back projected like getGlobalPoint ().
+   *
+   * On the GL path this is a shader pass next to the rendered depth whose
+   * four counts are summed with one Reduce, so only the reduced sums are
+   * read back. Neighbours are searched in a window of pixels around each
+   * point, which is exact unless the window would exceed 8 pixels, i.e. for
+   * points closer than radius * fx / 8.
+   */
+  void
+  countUnexplainedPoints (float radius, float counts[4]);
+
  private:
   /**
    * Evaluate the likelihood/score for a set of particles
@@ -193,15 +416,21 @@ class PCL_EXPORTS RangeLikelihood {
   void
   computeScoresShader (float *reference);
 
+  /**
+   * Render the tiles of the framebuffer. If scenes is empty every tile shows
+   * scene_, otherwise tile n shows scenes[n].
+   */
   void
   render (const
           std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
-          &poses);
+          &poses,
+          const std::vector<Scene::Ptr> &scenes = std::vector<Scene::Ptr> ());
 
   void
-  drawParticles (
+  drawParticles (const
     std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
-    poses);
+    &poses,
+    const std::vector<Scene::Ptr> &scenes);
 
   void
   applyCameraTransform (const Eigen::Isometry3d &pose);
@@ -212,6 +441,44 @@ class PCL_EXPORTS RangeLikelihood {
   void
   setupProjectionMatrix ();
 
+  int
+  nextReadbackSlot ();
+
+  /**
+   * Run the depth to millimetre shader pass into the rectangle (x, y,
+   * width, height) of depth_mm_texture_.
+   */
+  void
+  convertDepthToMillimeters (int x, int y, int width, int height);
+
+  /**
+   * Read a rectangle of depth_mm_texture_ into data, or into the bound pack
+   * buffer.
+   */
+  void
+  readDepthMillimeters (int x, int y, int width, int height, void *data);
+
+  /**
+   * CPU version of the shader pass, used with the software rasterizer.
+   * Writes the rectangle row major into depth_mm.
+   */
+  void
+  convertDepthToMillimetersCPU (const float *depth, int x, int y, int width,
+                                int height, unsigned short *depth_mm) const;
+
+  void
+  countUnexplainedPointsCPU (float radius, float counts[4]);
+
+  /** Create the framebuffers, textures and shaders used by the GL path. */
+  void
+  initializeGL ();
+
+  void
+  renderSoftware (const
+                  std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+                  &poses,
+                  const std::vector<Scene::Ptr> &scenes);
+
   Scene::Ptr scene_;
   int rows_;
   int cols_;
@@ -221,6 +488,7 @@ class PCL_EXPORTS RangeLikelihood {
   int height_;
   float *depth_buffer_;
   uint8_t *color_buffer_;
+  unsigned short *depth_mm_buffer_;
 
   // Camera Intrinsic Parameters
   int camera_width_;
@@ -235,7 +503,23 @@ class PCL_EXPORTS RangeLikelihood {
   float z_near_;
   float z_far_;
 
+  // Ring of pixel pack buffers for asynchronous depth readback, created on
+  // first use. The software rasterizer uses plain host copies instead.
+  int num_readback_buffers_;
+  int next_readback_buffer_;
+  std::vector<GLuint> readback_pbos_;
+  std::vector<std::vector<float>> readback_copies_;
+  std::vector<std::vector<unsigned short>> readback_mm_copies_;
+
+  // Scissor rectangle of the next render in OpenGL window coordinates.
+  bool use_scissor_;
+  int scissor_[4];
+  // Per tile scissor rectangles of the next render in OpenGL window
+  // coordinates, 4 values per tile. Empty unless set by renderScenes ().
+  std::vector<int> tile_scissors_;
+
   bool depth_buffer_dirty_;
+  bool depth_mm_buffer_dirty_;
   bool color_buffer_dirty_;
   bool score_buffer_dirty_;
 
@@ -254,6 +538,25 @@ class PCL_EXPORTS RangeLikelihood {
   GLuint score_summarized_texture_;
   GLuint sensor_texture_;
   GLuint likelihood_texture_;
+  GLuint depth_mm_texture_;
+  GLuint depth_mm_fbo_;
+  // Reference of countOccludingPixels (), one tile of 16 bit millimetres.
+  // The software rasterizer keeps a host copy instead.
+  GLuint occlusion_reference_texture_;
+  GLuint occlusion_query_;
+  std::vector<unsigned short> occlusion_reference_;
+  // Millimetre depth of the first tile, scratch space of the CPU paths.
+  std::vector<unsigned short> tile_depth_mm_;
+  // Inputs of the PERCH scoring pass, with host copies for the CPU path.
+  GLuint observed_texture_;
+  GLuint observed_mask_texture_;
+  std::vector<unsigned short> observed_depth_;
+  std::vector<uint8_t> observed_mask_;
+  // Four channel float image of the PERCH scoring pass, reduced with
+  // statistics_reduce_.
+  GLuint statistics_fbo_;
+  GLuint statistics_texture_;
+  std::vector<float> reduced_statistics_;
 
   bool compute_likelihood_on_cpu_;
   bool aggregate_on_cpu_;
@@ -262,11 +565,22 @@ class PCL_EXPORTS RangeLikelihood {
   bool use_color_;
 
   gllib::Program::Ptr likelihood_program_;
+  gllib::Program::Ptr depth_mm_program_;
+  gllib::Program::Ptr occlusion_reference_program_;
+  gllib::Program::Ptr perch_score_program_;
   GLuint quad_vbo_;
   std::vector<Eigen::Vector3f> vertices_;
+  // Scratch space reused across render calls.
+  std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+      single_pose_;
+  std::vector<Scene::Ptr> tile_scenes_;
+  SoftwareRasterizer::Matrices tile_views_;
   float *score_buffer_;
-  Quad quad_;
-  SumReduce sum_reduce_;
+  // Only created on the GL path, they need a current context.
+  boost::shared_ptr<Quad> quad_;
+  boost::shared_ptr<SumReduce> sum_reduce_;
+  boost::shared_ptr<Reduce> statistics_reduce_;
+  SoftwareRasterizer::Ptr software_rasterizer_;
 };
 
 template<class T> T
@@ -38,6 +38,9 @@ namespace pcl
       void
       clear ();
 
+      const std::vector<Model::Ptr>&
+      getModels () const { return models_; }
+
     private:
       std::vector<Model::Ptr> models_;
     };
@@ -38,21 +38,83 @@ namespace pcl
 {
   namespace simulation
   {
+    /**
+     * Part of a depth image (in mm, same layout as
+     * SimExample::get_depth_image_uint) that holds every pixel a render
+     * covered; pixels outside of it are at the far plane. depth has width * height values, row
+     * major, and pixel (u, v) of the full image is
+     * depth[(v - y) * width + (u - x)].
+     */
+    struct DepthImageROI
+    {
+      int x;
+      int y;
+      int width;
+      int height;
+      std::vector<unsigned short> depth;
+
+      DepthImageROI () : x (0), y (0), width (0), height (0) {}
+    };
+
     class PCL_EXPORTS SimExample
     {
       public:
         typedef boost::shared_ptr<SimExample> Ptr;
         typedef boost::shared_ptr<const SimExample> ConstPtr;
+
+        /** How the OpenGL context used for rendering is created. */
+        enum ContextType
+        {
+          /** Hidden GLUT window. Requires an X display. */
+          CONTEXT_GLUT,
+          /**
+           * Offscreen EGL context (surfaceless, or a 1x1 pbuffer when the
+           * driver needs a surface). No window system is required; all
+           * rendering goes to the RangeLikelihood framebuffer objects.
+           */
+          CONTEXT_EGL,
+          /**
+           * No OpenGL context at all. Depth images are rendered on the CPU
+           * by SoftwareRasterizer, so only models that expose their geometry
+           * (TriangleMeshModel) show up, and color images are black.
+           */
+          CONTEXT_SOFTWARE
+        };
     	
         SimExample (int argc, char** argv,
-    		int height,int width);
+    		int height,int width, ContextType context_type = CONTEXT_GLUT);
+        ~SimExample ();
         void initializeGL (int argc, char** argv);
+        void initializeEGL ();
         
         Scene::Ptr scene_;
         Camera::Ptr camera_;
         RangeLikelihood::Ptr rl_;  
     
         void doSim (Eigen::Isometry3d pose_in);
+
+        /**
+         * Render scene_ from pose_in with rl_ and nothing else; unlike doSim no
+         * likelihoods are computed. Read the result with rl_->getDepthBuffer ()
+         * or get_depth_image_uint ().
+         */
+        void doRender (const Eigen::Isometry3d& pose_in);
+
+        /**
+         * Like doRender followed by get_depth_image_uint, but only renders
+         * and reads back the screen space bounding box of scene_. Falls back
+         * to the full image when the box cannot be computed.
+         */
+        void doRenderROI (const Eigen::Isometry3d& pose_in, DepthImageROI* roi);
+
+        /**
+         * Number of pixels where scene_ seen from pose_in would be in front
+         * of the valid pixels of depth_img (in mm, same layout as
+         * get_depth_image_uint), without reading back any image. See
+         * RangeLikelihood::countOccludingPixels.
+         */
+        void set_occlusion_reference (const std::vector<unsigned short>& depth_img);
+        int count_occluding_pixels (const Eigen::Isometry3d& pose_in);
     
         void write_score_image(const float* score_buffer,std::string fname);
         void write_depth_image(const float* depth_buffer,std::string fname);
@@ -60,9 +122,70 @@ namespace pcl
         void write_rgb_image(const uint8_t* rgb_buffer,std::string fname);
 
         void get_depth_image_uint(const float* depth_buffer, std::vector<unsigned short>* depth_img_uint);
+        /**
+         * Depth image (in mm) of the last render of rl_. The conversion is done
+         * on the render side, see RangeLikelihood::getDepthBufferMillimeters.
+         */
+        void get_depth_image_uint(std::vector<unsigned short>* depth_img_uint);
         void get_depth_image_cv(const float* depth_buffer, cv::Mat &depth_image);
+
+        /**
+         * Render a batch of scenes, each from its own camera pose, into the
+         * tiles of one large framebuffer and return a depth image (in mm, same
+         * layout as get_depth_image_uint) for every scene. Scenes are rendered
+         * getBatchSize () at a time with a single depth readback per chunk,
+         * and the readback of one chunk overlaps the rendering of the next.
+         */
+        void get_depth_images_uint(const std::vector<Scene::Ptr>& scenes,
+                                   const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d> >& poses,
+                                   std::vector<std::vector<unsigned short> >* depth_images);
+
+        /**
+         * Batch version of doRenderROI: the depth image of every scene is
+         * cropped to its screen space bounding box. As in doRenderROI each
+         * tile is only drawn inside its box, and only the bounding box of
+         * the boxes of a chunk is converted to mm and read back.
+         */
+        void get_depth_images_roi(const std::vector<Scene::Ptr>& scenes,
+                                  const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d> >& poses,
+                                  std::vector<DepthImageROI>* rois);
+
+        // Number of scenes rendered per pass by get_depth_images_uint.
+        int getBatchSize ();
     
       private:
+        void initializeGLEW ();
+
+        // Tiled renderer used for batches, created on first use.
+        RangeLikelihood::Ptr getBatchRangeLikelihood ();
+
+        // Renders scenes in chunks of getBatchSize () and extracts the
+        // tiles into depth_images, or into the rectangles of rois if
+        // depth_images is NULL. In the latter case only the rectangles are
+        // drawn and read back.
+        void renderBatch (const std::vector<Scene::Ptr>& scenes,
+                          const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d> >& poses,
+                          std::vector<std::vector<unsigned short> >* depth_images,
+                          std::vector<DepthImageROI>* rois);
+
+        // Copies tiles 0 .. last-first of a batch millimetre depth buffer
+        // into (*depth_images)[first .. last), or into (*rois)[first .. last)
+        // if depth_images is NULL. depth_buffer holds the rectangle of the
+        // batch buffer at (buffer_x, buffer_y) with rows of buffer_width.
+        void extractTiles (const unsigned short* depth_buffer, int buffer_x, int buffer_y,
+                           int buffer_width, size_t first, size_t last,
+                           std::vector<std::vector<unsigned short> >* depth_images,
+                           std::vector<DepthImageROI>* rois);
+
+        ContextType context_type_;
+        // EGLDisplay, EGLSurface and EGLContext handles when using
+        // CONTEXT_EGL, kept opaque so this header does not depend on EGL.
+        void* egl_display_;
+        void* egl_surface_;
+        void* egl_context_;
+
+        RangeLikelihood::Ptr batch_rl_;
+
         uint16_t t_gamma[2048];  
     
         // of platter, usually 640x480
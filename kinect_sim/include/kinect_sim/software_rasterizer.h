@@ -0,0 +1,118 @@
+/*
+ * software_rasterizer.h
+ *
+ * Multi-threaded CPU depth rasterizer. Produces the same tiled depth buffer
+ * as the OpenGL path of RangeLikelihood without needing a GL context.
+ */
+
+#ifndef PCL_SIMULATION_SOFTWARE_RASTERIZER
+#define PCL_SIMULATION_SOFTWARE_RASTERIZER
+
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+
+#include <pcl/pcl_macros.h>
+#include <kinect_sim/scene.h>
+
+namespace pcl
+{
+  namespace simulation
+  {
+    /** \brief Renders depth images of triangle mesh scenes on the CPU.
+     *
+     * The output buffer is laid out like the RangeLikelihood framebuffer:
+     * rows * cols tiles of row_height x col_width pixels, tile n at row
+     * n / cols and column n % cols, with the first buffer row at the bottom.
+     * Depth values are window depths in [0, 1] as written by OpenGL with the
+     * default depth range, and uncovered pixels are 1.
+     *
+     * Rasterization uses edge functions evaluated four pixels at a time with
+     * SSE2 (when available). Tiles are set up in parallel and then split into
+     * horizontal bands, so both batches of scenes and single large images
+     * are spread over the worker threads.
+     *
+     * Only models that expose their geometry through Model::getVertices ()
+     * and Model::getIndices () are drawn.
+     */
+    class PCL_EXPORTS SoftwareRasterizer
+    {
+      public:
+        typedef boost::shared_ptr<SoftwareRasterizer> Ptr;
+        typedef std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > Matrices;
+
+        /** \brief Create a rasterizer for a tiled depth buffer.
+         * \param[in] num_threads number of worker threads, 0 to use one per
+         *            hardware thread.
+         */
+        SoftwareRasterizer (int rows, int cols, int row_height, int col_width,
+                            int num_threads = 0);
+
+        /** \brief Render scenes[n] with view matrix views[n] into tile n.
+         * Tiles past the end of scenes are cleared.
+         * \param[in] scenes the scene to draw in each tile.
+         * \param[in] views world to OpenGL eye transform for each tile.
+         * \param[in] projection OpenGL projection matrix shared by all tiles.
+         * \param[out] depth_buffer width * height window depths.
+         */
+        void
+        render (const std::vector<Scene::Ptr> &scenes,
+                const Matrices &views,
+                const Eigen::Matrix4f &projection,
+                float *depth_buffer);
+
+        int
+        getNumThreads () const { return num_threads_; }
+
+      private:
+        /** Screen space triangle in tile pixel coordinates. */
+        struct Triangle
+        {
+          // Edge functions e(x, y) = a * x + b * y + c, positive inside.
+          // The per-row terms are kept in double so that only the short
+          // run along x is evaluated in single precision.
+          float a[3];
+          double b[3];
+          double c[3];
+          bool top_left[3];
+          // Window depth plane z(x, y) = za * x + zb * y + zc.
+          float za;
+          double zb;
+          double zc;
+          int min_x;
+          int max_x;
+          int min_y;
+          int max_y;
+        };
+
+        void
+        setupTile (int tile, const Scene &scene, const Eigen::Matrix4f &view_projection);
+
+        void
+        addTriangle (int tile, const Eigen::Vector4f &c0,
+                     const Eigen::Vector4f &c1, const Eigen::Vector4f &c2);
+
+        void
+        addClippedTriangle (int tile, const Eigen::Vector4f &c0,
+                            const Eigen::Vector4f &c1, const Eigen::Vector4f &c2);
+
+        void
+        rasterizeBand (int tile, int y_begin, int y_end, float *depth_buffer) const;
+
+        int rows_;
+        int cols_;
+        int row_height_;
+        int col_width_;
+        int width_;
+        int num_threads_;
+
+        std::vector<std::vector<Triangle> > tile_triangles_;
+        std::vector<std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> > > tile_clip_vertices_;
+    };
+
+  } // namespace - simulation
+} // namespace - pcl
+
+#endif
@@ -8,6 +8,8 @@
 #ifndef PCL_SIMULATION_SUM_REDUCE
 #define PCL_SIMULATION_SUM_REDUCE
 
+#include <vector>
+
 #include <GL/glew.h>
 
 #include <pcl/pcl_config.h>
@@ -24,6 +26,74 @@ namespace pcl
 {
   namespace simulation
   {
+    /** \brief Implements a parallel reduction of float arrays using GLSL.
+     * The input array is provided as a float texture with up to four
+     * channels and the reduction is performed over set number of levels,
+     * where each level halfs each dimension. Every channel is reduced with
+     * its own operation, so several statistics (e.g. a count in one channel
+     * and the minimum of a value in another) come out of a single pass.
+     *
+     * Pixels that should not take part in a min (max) reduction must hold a
+     * value larger (smaller) than any valid one, and 0 for a sum.
+     *
+     * The same reduction is available on the CPU for arrays in host memory.
+     */
+    class PCL_EXPORTS Reduce
+    {
+      public:
+        enum Operation
+        {
+          SUM = 0,
+          MIN = 1,
+          MAX = 2
+        };
+
+        /** \brief Construct a new reduction object for an array of given size.
+         * \param width[in] the width of the input array.
+         * \param width[in] the height of the input array.
+         * \param levels[in] the number of levels to carry out the reduction.
+         * \param channels[in] the number of channels of the input array,
+         *        1, 2 or 4.
+         */
+        Reduce (int width, int height, int levels, int channels = 1);
+
+        /** \brief Release any allocated resources. */
+        virtual ~Reduce ();
+
+        /** \brief Reduce the array over set number of levels.
+         *  \param[in] input_array name of the input texture.
+         *  \param[in] operations the operation of each channel.
+         *  \param[out] output_array a pointer to an array that can store
+         *  getOutputWidth () * getOutputHeight () pixels of getChannels ()
+         *  interleaved floats.
+         */
+        void reduce (GLuint input_array, const std::vector<Operation> &operations,
+                     float* output_array);
+
+        /** \brief CPU version of reduce () for an array in host memory with
+         *  the layout of glGetTexImage (first row at the bottom).
+         *  Uses SSE2 when available.
+         */
+        static void reduce (const float* input_array, int width, int height,
+                            int levels, int channels,
+                            const std::vector<Operation> &operations,
+                            float* output_array);
+
+        int getChannels () const { return channels_; }
+        int getOutputWidth () const { return width_ >> levels_; }
+        int getOutputHeight () const { return height_ >> levels_; }
+
+      private:
+        GLuint fbo_;
+        GLuint* arrays_;
+        Quad quad_;
+        int levels_;
+        int width_;
+        int height_;
+        int channels_;
+        gllib::Program::Ptr reduce_program_;
+    };
+
     /** \brief Implements a parallel summation of float arrays using GLSL.
      * The input array is provided as a float texture and the summation
      * is performed over set number of levels, where each level halfs each
@@ -32,7 +102,7 @@ namespace pcl
      * \author Hordur Johannsson
      * \ingroup simulation
      */
-    class PCL_EXPORTS SumReduce
+    class PCL_EXPORTS SumReduce : public Reduce
     {
       public:
         /** \brief Construct a new summation object for an array of given size.
@@ -42,23 +112,11 @@ namespace pcl
          */
         SumReduce (int width, int height, int levels);
 
-        /** \brief Release any allocated resources. */
-        ~SumReduce ();
-
         /** \brief Reduce the array with summation over set number of levels.
          *  \param[in] input_array name of the input texture.
          *  \param[out] a pointer to an array that can store the summation result.
          */
         void sum (GLuint input_array, float* output_array);
-
-      private:
-        GLuint fbo_;
-        GLuint* arrays_;
-        Quad quad_;
-        int levels_;
-        int width_;
-        int height_;
-        gllib::Program::Ptr sum_program_;
     };
   } // namespace - simulation
 } // namespace - pcl
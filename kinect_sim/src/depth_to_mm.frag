@@ -0,0 +1,27 @@
+#version 130
+#extension GL_ARB_explicit_attrib_location : enable
+#extension GL_ARB_explicit_uniform_location : enable
+
+// Converts the non-linear depth buffer to Kinect style range in millimetres.
+// Every tile of row_height rows is flipped vertically, so that reading the
+// result back gives top-down images.
+
+layout(location = 0) out uvec4 DepthMm;
+
+uniform sampler2D DepthSampler;
+
+uniform int row_height;
+uniform float near;
+uniform float far;
+
+void main()
+{
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  int tile_y = (p.y / row_height) * row_height;
+  int src_y = tile_y + row_height - 1 - (p.y - tile_y);
+
+  float d = texelFetch(DepthSampler, ivec2(p.x, src_y), 0).r;
+  float z = -far * near / ((far - near) * (d - far / (far - near)));
+
+  DepthMm = uvec4(uint(clamp(floor(1000.0 * z + 0.5), 0.0, 65535.0)), 0u, 0u, 0u);
+}
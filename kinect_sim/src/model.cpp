@@ -1,82 +1,116 @@
 #include <kinect_sim/model.h>
+
+#include <limits>
+
 using namespace pcl::simulation;
 
 pcl::simulation::TriangleMeshModel::TriangleMeshModel (pcl::PolygonMesh::Ptr plg)
+  : vbo_ (0), ibo_ (0), size_ (0)
 {
-  Vertices vertices;
-  Indices indices;
+  Vertices& vertices = vertices_;
+  Indices& indices = indices_;
 
   bool found_rgb = false;
   for (size_t i=0; i < plg->cloud.fields.size () ; ++i)
     if (plg->cloud.fields[i].name.compare ("rgb") == 0)
       found_rgb = true;
 
+  // Vertices are shared between faces: one entry per point of the mesh cloud.
   if (found_rgb)
   {
     pcl::PointCloud<pcl::PointXYZRGB> newcloud;
     pcl::fromPCLPointCloud2 (plg->cloud, newcloud);
-
-    PCL_DEBUG("RGB Triangle mesh: ");
-    PCL_DEBUG("Mesh polygons: %ld", plg->polygons.size ());
-    PCL_DEBUG("Mesh points: %ld", newcloud.points.size ());
-
-    Eigen::Vector4f tmp;
-    for(size_t i=0; i< plg->polygons.size (); ++i)
-    { // each triangle/polygon
-      pcl::Vertices apoly_in = plg->polygons[i];
-      for(size_t j = 0; j < apoly_in.vertices.size (); ++j)
-      { // each point
-        uint32_t pt = apoly_in.vertices[j];
-        tmp = newcloud.points[pt].getVector4fMap();
-        vertices.push_back (Vertex (Eigen::Vector3f (tmp (0), tmp (1), tmp (2)),
-                                    Eigen::Vector3f (newcloud.points[pt].r/255.0f,
-                                                     newcloud.points[pt].g/255.0f,
-                                                     newcloud.points[pt].b/255.0f)));
-        indices.push_back (indices.size ());
-      }
+    vertices.reserve (newcloud.points.size ());
+    for (size_t i = 0; i < newcloud.points.size (); ++i)
+    {
+      const pcl::PointXYZRGB& pt = newcloud.points[i];
+      vertices.push_back (Vertex (Eigen::Vector3f (pt.x, pt.y, pt.z),
+                                  Eigen::Vector3f (pt.r/255.0f,
+                                                   pt.g/255.0f,
+                                                   pt.b/255.0f)));
     }
   }
   else
   {
     pcl::PointCloud<pcl::PointXYZ> newcloud;
     pcl::fromPCLPointCloud2 (plg->cloud, newcloud);
-    Eigen::Vector4f tmp;
-    for(size_t i=0; i< plg->polygons.size (); i++)
-    { // each triangle/polygon
-      pcl::Vertices apoly_in = plg->polygons[i];
-      for(size_t j=0; j< apoly_in.vertices.size (); j++)
-      { // each point
-        uint32_t pt = apoly_in.vertices[j];
-        tmp = newcloud.points[pt].getVector4fMap();
-        vertices.push_back (Vertex (Eigen::Vector3f (tmp (0), tmp (1), tmp (2)),
-                                    Eigen::Vector3f (1.0, 1.0, 1.0)));
-        indices.push_back (indices.size ());
-      }
+    vertices.reserve (newcloud.points.size ());
+    for (size_t i = 0; i < newcloud.points.size (); ++i)
+    {
+      const pcl::PointXYZ& pt = newcloud.points[i];
+      vertices.push_back (Vertex (Eigen::Vector3f (pt.x, pt.y, pt.z),
+                                  Eigen::Vector3f (1.0, 1.0, 1.0)));
+    }
+  }
+
+  if (vertices.size () > std::numeric_limits<GLuint>::max ())
+    PCL_THROW_EXCEPTION(PCLException, "Too many vertices");
+
+  // Triangulate every polygon as a fan around its first vertex. Faces with
+  // fewer than three vertices do not cover any pixels and are dropped.
+  for (size_t i = 0; i < plg->polygons.size (); ++i)
+  {
+    const std::vector<uint32_t>& poly = plg->polygons[i].vertices;
+    for (size_t j = 2; j < poly.size (); ++j)
+    {
+      indices.push_back (poly[0]);
+      indices.push_back (poly[j - 1]);
+      indices.push_back (poly[j]);
     }
   }
 
+  PCL_DEBUG("Mesh polygons: %ld", plg->polygons.size ());
   PCL_DEBUG("Vertices: %ld", vertices.size ());
   PCL_DEBUG("Indices: %ld", indices.size ());
 
+  if (indices.size () > static_cast<size_t> (std::numeric_limits<GLsizei>::max ()))
+    PCL_THROW_EXCEPTION(PCLException, "Too many indices");
+
+  size_ = static_cast<GLuint>(indices.size ());
+
+  min_pt_.setConstant (std::numeric_limits<float>::max ());
+  max_pt_.setConstant (-std::numeric_limits<float>::max ());
+  for (size_t i = 0; i < vertices.size (); ++i)
+  {
+    min_pt_ = min_pt_.cwiseMin (vertices[i].pos);
+    max_pt_ = max_pt_.cwiseMax (vertices[i].pos);
+  }
+}
+
+bool
+pcl::simulation::TriangleMeshModel::getBoundingBox (Eigen::Vector3f& min_pt,
+                                                    Eigen::Vector3f& max_pt) const
+{
+  if (vertices_.empty ())
+    return false;
+
+  min_pt = min_pt_;
+  max_pt = max_pt_;
+  return true;
+}
+
+void
+pcl::simulation::TriangleMeshModel::upload ()
+{
   glGenBuffers (1, &vbo_);
   glBindBuffer (GL_ARRAY_BUFFER, vbo_);
-  glBufferData (GL_ARRAY_BUFFER, vertices.size () * sizeof (vertices[0]), &(vertices[0]), GL_STATIC_DRAW);
+  if (!vertices_.empty ())
+    glBufferData (GL_ARRAY_BUFFER, vertices_.size () * sizeof (vertices_[0]), &(vertices_[0]), GL_STATIC_DRAW);
   glBindBuffer (GL_ARRAY_BUFFER, 0);
 
   glGenBuffers (1, &ibo_);
   glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, ibo_);
-  glBufferData (GL_ELEMENT_ARRAY_BUFFER, indices.size () * sizeof (indices[0]), &(indices[0]), GL_STATIC_DRAW);
+  if (!indices_.empty ())
+    glBufferData (GL_ELEMENT_ARRAY_BUFFER, indices_.size () * sizeof (indices_[0]), &(indices_[0]), GL_STATIC_DRAW);
   glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, 0);
-
-  if (indices.size () > std::numeric_limits<GLuint>::max ())
-    PCL_THROW_EXCEPTION(PCLException, "Too many vertices");
-
-  size_ = static_cast<GLuint>(indices.size ());
 }
 
 void
 pcl::simulation::TriangleMeshModel::draw ()
 {
+  if (vbo_ == 0)
+    upload ();
+
   glEnable (GL_DEPTH_TEST);
 
   glEnableClientState (GL_VERTEX_ARRAY);
@@ -89,7 +123,7 @@ pcl::simulation::TriangleMeshModel::draw ()
   glColorPointer (3, GL_FLOAT, sizeof (Vertex), reinterpret_cast<GLvoid*> (12));
 
   // glNormalPointer(GL_FLOAT, sizeof(Vertex), (GLvoid*)((char*)&(vertices_[0].norm)-(char*)&(vertices_[0].pos)));
-  //  glDrawElements(GL_TRIANGLES, indices_.size(), GL_UNSIGNED_INT, 0);
+  // The whole mesh goes out in a single indexed draw call.
   glDrawElements (GL_TRIANGLES, size_, GL_UNSIGNED_INT, 0);
   glDisableClientState (GL_VERTEX_ARRAY);
   glDisableClientState (GL_COLOR_ARRAY);
@@ -104,16 +138,21 @@ pcl::simulation::TriangleMeshModel::draw ()
 
 pcl::simulation::TriangleMeshModel::~TriangleMeshModel ()
 {
-  if (glIsBuffer (vbo_) == GL_TRUE)
+  // Nothing was uploaded if the model was never drawn with OpenGL.
+  if (vbo_ != 0 && glIsBuffer (vbo_) == GL_TRUE)
     glDeleteBuffers (1, &vbo_);
 
-  if (glIsBuffer (ibo_) == GL_TRUE)
+  if (ibo_ != 0 && glIsBuffer (ibo_) == GL_TRUE)
     glDeleteBuffers (1, &ibo_);
 }
 
 // Create a PolygonMeshModel by converting the PolygonMesh to our format
 pcl::simulation::PolygonMeshModel::PolygonMeshModel (GLenum mode, pcl::PolygonMesh::Ptr plg) : mode_ (mode)
 {
+  Vertices vertices;
+  first_.reserve (plg->polygons.size ());
+  count_.reserve (plg->polygons.size ());
+
   bool found_rgb=false;
   for (size_t i=0; i<plg->cloud.fields.size () ;i++)
     if (plg->cloud.fields[i].name.compare ("rgb") == 0)
@@ -123,93 +162,91 @@ pcl::simulation::PolygonMeshModel::PolygonMeshModel (GLenum mode, pcl::PolygonMe
   {
     pcl::PointCloud<pcl::PointXYZRGB> newcloud;  
     pcl::fromPCLPointCloud2 (plg->cloud, newcloud);
-    Eigen::Vector4f tmp;
     for(size_t i = 0; i< plg->polygons.size (); i++)
     { // each triangle/polygon
-      pcl::Vertices apoly_in = plg->polygons[i];
-      SinglePoly apoly;
-      apoly.nvertices_ = apoly_in.vertices.size ();
-      apoly.vertices_ = new float[3*apoly_in.vertices.size ()];
-      apoly.colors_ = new float[4*apoly_in.vertices.size ()]; 
+      const pcl::Vertices& apoly_in = plg->polygons[i];
+      first_.push_back (static_cast<GLint> (vertices.size ()));
+      count_.push_back (static_cast<GLsizei> (apoly_in.vertices.size ()));
 
       for(size_t j=0; j< apoly_in.vertices.size (); j++)
       { // each point
-	uint32_t pt = apoly_in.vertices[j];
-	tmp = newcloud.points[pt].getVector4fMap ();
-	// x,y,z
-	apoly.vertices_[3*j + 0] = tmp (0);
-	apoly.vertices_[3*j + 1] = tmp (1);
-	apoly.vertices_[3*j + 2] = tmp (2);
-	// r,g,b: input is ints 0->255, opengl wants floats 0->1
-	apoly.colors_[4*j + 0] = newcloud.points[pt].r/255.0f; // Red
-	apoly.colors_[4*j + 1] = newcloud.points[pt].g/255.0f; // Green
-	apoly.colors_[4*j + 2] = newcloud.points[pt].b/255.0f; // Blue
-	apoly.colors_[4*j + 3] = 1.0f; // transparancy? unnecessary?
+        const pcl::PointXYZRGB& pt = newcloud.points[apoly_in.vertices[j]];
+        // r,g,b: input is ints 0->255, opengl wants floats 0->1
+        vertices.push_back (Vertex (Eigen::Vector3f (pt.x, pt.y, pt.z),
+                                    Eigen::Vector3f (pt.r/255.0f,
+                                                     pt.g/255.0f,
+                                                     pt.b/255.0f)));
       }
-      polygons.push_back (apoly);
     }
   }
   else
   {
     pcl::PointCloud<pcl::PointXYZ> newcloud;  
     pcl::fromPCLPointCloud2 (plg->cloud, newcloud);
-    Eigen::Vector4f tmp;
     for(size_t i=0; i< plg->polygons.size (); i++)
     { // each triangle/polygon
-      pcl::Vertices apoly_in = plg->polygons[i];
-      SinglePoly apoly;
-      apoly.nvertices_ = apoly_in.vertices.size ();
-      apoly.vertices_ = new float [3*apoly_in.vertices.size ()];
-      apoly.colors_ = new float [4*apoly_in.vertices.size ()];
+      const pcl::Vertices& apoly_in = plg->polygons[i];
+      first_.push_back (static_cast<GLint> (vertices.size ()));
+      count_.push_back (static_cast<GLsizei> (apoly_in.vertices.size ()));
 
       for(size_t j=0; j< apoly_in.vertices.size (); j++)
       { // each point
-	uint32_t pt = apoly_in.vertices[j];
-	tmp = newcloud.points[pt].getVector4fMap ();
-	// x,y,z
-	apoly.vertices_[3*j + 0] = tmp (0);
-	apoly.vertices_[3*j + 1] = tmp (1);
-	apoly.vertices_[3*j + 2] = tmp (2);
-	// r,g,b: input is ints 0->255, opengl wants floats 0->1
-	apoly.colors_[4*j + 0] = 1.0f; // Red
-	apoly.colors_[4*j + 1] = 0.0f; // Green
-	apoly.colors_[4*j + 2] = 0.0f; // Blue
-	apoly.colors_[4*j + 3] = 1.0;
+        const pcl::PointXYZ& pt = newcloud.points[apoly_in.vertices[j]];
+        vertices.push_back (Vertex (Eigen::Vector3f (pt.x, pt.y, pt.z),
+                                    Eigen::Vector3f (1.0f, 0.0f, 0.0f)));
       }
-      polygons.push_back (apoly);
     }
   }
+
+  glGenBuffers (1, &vbo_);
+  glBindBuffer (GL_ARRAY_BUFFER, vbo_);
+  if (!vertices.empty ())
+    glBufferData (GL_ARRAY_BUFFER, vertices.size () * sizeof (vertices[0]), &(vertices[0]), GL_STATIC_DRAW);
+  glBindBuffer (GL_ARRAY_BUFFER, 0);
 }
 
 pcl::simulation::PolygonMeshModel::~PolygonMeshModel ()
 {
-  // TODO: memory management!
-  for (size_t i = 0; i < polygons.size (); ++i)
-  {
-    delete [] polygons[i].vertices_;
-    delete [] polygons[i].colors_;
-  }
+  if (glIsBuffer (vbo_) == GL_TRUE)
+    glDeleteBuffers (1, &vbo_);
 }
 
 void
 pcl::simulation::PolygonMeshModel::draw ()
 {
-  // This might be a little quicker than drawing using individual polygons
-  // TODO: test by how much
   glEnable (GL_DEPTH_TEST);
   glEnableClientState (GL_VERTEX_ARRAY);
   glEnableClientState (GL_COLOR_ARRAY);
+  glBindBuffer (GL_ARRAY_BUFFER, vbo_);
 
-  for (size_t i = 0; i < polygons.size (); i++)
-  {
-    glVertexPointer (3, GL_FLOAT, 0, polygons[i].vertices_);
-    glColorPointer (4, GL_FLOAT, 0, polygons[i].colors_);
-    glDrawArrays (mode_, 0, polygons[i].nvertices_);
-  }
+  glVertexPointer (3, GL_FLOAT, sizeof (Vertex), 0);
+  glColorPointer (3, GL_FLOAT, sizeof (Vertex), reinterpret_cast<GLvoid*> (12));
+
+  for (size_t i = 0; i < first_.size (); i++)
+    glDrawArrays (mode_, first_[i], count_[i]);
+
+  glBindBuffer (GL_ARRAY_BUFFER, 0);
   glDisableClientState (GL_COLOR_ARRAY);
   glDisableClientState (GL_VERTEX_ARRAY);
 }
 
+pcl::simulation::TransformedModel::TransformedModel (const Model::Ptr& model,
+                                                     const Eigen::Matrix4f& transform)
+  : model_ (model), transform_ (transform)
+{
+}
+
+void
+pcl::simulation::TransformedModel::draw ()
+{
+  // Eigen matrices are column major, which is what OpenGL expects.
+  glMatrixMode (GL_MODELVIEW);
+  glPushMatrix ();
+  glMultMatrixf (transform_.data ());
+  model_->draw ();
+  glPopMatrix ();
+}
+
 pcl::simulation::PointCloudModel::PointCloudModel (GLenum mode, pcl::PointCloud<pcl::PointXYZRGB>::Ptr pc) : mode_ (mode)
 {
   nvertices_ = pc->points.size ();
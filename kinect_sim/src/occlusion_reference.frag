@@ -0,0 +1,33 @@
+#version 130
+
+// Loads a millimetre depth image (top-down, as returned by
+// RangeLikelihood::getDepthBufferMillimeters) into the depth buffer for
+// RangeLikelihood::countOccludingPixels. A fragment drawn afterwards passes
+// a GL_LESS test only where it is more than 1 mm in front of the reference,
+// so it also rounds to fewer millimetres however the float depths of the
+// two passes round. Fragments that round to exactly 1 mm less can be
+// missed, which errs on the side of keeping a successor. Pixels without a
+// return get depth 0, so nothing passes there.
+
+uniform usampler2D ReferenceSampler;
+
+uniform int row_height;
+uniform int max_depth;
+uniform float near;
+uniform float far;
+
+void main()
+{
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  int mm = int(texelFetch(ReferenceSampler, ivec2(p.x, row_height - 1 - p.y), 0).r);
+
+  if (mm >= max_depth)
+  {
+    gl_FragDepth = 0.0;
+    return;
+  }
+
+  // Half a millimetre of margin below the smallest range that rounds to mm.
+  float z = (float(mm) - 1.0) / 1000.0;
+  gl_FragDepth = far / (far - near) - far * near / ((far - near) * z);
+}
@@ -0,0 +1,106 @@
+#version 130
+#extension GL_ARB_explicit_attrib_location : enable
+#extension GL_ARB_explicit_uniform_location : enable
+
+// Per pixel "unexplained point" tests of the PERCH cost, evaluated on the
+// first tile of the last render. A point is explained if a point of the
+// other image lies within radius of it. Every point of an image sits on its
+// own pixel, so only a window of pixels around the point can be within
+// radius and the test is a small window search instead of a KdTree query.
+//
+// Red: child points on pixels without a reference (parent) return.
+// Green, blue, alpha: observed points on pixels with mask value 1, 2, 3.
+//
+// Rendered depth is the bottom-up window depth; the other images are one
+// tile of top-down millimetres. The child image is the render composited
+// with the reference, so the render may hold only the objects that the
+// reference is missing.
+
+in vec2 TexCoord0;
+
+layout(location = 0) out vec4 FragColor;
+
+uniform sampler2D DepthSampler;
+uniform usampler2D ObservedSampler;
+uniform usampler2D ReferenceSampler;
+uniform usampler2D MaskSampler;
+
+uniform int row_height;
+uniform int col_width;
+uniform int max_depth;
+uniform int max_window;
+uniform float near;
+uniform float far;
+uniform float fx;
+uniform float fy;
+uniform float cx;
+uniform float cy;
+uniform float radius;
+
+int renderedMm(ivec2 p)
+{
+  float d = texelFetch(DepthSampler, p, 0).r;
+  float z = -far * near / ((far - near) * (d - far / (far - near)));
+  return int(clamp(floor(1000.0 * z + 0.5), 0.0, 65535.0));
+}
+
+int topDown(usampler2D sampler, ivec2 p)
+{
+  return int(texelFetch(sampler, ivec2(p.x, row_height - 1 - p.y), 0).r);
+}
+
+int childMm(ivec2 p)
+{
+  return min(renderedMm(p), topDown(ReferenceSampler, p));
+}
+
+// Camera frame point, as RangeLikelihood::getGlobalPoint before the pose.
+vec3 backProject(ivec2 p, int mm)
+{
+  float z = float(mm) / 1000.0;
+  return vec3((float(p.x) - cx) * z / fx, (float(p.y) - cy) * z / fy, z);
+}
+
+bool isExplained(ivec2 p, int mm, bool by_observed)
+{
+  vec3 point = backProject(p, mm);
+  float z = max(point.z - radius, near);
+  int window = min(max_window, int(ceil(radius * max(fx, fy) / z)));
+  float radius_sq = radius * radius;
+
+  for (int y = max(p.y - window, 0); y <= min(p.y + window, row_height - 1); ++y)
+  {
+    for (int x = max(p.x - window, 0); x <= min(p.x + window, col_width - 1); ++x)
+    {
+      ivec2 q = ivec2(x, y);
+      int other = by_observed ? topDown(ObservedSampler, q) : childMm(q);
+      if (other >= max_depth)
+        continue;
+
+      vec3 d = backProject(q, other) - point;
+      if (dot(d, d) <= radius_sq)
+        return true;
+    }
+  }
+
+  return false;
+}
+
+void main()
+{
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  vec4 unexplained = vec4(0.0);
+
+  int rendered = childMm(p);
+  if (rendered < max_depth && topDown(ReferenceSampler, p) == max_depth &&
+      !isExplained(p, rendered, true))
+    unexplained.r = 1.0;
+
+  int observed = topDown(ObservedSampler, p);
+  int mask = topDown(MaskSampler, p);
+  if (observed < max_depth && mask > 0 && mask < 4 &&
+      !isExplained(p, observed, false))
+    unexplained[mask] = 1.0;
+
+  FragColor = unexplained;
+}
@@ -1,5 +1,12 @@
 #include <GL/glew.h>
 #include <time.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #include <pcl/pcl_config.h>
 #ifdef OPENGL_IS_A_FRAMEWORK
@@ -28,6 +35,15 @@ const string kComputeScoreVertFile =  ros::package::getPath("kinect_sim") +
                                       "/src/compute_score.vert";
 const string kComputeScoreFragFile =  ros::package::getPath("kinect_sim") +
                                       "/src/compute_score.frag";
+const string kDepthToMmFragFile =  ros::package::getPath("kinect_sim") +
+                                   "/src/depth_to_mm.frag";
+const string kPerchScoreFragFile =  ros::package::getPath("kinect_sim") +
+                                    "/src/perch_score.frag";
+// Largest neighbour search window (in pixels from the center) of the PERCH
+// scoring pass.
+const int kMaxScoreWindow = 8;
+const string kOcclusionReferenceFragFile =  ros::package::getPath("kinect_sim") +
+                                            "/src/occlusion_reference.frag";
 
 // 301 values, 0.0 uniform  1.0 normal. properly truncated/normalized
 float normal_sigma0x5_normal1x0_range0to3_step0x01[] = {1.59576912f, 1.59545000f, 1.59449302f, 1.59289932f, 1.59067083f,
@@ -154,31 +170,46 @@ display_tic_toc (vector<double> &tic_toc, const string &fun_name) {
 }
 
 pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
-                                                   int row_height, int col_width, Scene::Ptr scene) :
+                                                   int row_height, int col_width, Scene::Ptr scene,
+                                                   bool use_software_rasterizer) :
   scene_(scene), rows_(rows), cols_(cols), row_height_(row_height),
   col_width_(col_width),
+  num_readback_buffers_ (2),
+  next_readback_buffer_ (0),
+  use_scissor_ (false),
   depth_buffer_dirty_(true),
+  depth_mm_buffer_dirty_(true),
   color_buffer_dirty_(true),
   score_buffer_dirty_(true),
   fbo_ (0),
+  score_fbo_ (0),
   depth_render_buffer_ (0),
   color_render_buffer_ (0),
+  color_texture_ (0),
   depth_texture_ (0),
   score_texture_ (0),
   score_summarized_texture_ (0),
   sensor_texture_ (0),
   likelihood_texture_ (0),
+  depth_mm_texture_ (0),
+  depth_mm_fbo_ (0),
+  occlusion_reference_texture_ (0),
+  occlusion_query_ (0),
+  observed_texture_ (0),
+  observed_mask_texture_ (0),
+  statistics_fbo_ (0),
+  statistics_texture_ (0),
   compute_likelihood_on_cpu_ (false),
   aggregate_on_cpu_ (false),
   use_instancing_ (false),
   use_color_ (true),
-  sum_reduce_ (cols *col_width, rows *row_height, max_level (col_width,
-                                                             row_height)) {
+  quad_vbo_ (0) {
   height_ = rows_ * row_height;
   width_ = cols_ * col_width;
 
   depth_buffer_ = new float[width_ * height_];
   color_buffer_ = new uint8_t[width_ * height_ * 3];
+  depth_mm_buffer_ = new unsigned short[width_ * height_];
 
   // Set Default Camera Intrinstic Parameters. techquad
   // Correspond closely to those stated here:
@@ -207,6 +238,21 @@ pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
   assert (height > 0 && height <= 8192 && width > 0 && width <= 8192);
   // throw std::runtime_error "
 
+  score_buffer_ = new float[width_ * height_];
+
+  if (use_software_rasterizer) {
+    software_rasterizer_.reset (new SoftwareRasterizer (rows, cols, row_height,
+                                                        col_width));
+  } else {
+    initializeGL ();
+  }
+}
+
+void
+pcl::simulation::RangeLikelihood::initializeGL () {
+  int height = height_;
+  int width = width_;
+
   // Allocate framebuffer
   glGenRenderbuffers (1, &depth_render_buffer_);
   glBindRenderbuffer (GL_RENDERBUFFER, depth_render_buffer_);
@@ -252,7 +298,7 @@ pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
   glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
   glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
   glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-  glTexImage2D (GL_TEXTURE_2D, 0, GL_R32F, col_width, row_height, 0, GL_RED,
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_R32F, col_width_, row_height_, 0, GL_RED,
                 GL_FLOAT, NULL);
   glBindTexture (GL_TEXTURE_2D, 0);
 
@@ -329,6 +375,121 @@ pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
 
   likelihood_program_->link ();
 
+  // Integer target for the depth in millimetres, read back as 16 bits.
+  glGenTextures (1, &depth_mm_texture_);
+  glBindTexture (GL_TEXTURE_2D, depth_mm_texture_);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_R16UI, width_, height_, 0, GL_RED_INTEGER,
+                GL_UNSIGNED_SHORT, NULL);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  glGenFramebuffers (1, &depth_mm_fbo_);
+  glBindFramebuffer (GL_FRAMEBUFFER, depth_mm_fbo_);
+  glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                          depth_mm_texture_, 0);
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+
+  depth_mm_program_ = gllib::Program::Ptr (new gllib::Program ());
+
+  if (!depth_mm_program_->addShaderFile (kComputeScoreVertFile.c_str(),
+                                         gllib::VERTEX)) {
+    std::cout << "Failed loading vertex shader" << std::endl;
+    exit (-1);
+  }
+
+  if (!depth_mm_program_->addShaderFile (kDepthToMmFragFile.c_str(),
+                                         gllib::FRAGMENT)) {
+    std::cout << "Failed loading fragment shader" << std::endl;
+    exit (-1);
+  }
+
+  depth_mm_program_->link ();
+
+  // Millimetre depth image of countOccludingPixels (), one tile large.
+  glGenTextures (1, &occlusion_reference_texture_);
+  glBindTexture (GL_TEXTURE_2D, occlusion_reference_texture_);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_R16UI, col_width_, row_height_, 0,
+                GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  glGenQueries (1, &occlusion_query_);
+
+  // Observed depth and mask of the PERCH scoring pass, one tile large.
+  glGenTextures (1, &observed_texture_);
+  glBindTexture (GL_TEXTURE_2D, observed_texture_);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_R16UI, col_width_, row_height_, 0,
+                GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+
+  glGenTextures (1, &observed_mask_texture_);
+  glBindTexture (GL_TEXTURE_2D, observed_mask_texture_);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_R8UI, col_width_, row_height_, 0,
+                GL_RED_INTEGER, GL_UNSIGNED_BYTE, NULL);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  perch_score_program_ = gllib::Program::Ptr (new gllib::Program ());
+
+  if (!perch_score_program_->addShaderFile (kComputeScoreVertFile.c_str(),
+                                            gllib::VERTEX)) {
+    std::cout << "Failed loading vertex shader" << std::endl;
+    exit (-1);
+  }
+
+  if (!perch_score_program_->addShaderFile (kPerchScoreFragFile.c_str(),
+                                            gllib::FRAGMENT)) {
+    std::cout << "Failed loading fragment shader" << std::endl;
+    exit (-1);
+  }
+
+  perch_score_program_->link ();
+
+  // Four statistics per pixel, see countUnexplainedPoints ().
+  glGenTextures (1, &statistics_texture_);
+  glBindTexture (GL_TEXTURE_2D, statistics_texture_);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA32F, width_, height_, 0, GL_RGBA,
+                GL_FLOAT, NULL);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  glGenFramebuffers (1, &statistics_fbo_);
+  glBindFramebuffer (GL_FRAMEBUFFER, statistics_fbo_);
+  glFramebufferTexture2D (GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                          statistics_texture_, 0);
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+
+  occlusion_reference_program_ = gllib::Program::Ptr (new gllib::Program ());
+
+  if (!occlusion_reference_program_->addShaderFile (kComputeScoreVertFile.c_str(),
+                                                    gllib::VERTEX)) {
+    std::cout << "Failed loading vertex shader" << std::endl;
+    exit (-1);
+  }
+
+  if (!occlusion_reference_program_->addShaderFile (
+        kOcclusionReferenceFragFile.c_str(), gllib::FRAGMENT)) {
+    std::cout << "Failed loading fragment shader" << std::endl;
+    exit (-1);
+  }
+
+  occlusion_reference_program_->link ();
+
   vertices_.push_back (Eigen::Vector3f (-1.0,  1.0, 0.0));
   vertices_.push_back (Eigen::Vector3f ( 1.0,  1.0, 0.0));
   vertices_.push_back (Eigen::Vector3f ( 1.0, -1.0, 0.0));
@@ -340,30 +501,52 @@ pcl::simulation::RangeLikelihood::RangeLikelihood (int rows, int cols,
                 &(vertices_[0]), GL_STATIC_DRAW);
   glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+  quad_.reset (new Quad ());
+  sum_reduce_.reset (new SumReduce (width_, height_,
+                                    max_level (col_width_, row_height_)));
+  statistics_reduce_.reset (new Reduce (width_, height_,
+                                        max_level (col_width_, row_height_), 4));
+
   gllib::getGLError ();
 
   // Go back to the default pipeline
   glUseProgram (0);
-
-  score_buffer_ = new float[width_ * height_];
-
 }
 
 pcl::simulation::RangeLikelihood::~RangeLikelihood () {
-  glDeleteBuffers (1, &quad_vbo_);
-  glDeleteTextures (1, &depth_texture_);
-  glDeleteTextures (1, &color_texture_);
-  glDeleteTextures (1, &score_texture_);
-  glDeleteTextures (1, &score_summarized_texture_);
-  glDeleteTextures (1, &sensor_texture_);
-  glDeleteTextures (1, &likelihood_texture_);
-  glDeleteFramebuffers (1, &fbo_);
-  glDeleteFramebuffers (1, &score_fbo_);
-  glDeleteRenderbuffers (1, &depth_render_buffer_);
-  glDeleteRenderbuffers (1, &color_render_buffer_);
+  if (!software_rasterizer_) {
+    quad_.reset ();
+    sum_reduce_.reset ();
+    statistics_reduce_.reset ();
+    glDeleteBuffers (1, &quad_vbo_);
+    glDeleteTextures (1, &depth_texture_);
+    glDeleteTextures (1, &color_texture_);
+    glDeleteTextures (1, &score_texture_);
+    glDeleteTextures (1, &score_summarized_texture_);
+    glDeleteTextures (1, &sensor_texture_);
+    glDeleteTextures (1, &likelihood_texture_);
+    glDeleteTextures (1, &depth_mm_texture_);
+    glDeleteTextures (1, &occlusion_reference_texture_);
+    glDeleteQueries (1, &occlusion_query_);
+    glDeleteTextures (1, &observed_texture_);
+    glDeleteTextures (1, &observed_mask_texture_);
+    glDeleteTextures (1, &statistics_texture_);
+    glDeleteFramebuffers (1, &statistics_fbo_);
+    glDeleteFramebuffers (1, &fbo_);
+    glDeleteFramebuffers (1, &depth_mm_fbo_);
+    glDeleteFramebuffers (1, &score_fbo_);
+    glDeleteRenderbuffers (1, &depth_render_buffer_);
+    glDeleteRenderbuffers (1, &color_render_buffer_);
+
+    if (!readback_pbos_.empty ()) {
+      glDeleteBuffers (static_cast<GLsizei> (readback_pbos_.size ()),
+                       &readback_pbos_[0]);
+    }
+  }
 
   delete [] depth_buffer_;
   delete [] color_buffer_;
+  delete [] depth_mm_buffer_;
   delete [] score_buffer_;
 }
 
@@ -375,11 +558,8 @@ pcl::simulation::RangeLikelihood::sampleNormal (double sigma) {
   return (norm ());
 }
 
-void
-pcl::simulation::RangeLikelihood::setupProjectionMatrix () {
-  glMatrixMode (GL_PROJECTION);
-  glLoadIdentity ();
-
+Eigen::Matrix4f
+pcl::simulation::RangeLikelihood::getProjectionMatrix () const {
   // Prepare scaled simulated camera projection matrix
   float sx = static_cast<float> (camera_width_) / static_cast<float>
              (col_width_);
@@ -392,26 +572,39 @@ pcl::simulation::RangeLikelihood::setupProjectionMatrix () {
   float fy = camera_fy_ / sy;
   float cx = camera_cx_ / sx;
   float cy = camera_cy_ / sy;
-  float m[16];
   float z_nf = (z_near_ - z_far_);
 
-  m[0] = 2.0f * fx / width;
-  m[4] = 0;
-  m[ 8] = 1.0f - (2 * cx / width);
-  m[12] = 0;
-  m[1] = 0;
-  m[5] = 2.0f * fy / height;
-  m[ 9] = 1.0f - (2 * cy / height);
-  m[13] = 0;
-  m[2] = 0;
-  m[6] = 0;
-  m[10] = (z_far_ + z_near_) / z_nf;
-  m[14] = 2.0f * z_near_ * z_far_ / z_nf;
-  m[3] = 0;
-  m[7] = 0;
-  m[11] = -1.0f;
-  m[15] = 0;
-  glMultMatrixf (m);
+  Eigen::Matrix4f m = Eigen::Matrix4f::Zero ();
+  m(0, 0) = 2.0f * fx / width;
+  m(0, 2) = 1.0f - (2 * cx / width);
+  m(1, 1) = 2.0f * fy / height;
+  m(1, 2) = 1.0f - (2 * cy / height);
+  m(2, 2) = (z_far_ + z_near_) / z_nf;
+  m(2, 3) = 2.0f * z_near_ * z_far_ / z_nf;
+  m(3, 2) = -1.0f;
+  return m;
+}
+
+Eigen::Matrix4f
+pcl::simulation::RangeLikelihood::getViewMatrix (const Eigen::Isometry3d &pose) {
+  // Go from Z-up, X-forward coordinate frame
+  // to OpenGL Z-out,Y-up [both Right Handed]
+  Eigen::Matrix4d T;
+  T <<  0, -1, 0, 0,
+        0,  0, 1, 0,
+       -1,  0, 0, 0,
+        0,  0, 0, 1;
+  return (T * pose.matrix ().inverse ()).cast<float> ();
+}
+
+void
+pcl::simulation::RangeLikelihood::setupProjectionMatrix () {
+  glMatrixMode (GL_PROJECTION);
+  glLoadIdentity ();
+
+  // Eigen matrices are column major like OpenGL
+  Eigen::Matrix4f m = getProjectionMatrix ();
+  glMultMatrixf (m.data ());
 }
 
 void
@@ -439,44 +632,49 @@ pcl::simulation::RangeLikelihood::applyCameraTransform (
 }
 
 void
-pcl::simulation::RangeLikelihood::drawParticles (
+pcl::simulation::RangeLikelihood::drawParticles (const
   std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
-  poses) {
+  &poses,
+  const std::vector<Scene::Ptr> &scenes) {
   int n = 0;
 
   for (int i = 0; i < rows_; ++i) {
     for (int j = 0; j < cols_; ++j) {
+      // Tiles without a pose are left cleared.
+      if (n >= static_cast<int> (poses.size ())) {
+        return;
+      }
+
       glMatrixMode (GL_MODELVIEW);
       glLoadIdentity ();
 
+      if (!tile_scissors_.empty ()) {
+        const int *scissor = &tile_scissors_[4 * n];
+
+        if (scissor[2] <= 0 || scissor[3] <= 0) {
+          ++n;
+          continue;
+        }
+
+        glScissor (scissor[0], scissor[1], scissor[2], scissor[3]);
+        glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      }
+
       glViewport(j * col_width_, i * row_height_, col_width_, row_height_);
 
-      // Go from Z-up, X-forward coordinate frame
-      // to OpenGL Z-out,Y-up [both Right Handed]
-      float T[16];
-      T[0] =  0;
-      T[4] = -1.0;
-      T[8] =  0;
-      T[12] = 0;
-      T[1] =  0;
-      T[5] = 0;
-      T[9] =  1;
-      T[13] = 0;
-      T[2] = -1.0;
-      T[6] = 0;
-      T[10] = 0;
-      T[14] = 0;
-      T[3] =  0;
-      T[7] = 0;
-      T[11] = 0;
-      T[15] = 1;
-      glMultMatrixf (T);
-
-      // Apply camera transformation
-      applyCameraTransform (poses[n++]);
+      // Camera transformation, including the change from the Z-up,
+      // X-forward frame to OpenGL's Z-out, Y-up frame.
+      Eigen::Matrix4f view = getViewMatrix (poses[n]);
+      glMultMatrixf (view.data ());
 
       // Draw the planes in each location:
-      scene_->draw ();
+      if (scenes.empty ()) {
+        scene_->draw ();
+      } else if (scenes[n]) {
+        scenes[n]->draw ();
+      }
+
+      ++n;
     }
   }
 }
@@ -1235,39 +1433,34 @@ RangeLikelihood::computeLikelihoods (float *reference,
 #endif
   // The depth image is now in depth_texture_
 
-  // Compute likelihoods
-  if (compute_likelihood_on_cpu_) {
+  // Compute likelihoods, the software rasterizer has no score shader.
+  if (compute_likelihood_on_cpu_ || software_rasterizer_) {
     computeScores (reference, scores);
   } else {
     computeScoresShader (reference);
 
     // Aggregate results (we do not use GPU to sum cpu scores)
-    if (aggregate_on_cpu_) {
-      const float *score_buffer = getScoreBuffer();
+    int levels = max_level (row_height_, col_width_);
+    int reduced_width = width_ >> levels;
+    int reduced_height = height_ >> levels;
+    int reduced_col_width = col_width_ >> levels;
+    int reduced_row_height = row_height_ >> levels;
 
-      for (int n = 0, row = 0; row < height_; ++row) {
-        for (int col = 0; col < width_; ++col, ++n) {
-          scores[row / row_height_ * cols_ + col / col_width_] += score_buffer[n];
-        }
-      }
+    std::vector<float> score_sum (reduced_width * reduced_height);
+
+    if (aggregate_on_cpu_) {
+      Reduce::reduce (getScoreBuffer (), width_, height_, levels, 1,
+                      std::vector<Reduce::Operation> (1, Reduce::SUM),
+                      &score_sum[0]);
     } else {
-      int levels = max_level (row_height_, col_width_);
-      int reduced_width = width_ >> levels;
-      int reduced_height = height_ >> levels;
-      int reduced_col_width = col_width_ >> levels;
-      int reduced_row_height = row_height_ >> levels;
-
-      float *score_sum = new float[reduced_width * reduced_height];
-      sum_reduce_.sum (score_texture_, score_sum);
-
-      for (int n = 0, row = 0; row < reduced_height; ++row) {
-        for (int col = 0; col < reduced_width; ++col, ++n) {
-          scores[row / reduced_row_height * cols_ + col / reduced_col_width] +=
-            score_sum[n];
-        }
-      }
+      sum_reduce_->sum (score_texture_, &score_sum[0]);
+    }
 
-      delete [] score_sum;
+    for (int n = 0, row = 0; row < reduced_height; ++row) {
+      for (int col = 0; col < reduced_width; ++col, ++n) {
+        scores[row / reduced_row_height * cols_ + col / reduced_col_width] +=
+          score_sum[n];
+      }
     }
   }
 
@@ -1338,7 +1531,7 @@ pcl::simulation::RangeLikelihood::computeScoresShader (float *reference) {
   glActiveTexture (GL_TEXTURE2);
   glBindTexture (GL_TEXTURE_2D, likelihood_texture_);
 
-  quad_.render ();
+  quad_->render ();
   glUseProgram (0);
 
   glBindFramebuffer (GL_FRAMEBUFFER, 0);
@@ -1362,10 +1555,474 @@ pcl::simulation::RangeLikelihood::computeScoresShader (float *reference) {
 
 }
 
+void
+RangeLikelihood::renderScenes (const std::vector<Scene::Ptr> &scenes,
+                               const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+                               &poses) {
+  assert (scenes.size () == poses.size ());
+  assert (static_cast<int> (scenes.size ()) <= rows_ * cols_);
+  render (poses, scenes);
+}
+
+void
+RangeLikelihood::renderScenes (const std::vector<Scene::Ptr> &scenes,
+                               const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+                               &poses,
+                               const std::vector<int> &rois) {
+  assert (rois.size () == 4 * poses.size ());
+  tile_scissors_.resize (rois.size ());
+
+  for (size_t n = 0; n < poses.size (); ++n) {
+    const int *roi = &rois[4 * n];
+    const int i = static_cast<int> (n) / cols_;
+    const int j = static_cast<int> (n) % cols_;
+    assert (roi[0] >= 0 && roi[1] >= 0 && roi[0] + roi[2] <= col_width_ &&
+            roi[1] + roi[3] <= row_height_);
+    tile_scissors_[4 * n] = j * col_width_ + roi[0];
+    tile_scissors_[4 * n + 1] = i * row_height_ + row_height_ - roi[1] - roi[3];
+    tile_scissors_[4 * n + 2] = roi[2];
+    tile_scissors_[4 * n + 3] = roi[3];
+  }
+
+  renderScenes (scenes, poses);
+  tile_scissors_.clear ();
+}
+
+void
+RangeLikelihood::renderPose (const Eigen::Isometry3d &pose) {
+  single_pose_.resize (1);
+  single_pose_[0] = pose;
+  render (single_pose_);
+}
+
+void
+RangeLikelihood::renderPose (const Eigen::Isometry3d &pose, int x, int y,
+                             int width, int height) {
+  assert (x >= 0 && y >= 0 && x + width <= col_width_ && y + height <= row_height_);
+  use_scissor_ = true;
+  scissor_[0] = x;
+  scissor_[1] = row_height_ - y - height;
+  scissor_[2] = width;
+  scissor_[3] = height;
+  renderPose (pose);
+  use_scissor_ = false;
+}
+
+void
+RangeLikelihood::setOcclusionReference (const unsigned short *depth_mm) {
+  if (software_rasterizer_) {
+    occlusion_reference_.assign (depth_mm, depth_mm + col_width_ * row_height_);
+    return;
+  }
+
+  GLint old_alignment;
+  glGetIntegerv (GL_UNPACK_ALIGNMENT, &old_alignment);
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 2);
+
+  glBindTexture (GL_TEXTURE_2D, occlusion_reference_texture_);
+  glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, col_width_, row_height_,
+                   GL_RED_INTEGER, GL_UNSIGNED_SHORT, depth_mm);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  glPixelStorei (GL_UNPACK_ALIGNMENT, old_alignment);
+}
+
+int
+RangeLikelihood::countOccludingPixels (const Scene::Ptr &scene,
+                                       const Eigen::Isometry3d &pose) {
+  int x, y, width, height;
+
+  if (!getScreenBoundingBox (*scene, pose, x, y, width, height)) {
+    x = 0;
+    y = 0;
+    width = col_width_;
+    height = row_height_;
+  }
+
+  if (width <= 0 || height <= 0) {
+    return 0;
+  }
+
+  const unsigned short max_depth_mm = static_cast<unsigned short> (1000.0f *
+                                                                   z_far_ + 0.5f);
+
+  if (software_rasterizer_) {
+    assert (occlusion_reference_.size () ==
+            static_cast<size_t> (col_width_ * row_height_));
+    single_pose_.resize (1);
+    single_pose_[0] = pose;
+    render (single_pose_, std::vector<Scene::Ptr> (1, scene));
+
+    tile_depth_mm_.resize (width * height);
+    convertDepthToMillimetersCPU (depth_buffer_, x, y, width, height,
+                                  &tile_depth_mm_[0]);
+    int count = 0;
+
+    for (int v = 0; v < height; ++v) {
+      const unsigned short *reference = &occlusion_reference_[(y + v) *
+                                                              col_width_ + x];
+      const unsigned short *depth = &tile_depth_mm_[v * width];
+
+      for (int u = 0; u < width; ++u) {
+        count += reference[u] != max_depth_mm && depth[u] < reference[u];
+      }
+    }
+
+    return count;
+  }
+
+  GLint old_matrix_mode;
+  GLint old_draw_buffer;
+  GLint old_read_buffer;
+  glGetIntegerv (GL_DRAW_BUFFER, &old_draw_buffer);
+  glGetIntegerv (GL_READ_BUFFER, &old_read_buffer);
+  glGetIntegerv (GL_MATRIX_MODE, &old_matrix_mode);
+
+  glMatrixMode (GL_PROJECTION);
+  glPushMatrix ();
+  glMatrixMode (GL_MODELVIEW);
+  glPushMatrix ();
+
+  glBindFramebuffer (GL_FRAMEBUFFER, fbo_);
+  glDrawBuffer (GL_NONE);
+  glReadBuffer (GL_NONE);
+
+  glPushAttrib (GL_ALL_ATTRIB_BITS);
+  glViewport (0, 0, col_width_, row_height_);
+  glEnable (GL_SCISSOR_TEST);
+  glScissor (x, row_height_ - y - height, width, height);
+  glEnable (GL_DEPTH_TEST);
+
+  // Load the reference as window depths
+  glDepthFunc (GL_ALWAYS);
+  glDepthMask (GL_TRUE);
+  occlusion_reference_program_->use ();
+  occlusion_reference_program_->setUniform ("ReferenceSampler", 0);
+  occlusion_reference_program_->setUniform ("row_height", row_height_);
+  occlusion_reference_program_->setUniform ("max_depth",
+                                            static_cast<int> (max_depth_mm));
+  occlusion_reference_program_->setUniform ("near", z_near_);
+  occlusion_reference_program_->setUniform ("far", z_far_);
+  glActiveTexture (GL_TEXTURE0);
+  glBindTexture (GL_TEXTURE_2D, occlusion_reference_texture_);
+  quad_->render ();
+  glBindTexture (GL_TEXTURE_2D, 0);
+  glUseProgram (0);
+
+  // Count the fragments of scene in front of it
+  glDepthFunc (GL_LESS);
+  glDepthMask (GL_FALSE);
+  setupProjectionMatrix ();
+  glMatrixMode (GL_MODELVIEW);
+  glLoadIdentity ();
+  Eigen::Matrix4f view = getViewMatrix (pose);
+  glMultMatrixf (view.data ());
+
+  glBeginQuery (GL_SAMPLES_PASSED, occlusion_query_);
+  scene->draw ();
+  glEndQuery (GL_SAMPLES_PASSED);
+
+  GLuint count = 0;
+  glGetQueryObjectuiv (occlusion_query_, GL_QUERY_RESULT, &count);
+
+  glPopAttrib ();
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+
+  glReadBuffer (old_read_buffer);
+  glDrawBuffer (old_draw_buffer);
+
+  glMatrixMode (GL_MODELVIEW);
+  glPopMatrix ();
+  glMatrixMode (GL_PROJECTION);
+  glPopMatrix ();
+  glMatrixMode (old_matrix_mode);
+
+  if (gllib::getGLError () != GL_NO_ERROR) {
+    std::cerr << "GL Error: RangeLikelihood::countOccludingPixels" << std::endl;
+  }
+
+  depth_buffer_dirty_ = true;
+  depth_mm_buffer_dirty_ = true;
+  score_buffer_dirty_ = true;
+  return static_cast<int> (count);
+}
+
+void
+RangeLikelihood::setObservedDepth (const unsigned short *depth_mm) {
+  if (software_rasterizer_) {
+    observed_depth_.assign (depth_mm, depth_mm + col_width_ * row_height_);
+    return;
+  }
+
+  GLint old_alignment;
+  glGetIntegerv (GL_UNPACK_ALIGNMENT, &old_alignment);
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 2);
+
+  glBindTexture (GL_TEXTURE_2D, observed_texture_);
+  glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, col_width_, row_height_,
+                   GL_RED_INTEGER, GL_UNSIGNED_SHORT, depth_mm);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  glPixelStorei (GL_UNPACK_ALIGNMENT, old_alignment);
+}
+
+void
+RangeLikelihood::setObservedMask (const uint8_t *mask) {
+  if (software_rasterizer_) {
+    observed_mask_.assign (mask, mask + col_width_ * row_height_);
+    return;
+  }
+
+  GLint old_alignment;
+  glGetIntegerv (GL_UNPACK_ALIGNMENT, &old_alignment);
+  glPixelStorei (GL_UNPACK_ALIGNMENT, 1);
+
+  glBindTexture (GL_TEXTURE_2D, observed_mask_texture_);
+  glTexSubImage2D (GL_TEXTURE_2D, 0, 0, 0, col_width_, row_height_,
+                   GL_RED_INTEGER, GL_UNSIGNED_BYTE, mask);
+  glBindTexture (GL_TEXTURE_2D, 0);
+
+  glPixelStorei (GL_UNPACK_ALIGNMENT, old_alignment);
+}
+
+void
+RangeLikelihood::countUnexplainedPoints (float radius, float counts[4]) {
+  if (software_rasterizer_) {
+    countUnexplainedPointsCPU (radius, counts);
+    return;
+  }
+
+  const int max_depth_mm = static_cast<int> (1000.0f * z_far_ + 0.5f);
+
+  perch_score_program_->use ();
+  perch_score_program_->setUniform ("DepthSampler", 0);
+  perch_score_program_->setUniform ("ObservedSampler", 1);
+  perch_score_program_->setUniform ("ReferenceSampler", 2);
+  perch_score_program_->setUniform ("MaskSampler", 3);
+  perch_score_program_->setUniform ("row_height", row_height_);
+  perch_score_program_->setUniform ("col_width", col_width_);
+  perch_score_program_->setUniform ("max_depth", max_depth_mm);
+  perch_score_program_->setUniform ("max_window", kMaxScoreWindow);
+  perch_score_program_->setUniform ("near", z_near_);
+  perch_score_program_->setUniform ("far", z_far_);
+  perch_score_program_->setUniform ("fx", camera_fx_);
+  perch_score_program_->setUniform ("fy", camera_fy_);
+  perch_score_program_->setUniform ("cx", camera_cx_);
+  perch_score_program_->setUniform ("cy", camera_cy_);
+  perch_score_program_->setUniform ("radius", radius);
+
+  glBindFramebuffer (GL_FRAMEBUFFER, statistics_fbo_);
+  glDrawBuffer (GL_COLOR_ATTACHMENT0);
+  glReadBuffer (GL_NONE);
+
+  GLboolean enable_depth_test;
+  glGetBooleanv (GL_DEPTH_TEST, &enable_depth_test);
+  glDisable (GL_DEPTH_TEST);
+
+  // Only the first tile is scored, clear the rest so the sum ignores it.
+  glClearColor (0.0f, 0.0f, 0.0f, 0.0f);
+  glClear (GL_COLOR_BUFFER_BIT);
+  glViewport (0, 0, col_width_, row_height_);
+
+  glActiveTexture (GL_TEXTURE0);
+  glBindTexture (GL_TEXTURE_2D, depth_texture_);
+  glActiveTexture (GL_TEXTURE1);
+  glBindTexture (GL_TEXTURE_2D, observed_texture_);
+  glActiveTexture (GL_TEXTURE2);
+  glBindTexture (GL_TEXTURE_2D, occlusion_reference_texture_);
+  glActiveTexture (GL_TEXTURE3);
+  glBindTexture (GL_TEXTURE_2D, observed_mask_texture_);
+
+  quad_->render ();
+  glUseProgram (0);
+
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+
+  for (int unit = 3; unit >= 0; --unit) {
+    glActiveTexture (GL_TEXTURE0 + unit);
+    glBindTexture (GL_TEXTURE_2D, 0);
+  }
+
+  if (enable_depth_test == GL_TRUE) {
+    glEnable (GL_DEPTH_TEST);
+  }
+
+  reduced_statistics_.resize (4 * statistics_reduce_->getOutputWidth () *
+                              statistics_reduce_->getOutputHeight ());
+  statistics_reduce_->reduce (statistics_texture_,
+                              std::vector<Reduce::Operation> (4, Reduce::SUM),
+                              &reduced_statistics_[0]);
+
+  if (gllib::getGLError () != GL_NO_ERROR) {
+    std::cerr << "GL Error: RangeLikelihood::countUnexplainedPoints" << std::endl;
+  }
+
+  // Counts are exact in float up to 2^24.
+  const int levels = max_level (row_height_, col_width_);
+  const int reduced_width = width_ >> levels;
+  std::fill (counts, counts + 4, 0.0f);
+
+  for (int row = 0; row < (row_height_ >> levels); ++row) {
+    for (int col = 0; col < (col_width_ >> levels); ++col) {
+      const float *sums = &reduced_statistics_[4 * (row * reduced_width + col)];
+
+      for (int k = 0; k < 4; ++k) {
+        counts[k] += sums[k];
+      }
+    }
+  }
+}
+
+void
+RangeLikelihood::countUnexplainedPointsCPU (float radius, float counts[4]) {
+  assert (observed_depth_.size () == static_cast<size_t> (col_width_ * row_height_));
+  assert (observed_mask_.size () == observed_depth_.size ());
+  assert (occlusion_reference_.size () == observed_depth_.size ());
+
+  const unsigned short max_depth_mm = static_cast<unsigned short> (1000.0f *
+                                                                   z_far_ + 0.5f);
+
+  // Same top-down layout as the observed image, composited with the
+  // reference.
+  tile_depth_mm_.resize (col_width_ * row_height_);
+  convertDepthToMillimetersCPU (depth_buffer_, 0, 0, col_width_, row_height_,
+                                &tile_depth_mm_[0]);
+
+  for (size_t i = 0; i < tile_depth_mm_.size (); ++i) {
+    tile_depth_mm_[i] = std::min (tile_depth_mm_[i], occlusion_reference_[i]);
+  }
+
+  const float radius_sq = radius * radius;
+  const float max_f = std::max (camera_fx_, camera_fy_);
+  std::fill (counts, counts + 4, 0.0f);
+
+  // As in perch_score.frag, with v the bottom-up row of getGlobalPoint ().
+  // Returns true if a point of others lies within radius of the point on
+  // pixel (u, row) with depth mm.
+  auto is_explained = [&] (int row, int u, unsigned short mm,
+                           const std::vector<unsigned short> &others) {
+    const float z = mm / 1000.0f;
+    const Eigen::Vector3f point ((u - camera_cx_) * z / camera_fx_,
+                                 (row_height_ - 1 - row - camera_cy_) * z / camera_fy_, z);
+    const int window = std::min (kMaxScoreWindow, static_cast<int> (std::ceil (
+                                   radius * max_f / std::max (z - radius, z_near_))));
+
+    for (int r = std::max (row - window, 0);
+         r <= std::min (row + window, row_height_ - 1); ++r) {
+      for (int c = std::max (u - window, 0);
+           c <= std::min (u + window, col_width_ - 1); ++c) {
+        const unsigned short other = others[r * col_width_ + c];
+
+        if (other == max_depth_mm) {
+          continue;
+        }
+
+        const float oz = other / 1000.0f;
+        const Eigen::Vector3f other_point ((c - camera_cx_) * oz / camera_fx_,
+                                           (row_height_ - 1 - r - camera_cy_) * oz / camera_fy_,
+                                           oz);
+
+        if ((other_point - point).squaredNorm () <= radius_sq) {
+          return true;
+        }
+      }
+    }
+
+    return false;
+  };
+
+  for (int row = 0; row < row_height_; ++row) {
+    for (int u = 0; u < col_width_; ++u) {
+      const int idx = row * col_width_ + u;
+      const unsigned short rendered = tile_depth_mm_[idx];
+      const unsigned short observed = observed_depth_[idx];
+      const uint8_t mask = observed_mask_[idx];
+
+      if (rendered != max_depth_mm && occlusion_reference_[idx] == max_depth_mm &&
+          !is_explained (row, u, rendered, observed_depth_)) {
+        counts[0] += 1.0f;
+      }
+
+      if (observed != max_depth_mm && mask > 0 && mask < 4 &&
+          !is_explained (row, u, observed, tile_depth_mm_)) {
+        counts[mask] += 1.0f;
+      }
+    }
+  }
+}
+
+bool
+RangeLikelihood::getScreenBoundingBox (const Scene &scene,
+                                       const Eigen::Isometry3d &pose,
+                                       int &x, int &y, int &width,
+                                       int &height) const {
+  const Eigen::Matrix4f view_projection = getProjectionMatrix () *
+                                          getViewMatrix (pose);
+  float min_u = std::numeric_limits<float>::max ();
+  float min_v = std::numeric_limits<float>::max ();
+  float max_u = -std::numeric_limits<float>::max ();
+  float max_v = -std::numeric_limits<float>::max ();
+
+  const std::vector<Model::Ptr> &models = scene.getModels ();
+
+  for (size_t m = 0; m < models.size (); ++m) {
+    Eigen::Vector3f lo, hi;
+
+    if (!models[m]->getBoundingBox (lo, hi)) {
+      return false;
+    }
+
+    const Eigen::Matrix4f mvp = view_projection * models[m]->getTransform ();
+
+    for (int c = 0; c < 8; ++c) {
+      const Eigen::Vector4f corner ((c & 1) ? hi.x () : lo.x (),
+                                    (c & 2) ? hi.y () : lo.y (),
+                                    (c & 4) ? hi.z () : lo.z (), 1.0f);
+      const Eigen::Vector4f clip = mvp * corner;
+
+      // w is the distance along the view axis. Corners in front of the near
+      // plane would be clipped and cannot be bounded by their projection.
+      if (clip (3) < z_near_) {
+        return false;
+      }
+
+      const float u = 0.5f * (clip (0) / clip (3) + 1.0f) * col_width_;
+      const float v = (1.0f - 0.5f * (clip (1) / clip (3) + 1.0f)) * row_height_;
+      min_u = std::min (min_u, u);
+      max_u = std::max (max_u, u);
+      min_v = std::min (min_v, v);
+      max_v = std::max (max_v, v);
+    }
+  }
+
+  if (models.empty ()) {
+    x = y = width = height = 0;
+    return true;
+  }
+
+  // Pixel i is covered when its center i + 0.5 is, pad by a pixel for
+  // rounding.
+  const int x_begin = std::max (0, static_cast<int> (std::floor (min_u)) - 1);
+  const int y_begin = std::max (0, static_cast<int> (std::floor (min_v)) - 1);
+  const int x_end = std::min (col_width_, static_cast<int> (std::ceil (max_u)) + 1);
+  const int y_end = std::min (row_height_, static_cast<int> (std::ceil (max_v)) + 1);
+  x = std::min (x_begin, col_width_);
+  y = std::min (y_begin, row_height_);
+  width = std::max (0, x_end - x);
+  height = std::max (0, y_end - y);
+  return true;
+}
+
 void
 RangeLikelihood::render (const
                          std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
-                         &poses) {
+                         &poses,
+                         const std::vector<Scene::Ptr> &scenes) {
+  if (software_rasterizer_) {
+    renderSoftware (poses, scenes);
+    return;
+  }
+
   if (gllib::getGLError () != GL_NO_ERROR) {
     std::cerr << "GL Error: RangeLikelihood::render - enter" << std::endl;
   }
@@ -1409,10 +2066,21 @@ RangeLikelihood::render (const
 
   // Render
   glPushAttrib (GL_ALL_ATTRIB_BITS);
+
+  if (use_scissor_) {
+    glEnable (GL_SCISSOR_TEST);
+    glScissor (scissor_[0], scissor_[1], scissor_[2], scissor_[3]);
+  } else if (!tile_scissors_.empty ()) {
+    glEnable (GL_SCISSOR_TEST);
+  }
   glEnable (GL_COLOR_MATERIAL);
   glClearColor (0.0f, 0.0f, 0.0f, 0.0f);
   glClearDepth (1.0);
-  glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  // Tiles with their own scissor rectangle are cleared by drawParticles ().
+  if (tile_scissors_.empty ()) {
+    glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  }
 
   // Setup projection matrix
   setupProjectionMatrix ();
@@ -1420,7 +2088,7 @@ RangeLikelihood::render (const
   glEnable (GL_DEPTH_TEST);
   glDepthMask (GL_TRUE);
   glCullFace (GL_FRONT);
-  drawParticles (poses);
+  drawParticles (poses, scenes);
 
   glPopAttrib ();
   glFlush ();
@@ -1445,6 +2113,33 @@ RangeLikelihood::render (const
 
   color_buffer_dirty_ = true;
   depth_buffer_dirty_ = true;
+  depth_mm_buffer_dirty_ = true;
+  score_buffer_dirty_ = true;
+}
+
+void
+RangeLikelihood::renderSoftware (const
+                                 std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+                                 &poses,
+                                 const std::vector<Scene::Ptr> &scenes) {
+  const size_t num_tiles = std::min (poses.size (),
+                                     static_cast<size_t> (rows_ * cols_));
+  tile_scenes_.resize (num_tiles);
+  tile_views_.resize (num_tiles);
+
+  for (size_t n = 0; n < num_tiles; ++n) {
+    tile_scenes_[n] = scenes.empty () ? scene_ : scenes[n];
+    tile_views_[n] = getViewMatrix (poses[n]);
+  }
+
+  software_rasterizer_->render (tile_scenes_, tile_views_, getProjectionMatrix (),
+                                depth_buffer_);
+  std::fill (color_buffer_, color_buffer_ + width_ * height_ * 3, 0);
+
+  // The results are already in host memory.
+  depth_buffer_dirty_ = false;
+  depth_mm_buffer_dirty_ = true;
+  color_buffer_dirty_ = false;
   score_buffer_dirty_ = true;
 }
 
@@ -1467,6 +2162,303 @@ RangeLikelihood::getDepthBuffer () {
   return depth_buffer_;
 }
 
+void
+RangeLikelihood::setNumReadbackBuffers (int num_buffers) {
+  num_buffers = std::max (2, num_buffers);
+
+  if (num_buffers == num_readback_buffers_) {
+    return;
+  }
+
+  // The buffers are recreated with the new count on the next readback.
+  if (!readback_pbos_.empty ()) {
+    glDeleteBuffers (static_cast<GLsizei> (readback_pbos_.size ()),
+                     &readback_pbos_[0]);
+    readback_pbos_.clear ();
+  }
+
+  readback_copies_.clear ();
+  readback_mm_copies_.clear ();
+  num_readback_buffers_ = num_buffers;
+  next_readback_buffer_ = 0;
+}
+
+int
+RangeLikelihood::nextReadbackSlot () {
+  const int slot = next_readback_buffer_;
+  next_readback_buffer_ = (next_readback_buffer_ + 1) % num_readback_buffers_;
+
+  if (!software_rasterizer_ && readback_pbos_.empty ()) {
+    readback_pbos_.resize (num_readback_buffers_);
+    glGenBuffers (num_readback_buffers_, &readback_pbos_[0]);
+
+    // Sized for float depth, which also holds the 16 bit depth.
+    for (int i = 0; i < num_readback_buffers_; ++i) {
+      glBindBuffer (GL_PIXEL_PACK_BUFFER, readback_pbos_[i]);
+      glBufferData (GL_PIXEL_PACK_BUFFER, width_ * height_ * sizeof (float), NULL,
+                    GL_STREAM_READ);
+    }
+
+    glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+  }
+
+  return slot;
+}
+
+int
+RangeLikelihood::beginDepthReadback () {
+  const int slot = nextReadbackSlot ();
+
+  if (software_rasterizer_) {
+    readback_copies_.resize (num_readback_buffers_);
+    readback_copies_[slot].assign (depth_buffer_, depth_buffer_ + width_ * height_);
+    return slot;
+  }
+
+  // With a pack buffer bound glReadPixels returns immediately and the copy
+  // runs after the queued rendering.
+  glBindFramebuffer (GL_FRAMEBUFFER, fbo_);
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, readback_pbos_[slot]);
+  glReadPixels (0, 0, width_, height_, GL_DEPTH_COMPONENT, GL_FLOAT, 0);
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+  glFlush ();
+
+  if (gllib::getGLError () != GL_NO_ERROR) {
+    std::cerr << "GL Error: RangeLikelihood::beginDepthReadback" << std::endl;
+  }
+
+  return slot;
+}
+
+const float *
+RangeLikelihood::mapDepthReadback (int slot) {
+  assert (slot >= 0 && slot < num_readback_buffers_);
+
+  if (software_rasterizer_) {
+    return &readback_copies_[slot][0];
+  }
+
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, readback_pbos_[slot]);
+  const float *data = static_cast<const float *> (glMapBuffer (
+                                                    GL_PIXEL_PACK_BUFFER, GL_READ_ONLY));
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+
+  if (data == NULL) {
+    std::cerr << "RangeLikelihood::mapDepthReadback: Mapping buffer failed" <<
+              std::endl;
+    exit (-1);
+  }
+
+  return data;
+}
+
+int
+RangeLikelihood::beginDepthReadbackMillimeters () {
+  return beginDepthReadbackMillimeters (0, 0, width_, height_);
+}
+
+int
+RangeLikelihood::beginDepthReadbackMillimeters (int x, int y, int width,
+                                                int height) {
+  assert (x >= 0 && y >= 0 && width > 0 && height > 0 &&
+          x + width <= width_ && y + height <= height_);
+  const int slot = nextReadbackSlot ();
+
+  if (software_rasterizer_) {
+    readback_mm_copies_.resize (num_readback_buffers_);
+    readback_mm_copies_[slot].resize (width * height);
+    getDepthBufferMillimeters (x, y, width, height, &readback_mm_copies_[slot][0]);
+    return slot;
+  }
+
+  convertDepthToMillimeters (x, y, width, height);
+
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, readback_pbos_[slot]);
+  readDepthMillimeters (x, y, width, height, 0);
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+  glFlush ();
+
+  return slot;
+}
+
+const unsigned short *
+RangeLikelihood::mapDepthReadbackMillimeters (int slot) {
+  if (software_rasterizer_) {
+    assert (slot >= 0 && slot < num_readback_buffers_);
+    return &readback_mm_copies_[slot][0];
+  }
+
+  return reinterpret_cast<const unsigned short *> (mapDepthReadback (slot));
+}
+
+const unsigned short *
+RangeLikelihood::getDepthBufferMillimeters () {
+  if (depth_mm_buffer_dirty_) {
+    if (software_rasterizer_) {
+      convertDepthToMillimetersCPU (depth_buffer_, 0, 0, width_, height_,
+                                    depth_mm_buffer_);
+    } else {
+      convertDepthToMillimeters (0, 0, width_, height_);
+      readDepthMillimeters (0, 0, width_, height_, depth_mm_buffer_);
+    }
+
+    depth_mm_buffer_dirty_ = false;
+  }
+
+  return depth_mm_buffer_;
+}
+
+void
+RangeLikelihood::getDepthBufferMillimeters (int x, int y, int width,
+                                            int height,
+                                            unsigned short *depth_mm) {
+  assert (x >= 0 && y >= 0 && x + width <= width_ && y + height <= height_);
+
+  if (width <= 0 || height <= 0) {
+    return;
+  }
+
+  if (software_rasterizer_) {
+    convertDepthToMillimetersCPU (depth_buffer_, x, y, width, height, depth_mm);
+  } else {
+    convertDepthToMillimeters (x, y, width, height);
+    readDepthMillimeters (x, y, width, height, depth_mm);
+  }
+}
+
+void
+RangeLikelihood::convertDepthToMillimeters (int x, int y, int width,
+                                            int height) {
+  if (gllib::getGLError () != GL_NO_ERROR) {
+    std::cerr << "GL Error: RangeLikelihood::convertDepthToMillimeters - enter" <<
+              std::endl;
+  }
+
+  depth_mm_program_->use ();
+  depth_mm_program_->setUniform ("DepthSampler", 0);
+  depth_mm_program_->setUniform ("row_height", row_height_);
+  depth_mm_program_->setUniform ("near", z_near_);
+  depth_mm_program_->setUniform ("far", z_far_);
+
+  glBindFramebuffer (GL_FRAMEBUFFER, depth_mm_fbo_);
+  glDrawBuffer (GL_COLOR_ATTACHMENT0);
+
+  GLboolean enable_depth_test;
+  glGetBooleanv (GL_DEPTH_TEST, &enable_depth_test);
+  glDisable (GL_DEPTH_TEST);
+  glViewport (0, 0, width_, height_);
+
+  // Rows of depth_mm_texture_ are already in top-down order.
+  const bool partial = x != 0 || y != 0 || width != width_ || height != height_;
+
+  if (partial) {
+    glEnable (GL_SCISSOR_TEST);
+    glScissor (x, y, width, height);
+  }
+
+  glActiveTexture (GL_TEXTURE0);
+  glBindTexture (GL_TEXTURE_2D, depth_texture_);
+
+  quad_->render ();
+  glUseProgram (0);
+
+  glBindTexture (GL_TEXTURE_2D, 0);
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+
+  if (partial) {
+    glDisable (GL_SCISSOR_TEST);
+  }
+
+  if (enable_depth_test == GL_TRUE) {
+    glEnable (GL_DEPTH_TEST);
+  }
+
+  if (gllib::getGLError () != GL_NO_ERROR) {
+    std::cerr << "GL Error: RangeLikelihood::convertDepthToMillimeters - exit" <<
+              std::endl;
+  }
+}
+
+void
+RangeLikelihood::readDepthMillimeters (int x, int y, int width, int height,
+                                       void *data) {
+  GLint old_read_buffer;
+  GLint old_pack_alignment;
+  glGetIntegerv (GL_READ_BUFFER, &old_read_buffer);
+  glGetIntegerv (GL_PACK_ALIGNMENT, &old_pack_alignment);
+
+  glBindFramebuffer (GL_FRAMEBUFFER, depth_mm_fbo_);
+  glReadBuffer (GL_COLOR_ATTACHMENT0);
+  glPixelStorei (GL_PACK_ALIGNMENT, 2);
+  glReadPixels (x, y, width, height, GL_RED_INTEGER, GL_UNSIGNED_SHORT, data);
+  glPixelStorei (GL_PACK_ALIGNMENT, old_pack_alignment);
+  glBindFramebuffer (GL_FRAMEBUFFER, 0);
+  glReadBuffer (old_read_buffer);
+
+  if (gllib::getGLError () != GL_NO_ERROR) {
+    std::cerr << "GL Error: RangeLikelihood::readDepthMillimeters" << std::endl;
+  }
+}
+
+void
+RangeLikelihood::convertDepthToMillimetersCPU (const float *depth, int x0,
+                                               int y0, int width, int height,
+                                               unsigned short *depth_mm) const {
+  // Same expression and evaluation order as depth_to_mm.frag and
+  // SimExample::get_depth_image_uint, so the results match bit for bit.
+  const float c = -z_far_ * z_near_;
+  const float e = z_far_ - z_near_;
+  const float b = z_far_ / (z_far_ - z_near_);
+
+  for (int row = y0; row < y0 + height; ++row) {
+    const int tile_y = (row / row_height_) * row_height_;
+    const int src_row = tile_y + row_height_ - 1 - (row - tile_y);
+    const float *in = depth + src_row * width_ + x0;
+    unsigned short *out = depth_mm + (row - y0) * width;
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128 c4 = _mm_set1_ps (c);
+    const __m128 e4 = _mm_set1_ps (e);
+    const __m128 b4 = _mm_set1_ps (b);
+    const __m128 scale = _mm_set1_ps (1000.0f);
+    const __m128 half = _mm_set1_ps (0.5f);
+
+    for (; x + 8 <= width; x += 8) {
+      const __m128 z0 = _mm_mul_ps (scale, _mm_div_ps (c4, _mm_mul_ps (e4,
+                                    _mm_sub_ps (_mm_loadu_ps (in + x), b4))));
+      const __m128 z1 = _mm_mul_ps (scale, _mm_div_ps (c4, _mm_mul_ps (e4,
+                                    _mm_sub_ps (_mm_loadu_ps (in + x + 4), b4))));
+      const __m128i mm0 = _mm_cvttps_epi32 (_mm_add_ps (z0, half));
+      const __m128i mm1 = _mm_cvttps_epi32 (_mm_add_ps (z1, half));
+      // Depth values are in [0, 1], so the range is at most z_far (20 m)
+      // and the signed saturating pack is exact.
+      _mm_storeu_si128 (reinterpret_cast<__m128i *> (out + x),
+                        _mm_packs_epi32 (mm0, mm1));
+    }
+#endif
+
+    for (; x < width; ++x) {
+      out[x] = static_cast<unsigned short> (1000.0f * (c / (e * (in[x] - b))) +
+                                            0.5f);
+    }
+  }
+}
+
+void
+RangeLikelihood::unmapDepthReadback (int slot) {
+  assert (slot >= 0 && slot < num_readback_buffers_);
+
+  if (software_rasterizer_) {
+    return;
+  }
+
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, readback_pbos_[slot]);
+  glUnmapBuffer (GL_PIXEL_PACK_BUFFER);
+  glBindBuffer (GL_PIXEL_PACK_BUFFER, 0);
+}
+
 const uint8_t *
 RangeLikelihood::getColorBuffer () {
   // It's only possible to read the color buffer if it
@@ -1499,7 +2491,7 @@ RangeLikelihood::getColorBuffer () {
 // The scores are in score_texture_
 const float *
 RangeLikelihood::getScoreBuffer () {
-  if (score_buffer_dirty_ && !compute_likelihood_on_cpu_) {
+  if (score_buffer_dirty_ && !compute_likelihood_on_cpu_ && !software_rasterizer_) {
     glActiveTexture (GL_TEXTURE0);
     glBindTexture (GL_TEXTURE_2D, score_texture_);
     glGetTexImage (GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, score_buffer_);
@@ -0,0 +1,29 @@
+#version 130
+#extension GL_ARB_explicit_attrib_location : enable
+#extension GL_ARB_explicit_uniform_location : enable
+
+in vec2 TexCoord0;
+
+layout(location = 0) out vec4 FragColor;
+
+// Operation of each channel: 0 sum, 1 min, 2 max.
+uniform ivec4 operations;
+
+uniform sampler2D ArraySampler;
+
+void main() 
+{
+  // Each output pixel reduces a 2x2 block of the level below.
+  ivec2 p = 2 * ivec2(gl_FragCoord.xy);
+  vec4 a = texelFetch(ArraySampler, p, 0);
+  vec4 b = texelFetch(ArraySampler, p + ivec2(1, 0), 0);
+  vec4 c = texelFetch(ArraySampler, p + ivec2(0, 1), 0);
+  vec4 d = texelFetch(ArraySampler, p + ivec2(1, 1), 0);
+
+  vec4 sum = a + b + c + d;
+  vec4 lo = min(min(a, b), min(c, d));
+  vec4 hi = max(max(a, b), max(c, d));
+
+  FragColor = mix(mix(sum, lo, equal(operations, ivec4(1))), hi,
+                  equal(operations, ivec4(2)));
+}
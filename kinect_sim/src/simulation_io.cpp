@@ -3,24 +3,49 @@
 
 #include <opencv2/core/core.hpp>
 
-pcl::simulation::SimExample::SimExample(int argc, char** argv,
-	int height,int width):
-        height_(height), width_(width){
+#ifdef KINECT_SIM_HAVE_EGL
+# include <EGL/egl.h>
+# include <EGL/eglext.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+  // Default camera intrinsics of the simulated Kinect.
+  const float kCameraFocalLength = 576.09757860f;
+  const float kCameraCx = 321.06398107f;
+  const float kCameraCy = 242.97676897f;
+
+  // Tile grid of the batch framebuffer. Every tile holds one full image.
+  const int kBatchRows = 4;
+  const int kBatchCols = 4;
+}
 
-  initializeGL (argc, argv);
+pcl::simulation::SimExample::SimExample(int argc, char** argv,
+	int height,int width, ContextType context_type):
+        context_type_(context_type), egl_display_(NULL), egl_surface_(NULL),
+        egl_context_(NULL), height_(height), width_(width){
+
+  if (context_type_ == CONTEXT_EGL)
+    initializeEGL ();
+  else if (context_type_ == CONTEXT_GLUT)
+    initializeGL (argc, argv);
   
   // 1. construct member elements:
   camera_ = Camera::Ptr (new Camera ());
   scene_ = Scene::Ptr (new Scene ());
 
   //rl_ = RangeLikelihoodGLSL::Ptr(new RangeLikelihoodGLSL(1, 1, height, width, scene_, 0));
-  rl_ = RangeLikelihood::Ptr (new RangeLikelihood (1, 1, height, width, scene_));
+  rl_ = RangeLikelihood::Ptr (new RangeLikelihood (1, 1, height, width, scene_,
+                                                   context_type_ == CONTEXT_SOFTWARE));
   // rl_ = RangeLikelihood::Ptr(new RangeLikelihood(10, 10, 96, 96, scene_));
   // rl_ = RangeLikelihood::Ptr(new RangeLikelihood(1, 1, height_, width_, scene_));
 
   // Actually corresponds to default parameters:
-  rl_->setCameraIntrinsicsParameters (width_,height_, 576.09757860,
-            576.09757860, 321.06398107, 242.97676897);
+  rl_->setCameraIntrinsicsParameters (width_,height_, kCameraFocalLength,
+            kCameraFocalLength, kCameraCx, kCameraCy);
   rl_->setComputeOnCPU (false);
   rl_->setSumOnCPU (true);
   rl_->setUseColor (true);  
@@ -33,9 +58,8 @@ if (argc != 0 && argv != NULL) {
   pcl::io::loadPolygonFile (argv[2], mesh);
   pcl::PolygonMesh::Ptr cloud (new pcl::PolygonMesh (mesh));
 
-  // Not sure if PolygonMesh assumes triangles if to, TODO: Ask a developer
-  PolygonMeshModel::Ptr model = PolygonMeshModel::Ptr (new PolygonMeshModel (
-                                                         GL_POLYGON, cloud));
+  // Polygons are fan-triangulated and drawn with a single indexed call.
+  TriangleMeshModel::Ptr model = TriangleMeshModel::Ptr (new TriangleMeshModel (cloud));
   scene_->add (model);
 
   std::cout << "Just read " << argv[2] << std::endl;
@@ -66,6 +90,27 @@ if (argc != 0 && argv != NULL) {
 
 
 
+pcl::simulation::SimExample::~SimExample ()
+{
+#ifdef KINECT_SIM_HAVE_EGL
+  if (egl_display_ != NULL)
+  {
+    // Release the GL objects while the context is still current.
+    batch_rl_.reset ();
+    rl_.reset ();
+    scene_.reset ();
+
+    EGLDisplay display = static_cast<EGLDisplay> (egl_display_);
+    eglMakeCurrent (display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (egl_context_ != NULL)
+      eglDestroyContext (display, static_cast<EGLContext> (egl_context_));
+    if (egl_surface_ != NULL)
+      eglDestroySurface (display, static_cast<EGLSurface> (egl_surface_));
+    eglTerminate (display);
+  }
+#endif
+}
+
 void 
 pcl::simulation::SimExample::initializeGL (int argc, char** argv)
 {
@@ -76,7 +121,116 @@ pcl::simulation::SimExample::initializeGL (int argc, char** argv)
   //glutInitWindowSize (window_width_, window_height_);
   glutCreateWindow ("OpenGL range likelihood");
 
+  initializeGLEW ();
+}
+
+void
+pcl::simulation::SimExample::initializeEGL ()
+{
+#ifdef KINECT_SIM_HAVE_EGL
+  EGLDisplay display = EGL_NO_DISPLAY;
+
+  // Prefer a display on a device directly, so that neither an X server nor
+  // a compositor is needed. Fall back to the default display otherwise.
+  PFNEGLQUERYDEVICESEXTPROC query_devices =
+    reinterpret_cast<PFNEGLQUERYDEVICESEXTPROC> (eglGetProcAddress ("eglQueryDevicesEXT"));
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+    reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC> (eglGetProcAddress ("eglGetPlatformDisplayEXT"));
+  if (query_devices != NULL && get_platform_display != NULL)
+  {
+    EGLDeviceEXT devices[16];
+    EGLint num_devices = 0;
+    if (query_devices (16, devices, &num_devices) && num_devices > 0)
+      display = get_platform_display (EGL_PLATFORM_DEVICE_EXT, devices[0], NULL);
+  }
+  if (display == EGL_NO_DISPLAY)
+    display = eglGetDisplay (EGL_DEFAULT_DISPLAY);
+
+  EGLint major = 0, minor = 0;
+  if (display == EGL_NO_DISPLAY || !eglInitialize (display, &major, &minor))
+  {
+    std::cerr << "Error: Could not initialize an EGL display" << std::endl;
+    exit (-1);
+  }
+  egl_display_ = display;
+  std::cout << "Status: Using EGL " << major << "." << minor << std::endl;
+
+  const EGLint config_attribs[] = {
+    EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+    EGL_RED_SIZE, 8,
+    EGL_GREEN_SIZE, 8,
+    EGL_BLUE_SIZE, 8,
+    EGL_DEPTH_SIZE, 24,
+    EGL_NONE
+  };
+  EGLConfig config;
+  EGLint num_configs = 0;
+  if (!eglChooseConfig (display, config_attribs, &config, 1, &num_configs) ||
+      num_configs < 1)
+  {
+    std::cerr << "Error: No EGL config supports desktop OpenGL" << std::endl;
+    exit (-1);
+  }
+
+  if (!eglBindAPI (EGL_OPENGL_API))
+  {
+    std::cerr << "Error: EGL does not support the desktop OpenGL API" << std::endl;
+    exit (-1);
+  }
+
+  // Everything is rendered into framebuffer objects; a surface is only
+  // created when the driver cannot make a context current without one.
+  EGLSurface surface = EGL_NO_SURFACE;
+  const char* extensions = eglQueryString (display, EGL_EXTENSIONS);
+  if (extensions == NULL || strstr (extensions, "EGL_KHR_surfaceless_context") == NULL)
+  {
+    const EGLint pbuffer_attribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    surface = eglCreatePbufferSurface (display, config, pbuffer_attribs);
+    if (surface == EGL_NO_SURFACE)
+    {
+      std::cerr << "Error: Could not create an EGL pbuffer surface" << std::endl;
+      exit (-1);
+    }
+    egl_surface_ = surface;
+  }
+
+  // Default attributes give a compatibility context, which the fixed function
+  // matrix stack used by RangeLikelihood requires.
+  EGLContext context = eglCreateContext (display, config, EGL_NO_CONTEXT, NULL);
+  if (context == EGL_NO_CONTEXT)
+  {
+    std::cerr << "Error: Could not create an EGL context" << std::endl;
+    exit (-1);
+  }
+  egl_context_ = context;
+
+  if (!eglMakeCurrent (display, surface, surface, context))
+  {
+    std::cerr << "Error: Could not make the EGL context current" << std::endl;
+    exit (-1);
+  }
+
+  initializeGLEW ();
+#else
+  std::cerr << "Error: kinect_sim was built without EGL support" << std::endl;
+  exit (-1);
+#endif
+}
+
+void
+pcl::simulation::SimExample::initializeGLEW ()
+{
+  if (context_type_ == CONTEXT_EGL)
+    glewExperimental = GL_TRUE;
+
   GLenum err = glewInit ();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+  // GLEW built against GLX complains about the missing X display even though
+  // the entry points of the current EGL context were loaded.
+  if (context_type_ == CONTEXT_EGL && err == GLEW_ERROR_NO_GLX_DISPLAY)
+    err = GLEW_OK;
+#endif
   if (GLEW_OK != err)
   {
     std::cerr << "Error: " << glewGetErrorString (err) << std::endl;
@@ -134,6 +288,45 @@ pcl::simulation::SimExample::doSim (Eigen::Isometry3d pose_in)
 
 
 
+void
+pcl::simulation::SimExample::doRender (const Eigen::Isometry3d& pose_in)
+{
+  rl_->renderPose (pose_in);
+}
+
+void
+pcl::simulation::SimExample::doRenderROI (const Eigen::Isometry3d& pose_in, DepthImageROI* roi)
+{
+  if (!rl_->getScreenBoundingBox (*scene_, pose_in, roi->x, roi->y, roi->width, roi->height))
+  {
+    roi->x = 0;
+    roi->y = 0;
+    roi->width = width_;
+    roi->height = height_;
+  }
+
+  roi->depth.resize (roi->width * roi->height);
+  // Nothing in view, there is nothing to render either.
+  if (roi->depth.empty ())
+    return;
+
+  rl_->renderPose (pose_in, roi->x, roi->y, roi->width, roi->height);
+  rl_->getDepthBufferMillimeters (roi->x, roi->y, roi->width, roi->height, &roi->depth[0]);
+}
+
+void
+pcl::simulation::SimExample::set_occlusion_reference (const std::vector<unsigned short>& depth_img)
+{
+  assert (static_cast<int> (depth_img.size ()) == width_ * height_);
+  rl_->setOcclusionReference (&depth_img[0]);
+}
+
+int
+pcl::simulation::SimExample::count_occluding_pixels (const Eigen::Isometry3d& pose_in)
+{
+  return rl_->countOccludingPixels (scene_, pose_in);
+}
+
 void
 pcl::simulation::SimExample::write_score_image(const float* score_buffer, std::string fname)
 {
@@ -349,6 +542,236 @@ pcl::simulation::SimExample::get_depth_image_uint(const float* depth_buffer, std
   }
 }
 
+void
+pcl::simulation::SimExample::get_depth_image_uint(std::vector<unsigned short>* depth_img)
+{
+  const unsigned short* depth_mm = rl_->getDepthBufferMillimeters ();
+  depth_img->assign (depth_mm, depth_mm + width_ * height_);
+}
+
+pcl::simulation::RangeLikelihood::Ptr
+pcl::simulation::SimExample::getBatchRangeLikelihood ()
+{
+  if (!batch_rl_)
+  {
+    // Keep the batch framebuffer within what the driver (and RangeLikelihood)
+    // supports.
+    GLint max_size = 8192;
+    if (context_type_ != CONTEXT_SOFTWARE)
+    {
+      glGetIntegerv (GL_MAX_TEXTURE_SIZE, &max_size);
+      max_size = std::min (static_cast<int> (max_size), 8192);
+    }
+    const int rows = std::max (1, std::min (kBatchRows, max_size / height_));
+    const int cols = std::max (1, std::min (kBatchCols, max_size / width_));
+
+    batch_rl_ = RangeLikelihood::Ptr (new RangeLikelihood (rows, cols, height_, width_, scene_,
+                                                           context_type_ == CONTEXT_SOFTWARE));
+    batch_rl_->setCameraIntrinsicsParameters (width_, height_, kCameraFocalLength,
+                                              kCameraFocalLength, kCameraCx, kCameraCy);
+    batch_rl_->setComputeOnCPU (false);
+    batch_rl_->setSumOnCPU (true);
+    batch_rl_->setUseColor (false);
+  }
+  return batch_rl_;
+}
+
+int
+pcl::simulation::SimExample::getBatchSize ()
+{
+  RangeLikelihood::Ptr batch_rl = getBatchRangeLikelihood ();
+  return batch_rl->getRows () * batch_rl->getCols ();
+}
+
+void
+pcl::simulation::SimExample::get_depth_images_uint (const std::vector<Scene::Ptr>& scenes,
+                                                    const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d> >& poses,
+                                                    std::vector<std::vector<unsigned short> >* depth_images)
+{
+  depth_images->resize (scenes.size ());
+  renderBatch (scenes, poses, depth_images, NULL);
+}
+
+void
+pcl::simulation::SimExample::get_depth_images_roi (const std::vector<Scene::Ptr>& scenes,
+                                                   const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d> >& poses,
+                                                   std::vector<DepthImageROI>* rois)
+{
+  assert (scenes.size () == poses.size ());
+  rois->resize (scenes.size ());
+
+  RangeLikelihood::Ptr batch_rl = getBatchRangeLikelihood ();
+  for (size_t n = 0; n < scenes.size (); ++n)
+  {
+    DepthImageROI& roi = (*rois)[n];
+    if (!batch_rl->getScreenBoundingBox (*scenes[n], poses[n], roi.x, roi.y, roi.width, roi.height))
+    {
+      roi.x = 0;
+      roi.y = 0;
+      roi.width = width_;
+      roi.height = height_;
+    }
+  }
+
+  renderBatch (scenes, poses, NULL, rois);
+}
+
+void
+pcl::simulation::SimExample::renderBatch (const std::vector<Scene::Ptr>& scenes,
+                                          const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d> >& poses,
+                                          std::vector<std::vector<unsigned short> >* depth_images,
+                                          std::vector<DepthImageROI>* rois)
+{
+  assert (scenes.size () == poses.size ());
+
+  RangeLikelihood::Ptr batch_rl = getBatchRangeLikelihood ();
+  const size_t batch_size = static_cast<size_t> (getBatchSize ());
+
+  // Chunks are pipelined: the readback of a chunk is only waited on after
+  // the next chunk has been submitted, so the GPU renders while the CPU
+  // converts the previous chunk.
+  size_t pending_first = 0;
+  size_t pending_last = 0;
+  int pending_slot = -1;
+  int pending_x = 0;
+  int pending_y = 0;
+  int pending_width = 0;
+  std::vector<int> tile_rois;
+
+  for (size_t first = 0; first < scenes.size (); first += batch_size)
+  {
+    const size_t last = std::min (first + batch_size, scenes.size ());
+    const std::vector<Scene::Ptr> chunk_scenes (scenes.begin () + first,
+                                                scenes.begin () + last);
+    const std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d> >
+      chunk_poses (poses.begin () + first, poses.begin () + last);
+
+    int x_begin = 0;
+    int y_begin = 0;
+    int x_end = batch_rl->getWidth ();
+    int y_end = batch_rl->getHeight ();
+
+    if (depth_images)
+    {
+      batch_rl->renderScenes (chunk_scenes, chunk_poses);
+    }
+    else
+    {
+      // Each tile is scissored to its rectangle, and the readback covers
+      // the bounding box of the rectangles in the batch buffer.
+      const int cols = batch_rl->getCols ();
+      tile_rois.resize (4 * (last - first));
+      x_begin = batch_rl->getWidth ();
+      y_begin = batch_rl->getHeight ();
+      x_end = 0;
+      y_end = 0;
+
+      for (size_t n = first; n < last; ++n)
+      {
+        const DepthImageROI& roi = (*rois)[n];
+        const int tile = static_cast<int> (n - first);
+        tile_rois[4 * tile] = roi.x;
+        tile_rois[4 * tile + 1] = roi.y;
+        tile_rois[4 * tile + 2] = roi.width;
+        tile_rois[4 * tile + 3] = roi.height;
+
+        if (roi.width <= 0 || roi.height <= 0)
+          continue;
+
+        const int x = (tile % cols) * width_ + roi.x;
+        const int y = (tile / cols) * height_ + roi.y;
+        x_begin = std::min (x_begin, x);
+        y_begin = std::min (y_begin, y);
+        x_end = std::max (x_end, x + roi.width);
+        y_end = std::max (y_end, y + roi.height);
+      }
+
+      // Nothing of the chunk is in view.
+      if (x_end <= x_begin || y_end <= y_begin)
+      {
+        for (size_t n = first; n < last; ++n)
+          (*rois)[n].depth.clear ();
+        continue;
+      }
+
+      batch_rl->renderScenes (chunk_scenes, chunk_poses, tile_rois);
+    }
+
+    const int slot = batch_rl->beginDepthReadbackMillimeters (x_begin, y_begin,
+                                                              x_end - x_begin,
+                                                              y_end - y_begin);
+
+    if (pending_slot >= 0)
+    {
+      extractTiles (batch_rl->mapDepthReadbackMillimeters (pending_slot), pending_x,
+                    pending_y, pending_width, pending_first, pending_last, depth_images,
+                    rois);
+      batch_rl->unmapDepthReadback (pending_slot);
+    }
+
+    pending_first = first;
+    pending_last = last;
+    pending_slot = slot;
+    pending_x = x_begin;
+    pending_y = y_begin;
+    pending_width = x_end - x_begin;
+  }
+
+  if (pending_slot >= 0)
+  {
+    extractTiles (batch_rl->mapDepthReadbackMillimeters (pending_slot), pending_x,
+                  pending_y, pending_width, pending_first, pending_last, depth_images,
+                  rois);
+    batch_rl->unmapDepthReadback (pending_slot);
+  }
+}
+
+void
+pcl::simulation::SimExample::extractTiles (const unsigned short* depth_buffer,
+                                           int buffer_x, int buffer_y, int buffer_width,
+                                           size_t first, size_t last,
+                                           std::vector<std::vector<unsigned short> >* depth_images,
+                                           std::vector<DepthImageROI>* rois)
+{
+  const int cols = batch_rl_->getCols ();
+
+  for (size_t n = first; n < last; ++n)
+  {
+    // Tile (row, col) starts at pixel (col*width_, row*height_) and its rows
+    // are already top-down.
+    const int tile = static_cast<int> (n - first);
+    int x = (tile % cols) * width_;
+    int y = (tile / cols) * height_;
+    int width = width_;
+    int height = height_;
+    std::vector<unsigned short>* depth_img;
+
+    if (depth_images)
+    {
+      depth_img = &(*depth_images)[n];
+    }
+    else
+    {
+      DepthImageROI& roi = (*rois)[n];
+      x += roi.x;
+      y += roi.y;
+      width = roi.width;
+      height = roi.height;
+      depth_img = &roi.depth;
+    }
+
+    depth_img->resize (width * height);
+    // Out of view, the tile is not part of the readback.
+    if (depth_img->empty ())
+      continue;
+
+    for (int row = 0; row < height; ++row)
+      memcpy (&(*depth_img)[row * width],
+              depth_buffer + (y - buffer_y + row) * buffer_width + x - buffer_x,
+              width * sizeof (unsigned short));
+  }
+}
+
 void pcl::simulation::SimExample::get_depth_image_cv(const float* depth_buffer, cv::Mat &depth_image)
 {
   int npixels = rl_->getWidth() * rl_->getHeight();
@@ -0,0 +1,317 @@
+/*
+ * software_rasterizer.cpp
+ *
+ * Multi-threaded CPU depth rasterizer, see software_rasterizer.h.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cmath>
+#include <thread>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
+#include <kinect_sim/software_rasterizer.h>
+
+namespace
+{
+// Height of the horizontal strips that a tile is split into for the
+// rasterization phase.
+const int kBandHeight = 32;
+
+// Runs function (i) for i in [0, count) on up to num_threads threads,
+// including the calling thread.
+template <typename Function> void
+parallelFor (int count, int num_threads, const Function &function)
+{
+  std::atomic<int> next (0);
+  auto worker = [&] ()
+  {
+    for (int i = next++; i < count; i = next++)
+      function (i);
+  };
+
+  std::vector<std::thread> threads;
+  for (int t = 1; t < std::min (num_threads, count); ++t)
+    threads.push_back (std::thread (worker));
+
+  worker ();
+
+  for (size_t t = 0; t < threads.size (); ++t)
+    threads[t].join ();
+}
+} // namespace
+
+pcl::simulation::SoftwareRasterizer::SoftwareRasterizer (int rows, int cols,
+                                                         int row_height,
+                                                         int col_width,
+                                                         int num_threads)
+  : rows_ (rows), cols_ (cols), row_height_ (row_height),
+    col_width_ (col_width), width_ (cols * col_width),
+    num_threads_ (num_threads),
+    tile_triangles_ (rows * cols),
+    tile_clip_vertices_ (rows * cols)
+{
+  if (num_threads_ <= 0)
+    num_threads_ = std::max (1, static_cast<int> (std::thread::hardware_concurrency ()));
+}
+
+void
+pcl::simulation::SoftwareRasterizer::render (const std::vector<Scene::Ptr> &scenes,
+                                             const Matrices &views,
+                                             const Eigen::Matrix4f &projection,
+                                             float *depth_buffer)
+{
+  assert (scenes.size () == views.size ());
+  const int num_tiles = rows_ * cols_;
+  const int num_scenes = std::min (num_tiles, static_cast<int> (scenes.size ()));
+
+  // Phase 1: transform, clip and set up the triangles of every tile.
+  parallelFor (num_tiles, num_threads_, [&] (int tile)
+  {
+    tile_triangles_[tile].clear ();
+    if (tile < num_scenes && scenes[tile])
+      setupTile (tile, *scenes[tile], projection * views[tile]);
+  });
+
+  // Phase 2: clear and rasterize each band of each tile. A band is only
+  // touched by the thread that owns it, so no synchronization is needed.
+  const int bands_per_tile = (row_height_ + kBandHeight - 1) / kBandHeight;
+  parallelFor (num_tiles * bands_per_tile, num_threads_, [&] (int item)
+  {
+    const int tile = item / bands_per_tile;
+    const int y_begin = (item % bands_per_tile) * kBandHeight;
+    const int y_end = std::min (row_height_, y_begin + kBandHeight);
+    rasterizeBand (tile, y_begin, y_end, depth_buffer);
+  });
+}
+
+void
+pcl::simulation::SoftwareRasterizer::setupTile (int tile, const Scene &scene,
+                                                const Eigen::Matrix4f &view_projection)
+{
+  std::vector<Eigen::Vector4f, Eigen::aligned_allocator<Eigen::Vector4f> > &clip =
+    tile_clip_vertices_[tile];
+
+  const std::vector<Model::Ptr> &models = scene.getModels ();
+  for (size_t m = 0; m < models.size (); ++m)
+  {
+    const Vertices *vertices = models[m]->getVertices ();
+    const Indices *indices = models[m]->getIndices ();
+    if (vertices == NULL || indices == NULL)
+      continue;
+
+    const Eigen::Matrix4f mvp = view_projection * models[m]->getTransform ();
+    clip.resize (vertices->size ());
+    for (size_t i = 0; i < vertices->size (); ++i)
+      clip[i] = mvp * (*vertices)[i].pos.homogeneous ();
+
+    for (size_t i = 0; i + 2 < indices->size (); i += 3)
+      addTriangle (tile, clip[(*indices)[i]], clip[(*indices)[i + 1]],
+                   clip[(*indices)[i + 2]]);
+  }
+}
+
+void
+pcl::simulation::SoftwareRasterizer::addTriangle (int tile,
+                                                  const Eigen::Vector4f &c0,
+                                                  const Eigen::Vector4f &c1,
+                                                  const Eigen::Vector4f &c2)
+{
+  // Clip against the near plane z + w >= 0. The remaining planes are handled
+  // by the screen bounding box and the depth test against the cleared far
+  // value.
+  const Eigen::Vector4f *in[3] = {&c0, &c1, &c2};
+  float d[3];
+  int inside = 0;
+  for (int i = 0; i < 3; ++i)
+  {
+    d[i] = (*in[i])(2) + (*in[i])(3);
+    if (d[i] >= 0)
+      ++inside;
+  }
+
+  if (inside == 0)
+    return;
+
+  if (inside == 3)
+  {
+    addClippedTriangle (tile, c0, c1, c2);
+    return;
+  }
+
+  Eigen::Vector4f out[4];
+  int n = 0;
+  for (int i = 0; i < 3; ++i)
+  {
+    const int j = (i + 1) % 3;
+    if (d[i] >= 0)
+      out[n++] = *in[i];
+    if ((d[i] >= 0) != (d[j] >= 0))
+    {
+      const float t = d[i] / (d[i] - d[j]);
+      out[n++] = *in[i] + t * (*in[j] - *in[i]);
+    }
+  }
+
+  addClippedTriangle (tile, out[0], out[1], out[2]);
+  if (n == 4)
+    addClippedTriangle (tile, out[0], out[2], out[3]);
+}
+
+void
+pcl::simulation::SoftwareRasterizer::addClippedTriangle (int tile,
+                                                         const Eigen::Vector4f &c0,
+                                                         const Eigen::Vector4f &c1,
+                                                         const Eigen::Vector4f &c2)
+{
+  // Window coordinates within the tile, shifted by half a pixel so that
+  // pixel (i, j) is sampled at integer coordinates like OpenGL samples
+  // pixel centers.
+  const Eigen::Vector4f *c[3] = {&c0, &c1, &c2};
+  double x[3], y[3], z[3];
+  for (int i = 0; i < 3; ++i)
+  {
+    const double w = (*c[i])(3);
+    x[i] = 0.5 * ((*c[i])(0) / w + 1.0) * col_width_ - 0.5;
+    y[i] = 0.5 * ((*c[i])(1) / w + 1.0) * row_height_ - 0.5;
+    z[i] = 0.5 * ((*c[i])(2) / w + 1.0);
+  }
+
+  if (z[0] > 1.0 && z[1] > 1.0 && z[2] > 1.0)
+    return;
+
+  double area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+  if (area == 0.0 || !std::isfinite (area))
+    return;
+
+  // Faces are not culled, so bring both windings to counter-clockwise.
+  if (area < 0)
+  {
+    std::swap (x[1], x[2]);
+    std::swap (y[1], y[2]);
+    std::swap (z[1], z[2]);
+    area = -area;
+  }
+
+  // Clamp in floating point first, vertices close to the eye plane can
+  // project far outside the range of int.
+  const double min_x = std::max (0.0, std::ceil (std::min (x[0], std::min (x[1], x[2]))));
+  const double max_x = std::min (col_width_ - 1.0, std::floor (std::max (x[0], std::max (x[1], x[2]))));
+  const double min_y = std::max (0.0, std::ceil (std::min (y[0], std::min (y[1], y[2]))));
+  const double max_y = std::min (row_height_ - 1.0, std::floor (std::max (y[0], std::max (y[1], y[2]))));
+  if (min_x > max_x || min_y > max_y)
+    return;
+
+  Triangle t;
+  t.min_x = static_cast<int> (min_x);
+  t.max_x = static_cast<int> (max_x);
+  t.min_y = static_cast<int> (min_y);
+  t.max_y = static_cast<int> (max_y);
+
+  double za = 0, zb = 0, zc = 0;
+  for (int k = 0; k < 3; ++k)
+  {
+    const int a = k;
+    const int b = (k + 1) % 3;
+    const double ea = y[a] - y[b];
+    const double eb = x[b] - x[a];
+    const double ec = x[a] * y[b] - x[b] * y[a];
+    t.a[k] = static_cast<float> (ea);
+    t.b[k] = eb;
+    t.c[k] = ec;
+    // Pixels exactly on an edge belong to the triangle if it is a left edge
+    // or a horizontal top edge.
+    t.top_left[k] = ea > 0 || (ea == 0 && eb < 0);
+
+    // Edge k is opposite vertex (k + 2) % 3 and its edge function divided by
+    // the area is that vertex's barycentric weight.
+    const double zv = z[(k + 2) % 3] / area;
+    za += zv * ea;
+    zb += zv * eb;
+    zc += zv * ec;
+  }
+  t.za = static_cast<float> (za);
+  t.zb = zb;
+  t.zc = zc;
+
+  tile_triangles_[tile].push_back (t);
+}
+
+void
+pcl::simulation::SoftwareRasterizer::rasterizeBand (int tile, int y_begin,
+                                                    int y_end,
+                                                    float *depth_buffer) const
+{
+  const int tile_x = (tile % cols_) * col_width_;
+  const int tile_y = (tile / cols_) * row_height_;
+
+  for (int y = y_begin; y < y_end; ++y)
+  {
+    float *row = depth_buffer + (tile_y + y) * width_ + tile_x;
+    std::fill (row, row + col_width_, 1.0f);
+  }
+
+  const std::vector<Triangle> &triangles = tile_triangles_[tile];
+  for (size_t i = 0; i < triangles.size (); ++i)
+  {
+    const Triangle &t = triangles[i];
+    const int y0 = std::max (t.min_y, y_begin);
+    const int y1 = std::min (t.max_y + 1, y_end);
+
+    for (int y = y0; y < y1; ++y)
+    {
+      float *row = depth_buffer + (tile_y + y) * width_ + tile_x;
+      float e_row[3];
+      for (int k = 0; k < 3; ++k)
+        e_row[k] = static_cast<float> (t.b[k] * y + t.c[k]);
+      const float z_row = static_cast<float> (t.zb * y + t.zc);
+
+      int x = t.min_x;
+#ifdef __SSE2__
+      const __m128 zero = _mm_setzero_ps ();
+      const __m128 lane = _mm_setr_ps (0.0f, 1.0f, 2.0f, 3.0f);
+      for (; x + 3 <= t.max_x; x += 4)
+      {
+        const __m128 xs = _mm_add_ps (_mm_set1_ps (static_cast<float> (x)), lane);
+        __m128 mask = _mm_castsi128_ps (_mm_set1_epi32 (-1));
+        for (int k = 0; k < 3; ++k)
+        {
+          const __m128 e = _mm_add_ps (_mm_set1_ps (e_row[k]),
+                                       _mm_mul_ps (_mm_set1_ps (t.a[k]), xs));
+          mask = _mm_and_ps (mask, t.top_left[k] ? _mm_cmpge_ps (e, zero)
+                                                 : _mm_cmpgt_ps (e, zero));
+        }
+        if (_mm_movemask_ps (mask) == 0)
+          continue;
+
+        const __m128 z = _mm_add_ps (_mm_set1_ps (z_row),
+                                     _mm_mul_ps (_mm_set1_ps (t.za), xs));
+        const __m128 old_z = _mm_loadu_ps (row + x);
+        const __m128 pass = _mm_and_ps (mask, _mm_cmplt_ps (z, old_z));
+        _mm_storeu_ps (row + x, _mm_or_ps (_mm_and_ps (pass, z),
+                                           _mm_andnot_ps (pass, old_z)));
+      }
+#endif
+      for (; x <= t.max_x; ++x)
+      {
+        const float xf = static_cast<float> (x);
+        bool inside = true;
+        for (int k = 0; k < 3 && inside; ++k)
+        {
+          const float e = e_row[k] + t.a[k] * xf;
+          inside = e > 0 || (e == 0 && t.top_left[k]);
+        }
+        if (!inside)
+          continue;
+
+        const float z = z_row + t.za * xf;
+        if (z < row[x])
+          row[x] = z;
+      }
+    }
+  }
+}
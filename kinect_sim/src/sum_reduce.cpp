@@ -1,37 +1,75 @@
 #include <kinect_sim/sum_reduce.h>
 
+#include <algorithm>
+#include <cassert>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #include <ros/package.h>
 
 using namespace pcl::simulation;
 
 const std::string kSumScoreVertFile =  ros::package::getPath("kinect_sim") +
                               "/src/sum_score.vert";
-const std::string kSumScoreFragFile =  ros::package::getPath("kinect_sim") +
-                              "/src/sum_score.frag";
+const std::string kReduceFragFile =  ros::package::getPath("kinect_sim") +
+                              "/src/reduce.frag";
+
+namespace
+{
+  GLenum
+  channelsFormat (int channels)
+  {
+    return channels == 1 ? GL_RED : (channels == 2 ? GL_RG : GL_RGBA);
+  }
+
+  GLint
+  channelsInternalFormat (int channels)
+  {
+    return channels == 1 ? GL_R32F : (channels == 2 ? GL_RG32F : GL_RGBA32F);
+  }
 
-pcl::simulation::SumReduce::SumReduce (int width, int height, int levels) : levels_ (levels),
-                                                                            width_ (width),
-                                                                            height_ (height)
+  inline float
+  combine (Reduce::Operation operation, float a, float b)
+  {
+    switch (operation)
+    {
+      case Reduce::MIN:
+        return std::min (a, b);
+      case Reduce::MAX:
+        return std::max (a, b);
+      default:
+        return a + b;
+    }
+  }
+}
+
+pcl::simulation::Reduce::Reduce (int width, int height, int levels, int channels) : levels_ (levels),
+                                                                                    width_ (width),
+                                                                                    height_ (height),
+                                                                                    channels_ (channels)
 {
-  std::cout << "SumReduce: levels: " << levels_ << std::endl;
+  std::cout << "Reduce: levels: " << levels_ << " channels: " << channels_ << std::endl;
+  assert (channels_ == 1 || channels_ == 2 || channels_ == 4);
 
   // Load shader
-  sum_program_ = gllib::Program::Ptr (new gllib::Program ());
+  reduce_program_ = gllib::Program::Ptr (new gllib::Program ());
   // TODO: to remove file dependency include the shader source in the binary
-  if (!sum_program_->addShaderFile (kSumScoreVertFile.c_str(), gllib::VERTEX))
+  if (!reduce_program_->addShaderFile (kSumScoreVertFile.c_str(), gllib::VERTEX))
   {
     std::cout << "Failed loading vertex shader" << std::endl;
     exit (-1);
   }
 
   // TODO: to remove file dependency include the shader source in the binary
-  if (!sum_program_->addShaderFile (kSumScoreFragFile.c_str(), gllib::FRAGMENT))
+  if (!reduce_program_->addShaderFile (kReduceFragFile.c_str(), gllib::FRAGMENT))
   {
     std::cout << "Failed loading fragment shader" << std::endl;
     exit (-1);
   }
 
-  sum_program_->link ();
+  reduce_program_->link ();
 
   // Setup the framebuffer object for rendering
   glGenFramebuffers (1, &fbo_);
@@ -54,23 +92,29 @@ pcl::simulation::SumReduce::SumReduce (int width, int height, int levels) : leve
     glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_NONE);
     glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
-    glTexImage2D (GL_TEXTURE_2D, 0, GL_R32F, level_width, level_height, 0, GL_RED, GL_FLOAT, NULL);
+    glTexImage2D (GL_TEXTURE_2D, 0, channelsInternalFormat (channels_), level_width,
+                  level_height, 0, channelsFormat (channels_), GL_FLOAT, NULL);
     glBindTexture (GL_TEXTURE_2D, 0);
   }
 }
 
-pcl::simulation::SumReduce::~SumReduce ()
+pcl::simulation::Reduce::~Reduce ()
 {
   glDeleteTextures (levels_, arrays_);
   glDeleteFramebuffers (1, &fbo_);
+  delete [] arrays_;
 }
 
 void
-pcl::simulation::SumReduce::sum (GLuint input_array, float* output_array)
+pcl::simulation::Reduce::reduce (GLuint input_array,
+                                 const std::vector<Operation> &operations,
+                                 float* output_array)
 {
+  assert (static_cast<int> (operations.size ()) == channels_);
+
   if (gllib::getGLError () != GL_NO_ERROR)
   {
-    std::cout << "SumReduce::sum enter" << std::endl;
+    std::cout << "Reduce::reduce enter" << std::endl;
   }
 
   glDisable (GL_DEPTH_TEST);
@@ -83,12 +127,18 @@ pcl::simulation::SumReduce::sum (GLuint input_array, float* output_array)
   glBindTexture (GL_TEXTURE_2D, input_array);
 
   // use program
-  sum_program_->use ();
-  glUniform1i (sum_program_->getUniformLocation ("ArraySampler"), 0);
+  reduce_program_->use ();
+  glUniform1i (reduce_program_->getUniformLocation ("ArraySampler"), 0);
+
+  // Channels the array does not have are summed and then dropped.
+  GLint channel_operations[4] = {SUM, SUM, SUM, SUM};
+  std::copy (operations.begin (), operations.end (), channel_operations);
+  glUniform4iv (reduce_program_->getUniformLocation ("operations"), 1,
+                channel_operations);
 
   if (gllib::getGLError () != GL_NO_ERROR)
   {
-    std::cout << "SumReduce::sum  set sampler" << std::endl;
+    std::cout << "Reduce::reduce  set uniforms" << std::endl;
   }
 
   for (int i=0; i < levels_; ++i)
@@ -98,18 +148,11 @@ pcl::simulation::SumReduce::sum (GLuint input_array, float* output_array)
 
     glViewport (0, 0, width/2, height/2);
 
-    float step_x = 1.0f / float (width);
-    float step_y = 1.0f / float (height);
-    sum_program_->setUniform ("step_x", step_x);
-    sum_program_->setUniform ("step_y", step_y);
-    //float step_x = 1.0f / static_cast<float> (width);
-    //float step_y = 1.0f / static_cast<float> (height);
-
     quad_.render ();
 
     if (gllib::getGLError () != GL_NO_ERROR)
     {
-      std::cout << "SumReduce::sum  render" << std::endl;
+      std::cout << "Reduce::reduce  render" << std::endl;
     }
 
     width = width / 2;
@@ -129,12 +172,109 @@ pcl::simulation::SumReduce::sum (GLuint input_array, float* output_array)
   // Final results is in arrays_[levels_-1]
   glActiveTexture (GL_TEXTURE0);
   glBindTexture (GL_TEXTURE_2D, arrays_[levels_-1]);
-  glGetTexImage (GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, output_array);
+  glGetTexImage (GL_TEXTURE_2D, 0, channelsFormat (channels_), GL_FLOAT, output_array);
   glBindTexture (GL_TEXTURE_2D, 0);
 
   if (gllib::getGLError () != GL_NO_ERROR)
   {
-    std::cout << "Error: SumReduce exit" << std::endl;
+    std::cout << "Error: Reduce exit" << std::endl;
+  }
+}
+
+void
+pcl::simulation::Reduce::reduce (const float* input_array, int width, int height,
+                                 int levels, int channels,
+                                 const std::vector<Operation> &operations,
+                                 float* output_array)
+{
+  assert (channels == 1 || channels == 2 || channels == 4);
+  assert (static_cast<int> (operations.size ()) == channels);
+
+  // Halving levels times is the same as reducing blocks of 2^levels pixels.
+  const int block = 1 << levels;
+  const int block_row_length = block * channels;
+  const int output_width = width >> levels;
+  const int output_height = height >> levels;
+
+  for (int out_y = 0; out_y < output_height; ++out_y)
+  {
+    for (int out_x = 0; out_x < output_width; ++out_x)
+    {
+      const float *first = input_array + (out_y * block * width + out_x * block) * channels;
+      float *out = output_array + (out_y * output_width + out_x) * channels;
+
+#ifdef __SSE2__
+      // A block row is a multiple of four floats, so lane l of the
+      // accumulators only ever sees channel l % channels.
+      if (block_row_length >= 4)
+      {
+        __m128 sum = _mm_setzero_ps ();
+        __m128 lo = _mm_loadu_ps (first);
+        __m128 hi = lo;
+
+        for (int y = 0; y < block; ++y)
+        {
+          const float *row = first + y * width * channels;
+
+          for (int x = 0; x < block_row_length; x += 4)
+          {
+            const __m128 value = _mm_loadu_ps (row + x);
+            sum = _mm_add_ps (sum, value);
+            lo = _mm_min_ps (lo, value);
+            hi = _mm_max_ps (hi, value);
+          }
+        }
+
+        float lanes[3][4];
+        _mm_storeu_ps (lanes[SUM], sum);
+        _mm_storeu_ps (lanes[MIN], lo);
+        _mm_storeu_ps (lanes[MAX], hi);
+
+        for (int c = 0; c < channels; ++c)
+        {
+          const float *lane = lanes[operations[c]];
+          float value = lane[c];
+
+          for (int l = c + channels; l < 4; l += channels)
+          {
+            value = combine (operations[c], value, lane[l]);
+          }
+
+          out[c] = value;
+        }
+
+        continue;
+      }
+#endif
+
+      for (int c = 0; c < channels; ++c)
+      {
+        out[c] = operations[c] == SUM ? 0.0f : first[c];
+      }
+
+      for (int y = 0; y < block; ++y)
+      {
+        const float *row = first + y * width * channels;
+
+        for (int x = 0; x < block_row_length; x += channels)
+        {
+          for (int c = 0; c < channels; ++c)
+          {
+            out[c] = combine (operations[c], out[c], row[x + c]);
+          }
+        }
+      }
+    }
   }
 }
 
+pcl::simulation::SumReduce::SumReduce (int width, int height, int levels) :
+  Reduce (width, height, levels, 1)
+{
+}
+
+void
+pcl::simulation::SumReduce::sum (GLuint input_array, float* output_array)
+{
+  reduce (input_array, std::vector<Operation> (1, SUM), output_array);
+}
@@ -0,0 +1,666 @@
+/**
+ * Headless rendering benchmark for the simulation library.
+ *
+ * Renders scenes made of household object models into an offscreen EGL
+ * context (or with the software rasterizer) and measures, for every
+ * combination of the swept parameters:
+ *
+ *  - render throughput: images rendered per second, waiting for the GPU to
+ *    finish every pass,
+ *  - depth readback latency of the float, millimetre, ROI and asynchronous
+ *    (pixel buffer object) readback paths,
+ *  - end-to-end throughput of building a scene, rendering it and copying
+ *    out its depth image, which is the work sbpl_perception does per search
+ *    state in EnvObjectRecognition::GetDepthImage.
+ *
+ * The sweeps are over the fraction of model triangles kept by quadric
+ * decimation, the tile grid of the framebuffer, the readback mode and the
+ * number of objects per scene. Results go to stdout or a file as JSON or CSV.
+ *
+ * kinect_sim_benchmark -model_bank `rospack find sbpl_perception`/config/household_objects.xml
+ * kinect_sim_benchmark -format csv -output results.csv mug.ply bowl.obj
+ */
+
+#include <Eigen/Dense>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <kinect_sim/simulation_io.hpp>
+#include <kinect_sim/model.h>
+
+#include <pcl/console/parse.h>
+#include <pcl/console/print.h>
+#include <pcl/console/time.h>
+#include <pcl/surface/vtk_smoothing/vtk_mesh_quadric_decimation.h>
+
+#include <ros/package.h>
+
+using namespace pcl::console;
+using namespace pcl::simulation;
+
+typedef std::vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d> > PoseVector;
+
+namespace
+{
+  // Same image size and intrinsics as SimExample and sbpl_perception.
+  const int kWidth = 640;
+  const int kHeight = 480;
+  const float kFocalLength = 576.09757860f;
+  const float kCx = 321.06398107f;
+  const float kCy = 242.97676897f;
+
+  // Models are scaled to kObjectSize (m) and laid out on a grid with
+  // kObjectSpacing between centres, kSceneDistance in front of the camera.
+  const float kObjectSize = 0.15f;
+  const float kObjectSpacing = 0.2f;
+  const float kSceneDistance = 1.5f;
+
+  // Untimed iterations run before every measurement, e.g. to upload models.
+  const int kWarmupIterations = 2;
+
+  enum ReadbackMode
+  {
+    READBACK_FLOAT,
+    READBACK_MM,
+    READBACK_ROI,
+    READBACK_ASYNC
+  };
+
+  struct BenchmarkModel
+  {
+    Model::Ptr model;
+    // Centres the model at the origin and scales it to kObjectSize.
+    Eigen::Matrix4f normalization;
+    int triangles;
+  };
+
+  struct Result
+  {
+    std::string renderer;
+    std::string readback;
+    int grid_rows;
+    int grid_cols;
+    int objects;
+    double triangle_fraction;
+    double triangles_per_scene;
+    int images;
+    // Per image.
+    double build_ms;
+    double render_ms;
+    // Per readback call, i.e. per batch of grid_rows * grid_cols images.
+    double readback_ms;
+    // Scene build, render, readback and copying out the tiles, per image.
+    double end_to_end_ms;
+  };
+}
+
+void
+printHelp (int, char **argv)
+{
+  print_error ("Syntax is: %s [options] [model files]\n", argv[0]);
+  print_info ("  where options are:\n");
+  print_info ("    -model_bank <file>  : also use the models of a rosparam model bank,\n");
+  print_info ("                          e.g. sbpl_perception/config/household_objects.xml\n");
+  print_info ("    -renderer <name>    : egl (default), glut or software\n");
+  print_info ("    -triangles <f,...>  : fractions of the triangles kept (default 1,0.5,0.25,0.125)\n");
+  print_info ("    -grids <RxC,...>    : framebuffer tile grids (default 1x1,2x2,4x4)\n");
+  print_info ("    -readback <m,...>   : float, mm, roi, async (default all). roi only runs\n");
+  print_info ("                          with the 1x1 grid, as in SimExample::doRenderROI\n");
+  print_info ("    -objects <n,...>    : objects per scene (default 1,2,4,8)\n");
+  print_info ("    -iterations <n>     : timed batches per measurement (default 20)\n");
+  print_info ("    -format <name>      : json (default) or csv\n");
+  print_info ("    -output <file>      : write results to file instead of stdout\n");
+  print_info ("acceptable model files include vtk, obj and ply\n");
+  print_info ("with async readback the render time is only the submission time, since\n");
+  print_info ("waiting for the GPU would defeat the overlap; compare end-to-end times\n");
+}
+
+std::vector<std::string>
+split (const std::string& str, char delimiter)
+{
+  std::vector<std::string> tokens;
+  std::stringstream ss (str);
+  std::string token;
+  while (std::getline (ss, token, delimiter))
+  {
+    if (!token.empty ())
+      tokens.push_back (token);
+  }
+  return tokens;
+}
+
+// Model files of a model bank such as sbpl_perception/config/household_objects.xml,
+// whose entries refer to files as $(find package)/relative/path.
+bool
+readModelBank (const std::string& bank_file, std::vector<std::string>& files)
+{
+  std::ifstream file (bank_file.c_str ());
+  if (!file.good ())
+    return false;
+
+  std::stringstream ss;
+  ss << file.rdbuf ();
+  const std::string contents = ss.str ();
+  const std::string find_tag = "$(find ";
+
+  size_t pos = contents.find (find_tag);
+  while (pos != std::string::npos)
+  {
+    const size_t package_begin = pos + find_tag.size ();
+    const size_t package_end = contents.find (')', package_begin);
+    if (package_end == std::string::npos)
+      break;
+
+    const size_t path_end = contents.find_first_of (", \t\r\n]", package_end + 1);
+    const std::string package = contents.substr (package_begin, package_end - package_begin);
+    const std::string package_path = ros::package::getPath (package);
+
+    if (package_path.empty ())
+      print_warn ("Package %s of model bank %s not found\n", package.c_str (), bank_file.c_str ());
+    else
+      files.push_back (package_path + contents.substr (package_end + 1, path_end - package_end - 1));
+
+    pos = contents.find (find_tag, package_end);
+  }
+  return true;
+}
+
+// Decimates every mesh to triangle_fraction of its triangles and wraps it in
+// a model. The GL buffers are created on first draw.
+void
+makeModels (const std::vector<pcl::PolygonMesh::Ptr>& meshes, double triangle_fraction,
+            std::vector<BenchmarkModel>& models)
+{
+  models.clear ();
+  for (size_t i = 0; i < meshes.size (); ++i)
+  {
+    pcl::PolygonMesh::Ptr mesh = meshes[i];
+    if (triangle_fraction < 1.0)
+    {
+      mesh.reset (new pcl::PolygonMesh);
+      pcl::MeshQuadricDecimationVTK decimation;
+      decimation.setInputMesh (meshes[i]);
+      decimation.setTargetReductionFactor (static_cast<float> (1.0 - triangle_fraction));
+      decimation.process (*mesh);
+    }
+
+    BenchmarkModel model;
+    model.model = Model::Ptr (new TriangleMeshModel (mesh));
+    model.triangles = static_cast<int> (model.model->getIndices ()->size () / 3);
+
+    Eigen::Vector3f min_pt, max_pt;
+    if (!model.model->getBoundingBox (min_pt, max_pt) || model.triangles == 0)
+    {
+      print_warn ("Skipping empty model %zu\n", i);
+      continue;
+    }
+
+    const float extent = (max_pt - min_pt).maxCoeff ();
+    const float scale = extent > 0.0f ? kObjectSize / extent : 1.0f;
+    const Eigen::Affine3f normalization = Eigen::Scaling (scale) *
+                                          Eigen::Translation3f (-0.5f * (min_pt + max_pt));
+    model.normalization = normalization.matrix ();
+    models.push_back (model);
+  }
+}
+
+// Fills scene with num_objects models on a grid facing the camera. Models
+// and their rotation change with variant, so consecutive scenes differ.
+void
+buildScene (const std::vector<BenchmarkModel>& models, int num_objects, int variant,
+            Scene& scene)
+{
+  scene.clear ();
+  const int grid = static_cast<int> (std::ceil (std::sqrt (static_cast<double> (num_objects))));
+
+  for (int i = 0; i < num_objects; ++i)
+  {
+    const BenchmarkModel& model = models[(i + variant) % models.size ()];
+    // The camera looks along x with z up, so the grid spans the y-z plane.
+    const Eigen::Affine3f placement =
+      Eigen::Translation3f (kSceneDistance,
+                            (i % grid - 0.5f * (grid - 1)) * kObjectSpacing,
+                            (i / grid - 0.5f * (grid - 1)) * kObjectSpacing) *
+      Eigen::AngleAxisf (0.1f * variant, Eigen::Vector3f::UnitZ ());
+    scene.add (Model::Ptr (new TransformedModel (model.model,
+                                                 placement.matrix () * model.normalization)));
+  }
+}
+
+// Copies tile n of a batch buffer (layout of getDepthBufferMillimeters ())
+// into images[n], for the first num_images tiles.
+template <typename T> void
+copyTiles (const T* buffer, int cols, int num_images, std::vector<std::vector<T> >& images)
+{
+  const int buffer_width = cols * kWidth;
+  images.resize (num_images);
+
+  for (int n = 0; n < num_images; ++n)
+  {
+    const int row = n / cols;
+    const int col = n % cols;
+    images[n].resize (kWidth * kHeight);
+
+    for (int y = 0; y < kHeight; ++y)
+    {
+      const T* src = buffer + (row * kHeight + y) * buffer_width + col * kWidth;
+      std::copy (src, src + kWidth, &images[n][y * kWidth]);
+    }
+  }
+}
+
+void
+finish (bool software)
+{
+  if (!software)
+    glFinish ();
+}
+
+bool
+runMeasurement (const std::vector<BenchmarkModel>& models, bool software,
+                int iterations, ReadbackMode mode, Result& result)
+{
+  const int batch_size = result.grid_rows * result.grid_cols;
+
+  std::vector<Scene::Ptr> scenes (batch_size);
+  for (int n = 0; n < batch_size; ++n)
+    scenes[n] = Scene::Ptr (new Scene ());
+  const PoseVector poses (batch_size, Eigen::Isometry3d::Identity ());
+
+  // renderPose () draws the scene the RangeLikelihood was created with,
+  // which for the 1x1 grid of the ROI mode is scenes[0].
+  RangeLikelihood::Ptr rl (new RangeLikelihood (result.grid_rows, result.grid_cols, kHeight,
+                                                kWidth, scenes[0], software));
+  rl->setCameraIntrinsicsParameters (kWidth, kHeight, kFocalLength, kFocalLength, kCx, kCy);
+  rl->setComputeOnCPU (false);
+  rl->setSumOnCPU (true);
+  rl->setUseColor (false);
+
+  std::vector<std::vector<float> > float_images;
+  std::vector<std::vector<unsigned short> > mm_images;
+  DepthImageROI roi;
+  int pending_slot = -1;
+  int pending_images = 0;
+
+  double build_s = 0.0;
+  double render_s = 0.0;
+  double readback_s = 0.0;
+  double total_s = 0.0;
+  int readbacks = 0;
+  int images = 0;
+
+  for (int iteration = -kWarmupIterations; iteration < iterations; ++iteration)
+  {
+    const bool timed = iteration >= 0;
+    const double start = getTime ();
+
+    for (int n = 0; n < batch_size; ++n)
+      buildScene (models, result.objects, (iteration + kWarmupIterations) * batch_size + n,
+                  *scenes[n]);
+    const double built = getTime ();
+
+    double rendered = built;
+    double read = built;
+
+    if (mode == READBACK_ROI)
+    {
+      const Eigen::Isometry3d& pose = poses[0];
+      if (!rl->getScreenBoundingBox (*scenes[0], pose, roi.x, roi.y, roi.width, roi.height))
+      {
+        roi.x = 0;
+        roi.y = 0;
+        roi.width = kWidth;
+        roi.height = kHeight;
+      }
+
+      roi.depth.resize (roi.width * roi.height);
+      if (!roi.depth.empty ())
+      {
+        rl->renderPose (pose, roi.x, roi.y, roi.width, roi.height);
+        finish (software);
+        rendered = getTime ();
+        rl->getDepthBufferMillimeters (roi.x, roi.y, roi.width, roi.height, &roi.depth[0]);
+      }
+      else
+      {
+        rendered = getTime ();
+      }
+      read = getTime ();
+    }
+    else
+    {
+      rl->renderScenes (scenes, poses);
+      if (mode != READBACK_ASYNC)
+        finish (software);
+      rendered = getTime ();
+
+      if (mode == READBACK_FLOAT)
+      {
+        copyTiles (rl->getDepthBuffer (), result.grid_cols, batch_size, float_images);
+      }
+      else if (mode == READBACK_MM)
+      {
+        copyTiles (rl->getDepthBufferMillimeters (), result.grid_cols, batch_size, mm_images);
+      }
+      else
+      {
+        // Wait for the previous batch only after this one has been queued,
+        // like SimExample::renderBatch.
+        const int slot = rl->beginDepthReadbackMillimeters ();
+        if (pending_slot >= 0)
+        {
+          copyTiles (rl->mapDepthReadbackMillimeters (pending_slot), result.grid_cols,
+                     pending_images, mm_images);
+          rl->unmapDepthReadback (pending_slot);
+        }
+        pending_slot = slot;
+        pending_images = batch_size;
+      }
+      read = getTime ();
+    }
+
+    if (timed)
+    {
+      build_s += built - start;
+      render_s += rendered - built;
+      readback_s += read - rendered;
+      total_s += read - start;
+      ++readbacks;
+      images += batch_size;
+    }
+  }
+
+  if (pending_slot >= 0)
+  {
+    const double start = getTime ();
+    copyTiles (rl->mapDepthReadbackMillimeters (pending_slot), result.grid_cols,
+               pending_images, mm_images);
+    rl->unmapDepthReadback (pending_slot);
+    const double elapsed = getTime () - start;
+    readback_s += elapsed;
+    total_s += elapsed;
+  }
+
+  if (images == 0)
+    return false;
+
+  result.images = images;
+  result.build_ms = 1000.0 * build_s / images;
+  result.render_ms = 1000.0 * render_s / images;
+  result.readback_ms = 1000.0 * readback_s / readbacks;
+  result.end_to_end_ms = 1000.0 * total_s / images;
+  return true;
+}
+
+void
+writeResults (const std::vector<Result>& results, const std::string& format, std::ostream& out)
+{
+  const char* const columns[] = {"renderer", "readback", "grid_rows", "grid_cols", "objects",
+                                 "triangle_fraction", "triangles_per_scene", "images",
+                                 "build_ms", "render_ms", "renders_per_sec", "readback_ms",
+                                 "end_to_end_ms", "end_to_end_images_per_sec"};
+  const size_t num_columns = sizeof (columns) / sizeof (columns[0]);
+
+  if (format == "csv")
+  {
+    for (size_t c = 0; c < num_columns; ++c)
+      out << (c == 0 ? "" : ",") << columns[c];
+    out << "\n";
+  }
+  else
+  {
+    out << "[\n";
+  }
+
+  for (size_t i = 0; i < results.size (); ++i)
+  {
+    const Result& r = results[i];
+    std::vector<std::string> values;
+    std::stringstream ss;
+
+    // Strings are quoted in JSON only; none of them contain commas or quotes.
+    const std::string quote = format == "csv" ? "" : "\"";
+    values.push_back (quote + r.renderer + quote);
+    values.push_back (quote + r.readback + quote);
+
+    const double numbers[] = {static_cast<double> (r.grid_rows), static_cast<double> (r.grid_cols),
+                              static_cast<double> (r.objects), r.triangle_fraction,
+                              r.triangles_per_scene, static_cast<double> (r.images), r.build_ms,
+                              r.render_ms, r.render_ms > 0.0 ? 1000.0 / r.render_ms : 0.0,
+                              r.readback_ms, r.end_to_end_ms,
+                              r.end_to_end_ms > 0.0 ? 1000.0 / r.end_to_end_ms : 0.0};
+    for (size_t n = 0; n < sizeof (numbers) / sizeof (numbers[0]); ++n)
+    {
+      ss.str ("");
+      ss << numbers[n];
+      values.push_back (ss.str ());
+    }
+
+    if (format == "csv")
+    {
+      for (size_t c = 0; c < num_columns; ++c)
+        out << (c == 0 ? "" : ",") << values[c];
+      out << "\n";
+    }
+    else
+    {
+      out << "  {";
+      for (size_t c = 0; c < num_columns; ++c)
+        out << (c == 0 ? "" : ", ") << "\"" << columns[c] << "\": " << values[c];
+      out << (i + 1 < results.size () ? "},\n" : "}\n");
+    }
+  }
+
+  if (format != "csv")
+    out << "]\n";
+}
+
+int
+main (int argc, char** argv)
+{
+  if (argc < 2 || find_switch (argc, argv, "-h"))
+  {
+    printHelp (argc, argv);
+    return (-1);
+  }
+
+  std::vector<std::string> files;
+  const char* const extensions[] = {".ply", ".obj", ".vtk"};
+  for (size_t e = 0; e < sizeof (extensions) / sizeof (extensions[0]); ++e)
+  {
+    const std::vector<int> indices = parse_file_extension_argument (argc, argv, extensions[e]);
+    for (size_t i = 0; i < indices.size (); ++i)
+      files.push_back (argv[indices[i]]);
+  }
+
+  std::string model_bank;
+  if (parse_argument (argc, argv, "-model_bank", model_bank) > 0 &&
+      !readModelBank (model_bank, files))
+  {
+    print_error ("Could not read model bank %s\n", model_bank.c_str ());
+    return (-1);
+  }
+
+  std::string renderer = "egl";
+  std::string grids_arg = "1x1,2x2,4x4";
+  std::string readback_arg = "float,mm,roi,async";
+  std::string format = "json";
+  std::string output;
+  int iterations = 20;
+  std::vector<double> triangle_fractions;
+  std::vector<int> object_counts;
+  parse_argument (argc, argv, "-renderer", renderer);
+  parse_argument (argc, argv, "-grids", grids_arg);
+  parse_argument (argc, argv, "-readback", readback_arg);
+  parse_argument (argc, argv, "-format", format);
+  parse_argument (argc, argv, "-output", output);
+  parse_argument (argc, argv, "-iterations", iterations);
+  parse_x_arguments (argc, argv, "-triangles", triangle_fractions);
+  parse_x_arguments (argc, argv, "-objects", object_counts);
+
+  if (triangle_fractions.empty ())
+  {
+    triangle_fractions.push_back (1.0);
+    triangle_fractions.push_back (0.5);
+    triangle_fractions.push_back (0.25);
+    triangle_fractions.push_back (0.125);
+  }
+  if (object_counts.empty ())
+  {
+    object_counts.push_back (1);
+    object_counts.push_back (2);
+    object_counts.push_back (4);
+    object_counts.push_back (8);
+  }
+
+  SimExample::ContextType context_type = SimExample::CONTEXT_EGL;
+  if (renderer == "glut")
+    context_type = SimExample::CONTEXT_GLUT;
+  else if (renderer == "software")
+    context_type = SimExample::CONTEXT_SOFTWARE;
+  else if (renderer != "egl")
+  {
+    print_error ("Unknown renderer %s\n", renderer.c_str ());
+    return (-1);
+  }
+  const bool software = context_type == SimExample::CONTEXT_SOFTWARE;
+
+  if (format != "json" && format != "csv")
+  {
+    print_error ("Unknown format %s\n", format.c_str ());
+    return (-1);
+  }
+
+  std::vector<std::pair<int, int> > grids;
+  const std::vector<std::string> grid_tokens = split (grids_arg, ',');
+  for (size_t i = 0; i < grid_tokens.size (); ++i)
+  {
+    int rows = 0;
+    int cols = 0;
+    if (sscanf (grid_tokens[i].c_str (), "%dx%d", &rows, &cols) != 2 || rows < 1 || cols < 1)
+    {
+      print_error ("Invalid grid %s, expected RxC\n", grid_tokens[i].c_str ());
+      return (-1);
+    }
+    grids.push_back (std::make_pair (rows, cols));
+  }
+
+  std::vector<ReadbackMode> modes;
+  const std::vector<std::string> mode_names = split (readback_arg, ',');
+  for (size_t i = 0; i < mode_names.size (); ++i)
+  {
+    if (mode_names[i] == "float")
+      modes.push_back (READBACK_FLOAT);
+    else if (mode_names[i] == "mm")
+      modes.push_back (READBACK_MM);
+    else if (mode_names[i] == "roi")
+      modes.push_back (READBACK_ROI);
+    else if (mode_names[i] == "async")
+      modes.push_back (READBACK_ASYNC);
+    else
+    {
+      print_error ("Unknown readback mode %s\n", mode_names[i].c_str ());
+      return (-1);
+    }
+  }
+
+  // The context must exist before any model is drawn.
+  SimExample::Ptr simexample (new SimExample (argc, argv, kHeight, kWidth, context_type));
+
+  GLint max_size = 8192;
+  if (!software)
+    glGetIntegerv (GL_MAX_TEXTURE_SIZE, &max_size);
+
+  std::vector<pcl::PolygonMesh::Ptr> meshes;
+  for (size_t i = 0; i < files.size (); ++i)
+  {
+    pcl::PolygonMesh::Ptr mesh (new pcl::PolygonMesh);
+    if (pcl::io::loadPolygonFile (files[i], *mesh) == 0 || mesh->polygons.empty ())
+    {
+      print_warn ("Could not load %s\n", files[i].c_str ());
+      continue;
+    }
+    meshes.push_back (mesh);
+  }
+
+  if (meshes.empty ())
+  {
+    print_error ("No models loaded\n");
+    return (-1);
+  }
+  std::cerr << "Loaded " << meshes.size () << " models" << std::endl;
+
+  std::vector<Result> results;
+  std::vector<BenchmarkModel> models;
+
+  for (size_t f = 0; f < triangle_fractions.size (); ++f)
+  {
+    makeModels (meshes, triangle_fractions[f], models);
+    if (models.empty ())
+      continue;
+
+    for (size_t g = 0; g < grids.size (); ++g)
+    {
+      if (grids[g].first * kHeight > max_size || grids[g].second * kWidth > max_size)
+      {
+        print_warn ("Skipping grid %dx%d, larger than the maximum texture size %d\n",
+                    grids[g].first, grids[g].second, max_size);
+        continue;
+      }
+
+      for (size_t m = 0; m < modes.size (); ++m)
+      {
+        if (modes[m] == READBACK_ROI && grids[g].first * grids[g].second != 1)
+          continue;
+
+        for (size_t o = 0; o < object_counts.size (); ++o)
+        {
+          Result result;
+          result.renderer = renderer;
+          result.readback = mode_names[m];
+          result.grid_rows = grids[g].first;
+          result.grid_cols = grids[g].second;
+          result.objects = object_counts[o];
+          result.triangle_fraction = triangle_fractions[f];
+
+          // Average over the models cycled through by buildScene.
+          double triangles = 0.0;
+          for (size_t i = 0; i < models.size (); ++i)
+            triangles += models[i].triangles;
+          result.triangles_per_scene = triangles * result.objects / models.size ();
+
+          if (runMeasurement (models, software, iterations, modes[m], result))
+          {
+            results.push_back (result);
+            std::cerr << result.readback << " " << result.grid_rows << "x" << result.grid_cols
+                      << " objects " << result.objects << " triangles "
+                      << result.triangle_fraction << ": " << 1000.0 / result.end_to_end_ms
+                      << " images/s" << std::endl;
+          }
+        }
+      }
+    }
+  }
+
+  if (output.empty ())
+  {
+    writeResults (results, format, std::cout);
+  }
+  else
+  {
+    std::ofstream out (output.c_str ());
+    writeResults (results, format, out);
+    if (!out.good ())
+    {
+      print_error ("Could not write %s\n", output.c_str ());
+      return (-1);
+    }
+  }
+
+  return 0;
+}
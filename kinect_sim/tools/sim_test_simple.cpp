@@ -543,9 +543,8 @@ void load_PolygonMesh_model (char* polygon_file)
   pcl::io::loadPolygonFile (polygon_file, mesh);
   pcl::PolygonMesh::Ptr cloud (new pcl::PolygonMesh (mesh));
   
-  // Not sure if PolygonMesh assumes triangles if to
-  // TODO: Ask a developer
-  PolygonMeshModel::Ptr model = PolygonMeshModel::Ptr (new PolygonMeshModel (GL_POLYGON, cloud));
+  // Polygons are fan-triangulated and drawn with a single indexed call.
+  TriangleMeshModel::Ptr model = TriangleMeshModel::Ptr (new TriangleMeshModel (cloud));
   scene_->add (model);
   
   std::cout << "Just read " << polygon_file << std::endl;
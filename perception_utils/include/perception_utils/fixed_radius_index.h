@@ -0,0 +1,148 @@
+#pragma once
+
+/**
+ * @file fixed_radius_index.h
+ * @brief Voxel hash for neighbour queries with a single, fixed radius
+ * @author Venkatraman Narayanan
+ * Carnegie Mellon University, 2015
+ */
+
+#include <pcl/point_cloud.h>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace perception_utils {
+
+/**@brief Answers "is there a point within radius" and "how many points are
+ * within radius" for one radius that is fixed at construction, which is all
+ * a pcl::search::KdTree is used for in most places.
+ *
+ * Points are hashed into cubic cells with the side of the radius, so the
+ * neighbours of a query are in the 27 cells around it, and building is a
+ * counting sort over the cells. Storage is reused across SetInputCloud
+ * calls. Non-finite points are not indexed, and queries at non-finite
+ * points have no neighbours.
+ **/
+class FixedRadiusIndex {
+ public:
+  /**@brief An empty index, with radius 0**/
+  FixedRadiusIndex();
+  explicit FixedRadiusIndex(double radius);
+
+  double radius() const {
+    return radius_;
+  }
+  /**@brief Number of indexed points**/
+  int size() const {
+    return static_cast<int>(x_.size());
+  }
+
+  template <typename PointType>
+  void SetInputCloud(const pcl::PointCloud<PointType> &cloud);
+  /**@brief Index the num_points points (x[i], y[i], z[i])**/
+  void SetInputPoints(const float *x, const float *y, const float *z,
+                      int num_points);
+
+  /**@brief Number of indexed points within radius of (x, y, z), counting
+   * stops at max_count**/
+  int CountNeighbors(float x, float y, float z,
+                     int max_count = std::numeric_limits<int>::max()) const;
+  bool HasNeighbor(float x, float y, float z) const {
+    return CountNeighbors(x, y, z, 1) > 0;
+  }
+
+  template <typename PointType>
+  int CountNeighbors(const PointType &point,
+                     int max_count = std::numeric_limits<int>::max()) const {
+    return CountNeighbors(point.x, point.y, point.z, max_count);
+  }
+  template <typename PointType>
+  bool HasNeighbor(const PointType &point) const {
+    return CountNeighbors(point.x, point.y, point.z, 1) > 0;
+  }
+
+  /**@brief Batch versions, with an entry for every point of queries**/
+  template <typename PointType>
+  void CountNeighbors(const pcl::PointCloud<PointType> &queries,
+                      std::vector<int> *counts,
+                      int max_count = std::numeric_limits<int>::max()) const;
+  template <typename PointType>
+  void HasNeighbors(const pcl::PointCloud<PointType> &queries,
+                    std::vector<bool> *has_neighbor) const;
+
+ private:
+  // Open addressing table slot for one occupied cell, whose points are
+  // [begin, end) of x_, y_ and z_.
+  struct Cell {
+    uint64_t key;
+    int begin;
+    int end;
+  };
+  static constexpr uint64_t kEmptyKey = std::numeric_limits<uint64_t>::max();
+
+  double radius_;
+  float sqr_radius_;
+  // Cells are a little larger than the radius, so that rounding never puts
+  // two points within radius more than one cell apart.
+  float cell_size_;
+  float inv_cell_size_;
+
+  std::vector<Cell> cells_;
+  int hash_shift_;
+  // Indexed points, sorted by cell.
+  std::vector<float> x_;
+  std::vector<float> y_;
+  std::vector<float> z_;
+  // Build scratch: the input points and the slot of each.
+  std::vector<float> input_x_;
+  std::vector<float> input_y_;
+  std::vector<float> input_z_;
+  std::vector<int> input_slots_;
+
+  int64_t CellCoordinate(float value) const {
+    return static_cast<int64_t>(std::floor(value * inv_cell_size_));
+  }
+  // Slot of the cell with key, or of the empty slot where it would go.
+  int FindSlot(uint64_t key) const;
+};
+
+template <typename PointType>
+void FixedRadiusIndex::SetInputCloud(const pcl::PointCloud<PointType>
+                                     &cloud) {
+  input_x_.resize(cloud.points.size());
+  input_y_.resize(cloud.points.size());
+  input_z_.resize(cloud.points.size());
+
+  for (size_t ii = 0; ii < cloud.points.size(); ++ii) {
+    input_x_[ii] = cloud.points[ii].x;
+    input_y_[ii] = cloud.points[ii].y;
+    input_z_[ii] = cloud.points[ii].z;
+  }
+
+  SetInputPoints(input_x_.data(), input_y_.data(), input_z_.data(),
+                 static_cast<int>(cloud.points.size()));
+}
+
+template <typename PointType>
+void FixedRadiusIndex::CountNeighbors(const pcl::PointCloud<PointType>
+                                      &queries, std::vector<int> *counts, int max_count) const {
+  counts->resize(queries.points.size());
+
+  for (size_t ii = 0; ii < queries.points.size(); ++ii) {
+    (*counts)[ii] = CountNeighbors(queries.points[ii], max_count);
+  }
+}
+
+template <typename PointType>
+void FixedRadiusIndex::HasNeighbors(const pcl::PointCloud<PointType>
+                                    &queries, std::vector<bool> *has_neighbor) const {
+  has_neighbor->resize(queries.points.size());
+
+  for (size_t ii = 0; ii < queries.points.size(); ++ii) {
+    (*has_neighbor)[ii] = HasNeighbor(queries.points[ii]);
+  }
+}
+} /** perception_utils **/
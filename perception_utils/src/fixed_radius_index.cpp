@@ -0,0 +1,168 @@
+/**
+ * @file fixed_radius_index.cpp
+ * @brief Voxel hash for neighbour queries with a single, fixed radius
+ * @author Venkatraman Narayanan
+ * Carnegie Mellon University, 2015
+ */
+
+#include <perception_utils/fixed_radius_index.h>
+
+namespace {
+// Cell coordinates are packed into 21 bits each.
+constexpr int kCoordinateBits = 21;
+constexpr int64_t kCoordinateOffset = int64_t(1) << (kCoordinateBits - 1);
+constexpr uint64_t kCoordinateMask = (uint64_t(1) << kCoordinateBits) - 1;
+
+uint64_t CellKey(int64_t x, int64_t y, int64_t z) {
+  return ((static_cast<uint64_t>(x + kCoordinateOffset) & kCoordinateMask) <<
+          (2 * kCoordinateBits)) |
+         ((static_cast<uint64_t>(y + kCoordinateOffset) & kCoordinateMask) <<
+          kCoordinateBits) |
+         (static_cast<uint64_t>(z + kCoordinateOffset) & kCoordinateMask);
+}
+
+// Distance from value to the near face of the cell offset cells away from
+// the cell [cell * cell_size, (cell + 1) * cell_size) that contains it.
+float GapToCell(float value, int64_t cell, int offset, float cell_size) {
+  if (offset < 0) {
+    return value - static_cast<float>(cell) * cell_size;
+  }
+
+  if (offset > 0) {
+    return static_cast<float>(cell + 1) * cell_size - value;
+  }
+
+  return 0.0f;
+}
+}  // namespace
+
+namespace perception_utils {
+
+constexpr uint64_t FixedRadiusIndex::kEmptyKey;
+
+FixedRadiusIndex::FixedRadiusIndex() : FixedRadiusIndex(0.0) {}
+
+FixedRadiusIndex::FixedRadiusIndex(double radius) : radius_(radius),
+  sqr_radius_(static_cast<float>(radius * radius)),
+  cell_size_(static_cast<float>(radius * (1.0 + 1e-4))),
+  inv_cell_size_(radius > 0.0 ? 1.0f / cell_size_ : 0.0f),
+  hash_shift_(64) {}
+
+int FixedRadiusIndex::FindSlot(uint64_t key) const {
+  const int mask = static_cast<int>(cells_.size()) - 1;
+  int slot = static_cast<int>((key * 0x9E3779B97F4A7C15ULL) >> hash_shift_);
+
+  while (cells_[slot].key != key && cells_[slot].key != kEmptyKey) {
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+void FixedRadiusIndex::SetInputPoints(const float *x, const float *y,
+                                      const float *z, int num_points) {
+  // At least twice as many slots as points, so that the table is at most
+  // half full.
+  int num_slots = 16;
+  hash_shift_ = 60;
+
+  while (num_slots < 2 * num_points) {
+    num_slots *= 2;
+    --hash_shift_;
+  }
+
+  cells_.assign(num_slots, Cell{kEmptyKey, 0, 0});
+  input_slots_.resize(num_points);
+  int num_finite_points = 0;
+
+  // Count the points of every cell in its end.
+  for (int ii = 0; ii < num_points; ++ii) {
+    if (!std::isfinite(x[ii]) || !std::isfinite(y[ii]) || !std::isfinite(z[ii])) {
+      input_slots_[ii] = -1;
+      continue;
+    }
+
+    const uint64_t key = CellKey(CellCoordinate(x[ii]), CellCoordinate(y[ii]),
+                                 CellCoordinate(z[ii]));
+    const int slot = FindSlot(key);
+    cells_[slot].key = key;
+    ++cells_[slot].end;
+    input_slots_[ii] = slot;
+    ++num_finite_points;
+  }
+
+  // Then make end the insertion point of the cell's range.
+  int offset = 0;
+
+  for (auto &cell : cells_) {
+    cell.begin = offset;
+    offset += cell.end;
+    cell.end = cell.begin;
+  }
+
+  x_.resize(num_finite_points);
+  y_.resize(num_finite_points);
+  z_.resize(num_finite_points);
+
+  for (int ii = 0; ii < num_points; ++ii) {
+    if (input_slots_[ii] < 0) {
+      continue;
+    }
+
+    const int position = cells_[input_slots_[ii]].end++;
+    x_[position] = x[ii];
+    y_[position] = y[ii];
+    z_[position] = z[ii];
+  }
+}
+
+int FixedRadiusIndex::CountNeighbors(float x, float y, float z,
+                                     int max_count) const {
+  if (x_.empty() || !std::isfinite(x) || !std::isfinite(y) ||
+      !std::isfinite(z)) {
+    return 0;
+  }
+
+  const int64_t cell_x = CellCoordinate(x);
+  const int64_t cell_y = CellCoordinate(y);
+  const int64_t cell_z = CellCoordinate(z);
+  int count = 0;
+
+  for (int dx = -1; dx <= 1; ++dx) {
+    const float gap_x = GapToCell(x, cell_x, dx, cell_size_);
+
+    for (int dy = -1; dy <= 1; ++dy) {
+      const float gap_y = GapToCell(y, cell_y, dy, cell_size_);
+
+      for (int dz = -1; dz <= 1; ++dz) {
+        const float gap_z = GapToCell(z, cell_z, dz, cell_size_);
+
+        // Cells that are entirely out of reach.
+        if (gap_x * gap_x + gap_y * gap_y + gap_z * gap_z > sqr_radius_) {
+          continue;
+        }
+
+        const Cell &cell = cells_[FindSlot(CellKey(cell_x + dx, cell_y + dy,
+                                                   cell_z + dz))];
+
+        if (cell.key == kEmptyKey) {
+          continue;
+        }
+
+        for (int ii = cell.begin; ii < cell.end; ++ii) {
+          const float diff_x = x_[ii] - x;
+          const float diff_y = y_[ii] - y;
+          const float diff_z = z_[ii] - z;
+
+          if (diff_x * diff_x + diff_y * diff_y + diff_z * diff_z <= sqr_radius_ &&
+              ++count >= max_count) {
+            return count;
+          }
+        }
+      }
+    }
+  }
+
+  return count;
+}
+} /** perception_utils **/
@@ -5,6 +5,7 @@
  */
 
 #include <perception_utils/perception_utils.h>
+#include <perception_utils/fixed_radius_index.h>
 
 #include <pcl/pcl_base.h>
 #include <pcl/common/common.h>
@@ -25,7 +26,6 @@
 #include <pcl/filters/passthrough.h>
 #include "pcl/filters/project_inliers.h"
 #include "pcl/filters/statistical_outlier_removal.h"
-#include <pcl/filters/radius_outlier_removal.h>
 
 #include <pcl/segmentation/organized_multi_plane_segmentation.h>
 #include <pcl/segmentation/organized_connected_component_segmentation.h>
@@ -750,14 +750,22 @@ PointCloudPtr RemoveStatisticalOutliers(PointCloudPtr cloud,
 
 PointCloudPtr RemoveRadiusOutliers(PointCloudPtr cloud,
                                                      double radius, int min_neighbors) {
+  // As pcl::RadiusOutlierRemoval (unorganized), a point is kept if more than
+  // min_neighbors points, itself included, are within radius.
+  FixedRadiusIndex index(radius);
+  index.SetInputCloud(*cloud);
+  vector<int> inlier_indices;
+  inlier_indices.reserve(cloud->points.size());
+
+  for (size_t ii = 0; ii < cloud->points.size(); ++ii) {
+    if (index.CountNeighbors(cloud->points[ii], min_neighbors + 1) >
+        min_neighbors) {
+      inlier_indices.push_back(static_cast<int>(ii));
+    }
+  }
+
   PointCloudPtr filtered_cloud(new PointCloud);
-  pcl::RadiusOutlierRemoval<PointT> ror;
-  ror.setKeepOrganized (
-    false); //NOTE: organized doesn't work -- possible bug in PCL
-  ror.setInputCloud(cloud);
-  ror.setRadiusSearch(radius);
-  ror.setMinNeighborsInRadius(min_neighbors);
-  ror.filter(*filtered_cloud);
+  pcl::copyPointCloud(*cloud, inlier_indices, *filtered_cloud);
   return filtered_cloud;
 }
 
@@ -0,0 +1,93 @@
+#pragma once
+
+/**
+ * @file camera_model.h
+ * @brief Pinhole model of the depth camera with precomputed pixel rays
+ * @author Venkatraman Narayanan
+ * Carnegie Mellon University, 2015
+ */
+
+#include <Eigen/Geometry>
+
+#include <vector>
+
+namespace sbpl_perception {
+
+// Pinhole model of the simulated depth camera at a fixed pose, with the
+// conventions of pcl::simulation::RangeLikelihood::getGlobalPoint and
+// getCameraCoordinate. SetCameraPose computes the world frame ray of every
+// pixel and the world to camera transform once, so converting between depth
+// pixels and world points afterwards is a multiply-add per coordinate.
+//
+// Pixels are addressed by their index in a depth image (top-down rows) and
+// depths are in mm, as everywhere else in sbpl_perception.
+class CameraModel {
+ public:
+  // An empty image.
+  CameraModel();
+  CameraModel(int width, int height, float fx, float fy, float cx, float cy);
+
+  void SetCameraPose(const Eigen::Isometry3d &camera_pose);
+
+  // World point seen at pixel index with depth depth_mm.
+  Eigen::Vector3f GetWorldPoint(int index, unsigned short depth_mm) const {
+    return Eigen::Vector3f(origin_x_ + depth_mm * ray_x_[index],
+                           origin_y_ + depth_mm * ray_y_[index],
+                           origin_z_ + depth_mm * ray_z_[index]);
+  }
+
+  // GetWorldPoint for every pixel of depth_image (width * height values),
+  // written to x, y and z. No return pixels are converted like any other.
+  void GetWorldPoints(const unsigned short *depth_image, float *x, float *y,
+                      float *z) const;
+
+  // Index of the pixel world_point projects to, and its range (m) along the
+  // optical axis. Returns false if the projection is outside of the image.
+  bool Project(const Eigen::Vector3f &world_point, int *index,
+               float *range) const;
+
+  // Inclusive bounds, clipped to the image, of the pixels that any world
+  // point within radius (m) of the point seen at pixel index with range range
+  // (m) can project to. Returns false if range <= radius, where there is no
+  // such bound.
+  bool GetNeighborhoodWindow(int index, float range, float radius, int *min_u,
+                             int *max_u, int *min_row, int *max_row) const;
+
+  // True if depth_image (a full image) has a pixel whose world point is
+  // within radius (m) of world_point, which is seen at pixel index with range
+  // range. Only pixels in the neighborhood window whose depths are within
+  // radius of range are visited. If exact is false, the first of them is
+  // taken as a neighbour without checking its 3D distance.
+  bool HasNeighborInDepthImage(const unsigned short *depth_image,
+                               const Eigen::Vector3f &world_point, int index, float range, float radius,
+                               bool exact) const;
+
+  int width() const {
+    return width_;
+  }
+  int height() const {
+    return height_;
+  }
+
+ private:
+  int width_;
+  int height_;
+  float fx_;
+  float fy_;
+  float cx_;
+  float cy_;
+
+  // Camera centre in the world frame.
+  float origin_x_;
+  float origin_y_;
+  float origin_z_;
+  // World frame ray of every pixel, in m per mm of depth.
+  std::vector<float> ray_x_;
+  std::vector<float> ray_y_;
+  std::vector<float> ray_z_;
+
+  // World to optical frame (x right, y up, looking along -z).
+  Eigen::Matrix3f world_to_camera_rotation_;
+  Eigen::Vector3f world_to_camera_translation_;
+};
+}  // namespace
@@ -0,0 +1,88 @@
+#pragma once
+
+/**
+ * @file depth_image_kernels.h
+ * @brief Fused per-pixel operations on depth images
+ * @author Venkatraman Narayanan
+ * Carnegie Mellon University, 2015
+ */
+
+#include <kinect_sim/simulation_io.hpp>
+
+#include <cstddef>
+#include <vector>
+
+namespace sbpl_perception {
+
+// Adds an object, rendered alone into object_depth_image, to a scene with
+// depth image source_depth_image (both full size, in mm, with
+// kKinectMaxDepth for no return). A single pass over the pixels of the
+// object's ROI computes:
+//
+// - composed_depth_image: the per-pixel minimum of the two, i.e. the depth
+//   image of the scene with the object added,
+// - new_pixel_indices: the pixels where only the object is seen,
+// - min_new_depth and max_new_depth: the depth range of those pixels,
+// - new_object_depth_image: the object at its new pixels and
+//   kKinectMaxDepth elsewhere.
+//
+// Returns true as soon as the object is found strictly in front of a source
+// pixel, i.e. it occludes the source. The outputs are then left empty (min
+// and max reset to kKinectMaxDepth and 0), as IsOccluded does. Either image
+// output may be null.
+//
+// The pixel loop uses AVX2 or SSE2 when the compiler targets them.
+bool ComposeObjectDepthImage(const std::vector<unsigned short>
+                             &source_depth_image,
+                             const pcl::simulation::DepthImageROI &object_depth_image,
+                             std::vector<unsigned short> *composed_depth_image,
+                             std::vector<int> *new_pixel_indices,
+                             unsigned short *min_new_depth,
+                             unsigned short *max_new_depth,
+                             std::vector<unsigned short> *new_object_depth_image = nullptr);
+
+// Same as above for an object rendered into a full size depth image.
+bool ComposeObjectDepthImage(const std::vector<unsigned short>
+                             &source_depth_image,
+                             const std::vector<unsigned short> &object_depth_image,
+                             std::vector<unsigned short> *composed_depth_image,
+                             std::vector<int> *new_pixel_indices,
+                             unsigned short *min_new_depth,
+                             unsigned short *max_new_depth,
+                             std::vector<unsigned short> *new_object_depth_image = nullptr);
+
+// composed[ii] = min(first[ii], second[ii]).
+void ComposeDepthImages(const unsigned short *first,
+                        const unsigned short *second, size_t num_pixels,
+                        unsigned short *composed);
+
+// masked[ii] = input[ii] if it is strictly in front of mask[ii], and
+// kKinectMaxDepth otherwise.
+void MaskOccludedPixels(const unsigned short *input,
+                        const unsigned short *mask, size_t num_pixels,
+                        unsigned short *masked);
+
+// Sparse depth images. A DepthImageROI stands for the full size image that
+// has its depths inside the ROI and no returns outside of it, which is how
+// depth images are cached and shipped between processors.
+
+// The smallest ROI that holds every pixel of depth_image (full size) with a
+// return. It is empty (0 x 0) if there are none.
+void CropDepthImage(const std::vector<unsigned short> &depth_image,
+                    pcl::simulation::DepthImageROI *roi);
+
+// The full size depth image that roi stands for.
+void ExpandDepthImage(const pcl::simulation::DepthImageROI &roi,
+                      std::vector<unsigned short> *depth_image);
+
+// Per-pixel minimum of two sparse images, over the bounding rectangle of
+// both ROIs.
+void ComposeDepthImages(const pcl::simulation::DepthImageROI &first,
+                        const pcl::simulation::DepthImageROI &second,
+                        pcl::simulation::DepthImageROI *composed);
+
+// True if the two sparse images stand for the same full size image,
+// whatever their ROIs.
+bool SameDepthImage(const pcl::simulation::DepthImageROI &first,
+                    const pcl::simulation::DepthImageROI &second);
+}  // namespace
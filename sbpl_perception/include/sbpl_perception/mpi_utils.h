@@ -1,6 +1,9 @@
 #pragma once
 
+#include <kinect_sim/simulation_io.hpp>
 #include <sbpl_perception/graph_state.h>
+#include <sbpl_perception/pixel_set.h>
+#include <sbpl_perception/template_bank.h>
 
 #include <boost/mpi.hpp>
 
@@ -16,28 +19,65 @@ struct CostComputationInput {
   int source_id;
   int child_id;
 
-  std::vector<unsigned short> source_depth_image;  
-  std::vector<int> source_counted_pixels;
+  // Depth images are shipped cropped to their valid pixels, see
+  // CropDepthImage.
+  pcl::simulation::DepthImageROI source_depth_image;
+  sbpl_perception::PixelSet source_counted_pixels;
 
-  // This is optional: a non-empty vector should be used only when lazily
-  // computing cost from cached depth images of individual objects.
-  std::vector<unsigned short> unadjusted_last_object_depth_image;
-  std::vector<unsigned short> adjusted_last_object_depth_image;
+  // This is optional: a render of the last object alone from the episode's
+  // single object cache. When computing the true cost, if
+  // last_object_cached, last_object_roi is used instead of rendering it, and
+  // if adjusted_last_object_state is also non-empty, its ICP result
+  // (rendered into adjusted_last_object_roi) may be used instead of running
+  // ICP. When lazily computing the cost, both renders are required, and the
+  // cost is invalid if adjusted_last_object_state is empty.
   GraphState adjusted_last_object_state;
+  bool last_object_cached;
+  pcl::simulation::DepthImageROI last_object_roi;
+  pcl::simulation::DepthImageROI adjusted_last_object_roi;
+
+  CostComputationInput() : source_id(-1), child_id(-1),
+    last_object_cached(false) {}
 };
 
 struct CostComputationOutput {
   int cost;
   GraphState adjusted_state;
   GraphStateProperties state_properties;
-  std::vector<int> child_counted_pixels;
-  std::vector<unsigned short> depth_image;
-  std::vector<unsigned short> unadjusted_depth_image;
+  sbpl_perception::PixelSet child_counted_pixels;
+  pcl::simulation::DepthImageROI depth_image;
+  pcl::simulation::DepthImageROI unadjusted_depth_image;
+  // The render of the last object alone, if it had to be rendered for this
+  // computation, so that it can be cached.
+  bool last_object_rendered;
+  pcl::simulation::DepthImageROI last_object_roi;
+
+  CostComputationOutput() : cost(-1), last_object_rendered(false) {}
 };
 
 namespace boost {
 namespace serialization {
 
+template<class Archive>
+void serialize(Archive &ar, sbpl_perception::TemplateKey &key,
+               const unsigned int version) {
+    ar &key.model_hash;
+    ar &key.x;
+    ar &key.y;
+    ar &key.yaw;
+    ar &key.lod_level;
+}
+
+template<class Archive>
+void serialize(Archive &ar, pcl::simulation::DepthImageROI &roi,
+               const unsigned int version) {
+    ar &roi.x;
+    ar &roi.y;
+    ar &roi.width;
+    ar &roi.height;
+    ar &roi.depth;
+}
+
 template<class Archive>
 void serialize(Archive &ar, CostComputationInput &input,
                const unsigned int version) {
@@ -47,9 +87,10 @@ void serialize(Archive &ar, CostComputationInput &input,
     ar &input.child_id;
     ar &input.source_depth_image;
     ar &input.source_counted_pixels;
-    ar &input.unadjusted_last_object_depth_image;
-    ar &input.adjusted_last_object_depth_image;
     ar &input.adjusted_last_object_state;
+    ar &input.last_object_cached;
+    ar &input.last_object_roi;
+    ar &input.adjusted_last_object_roi;
 }
 
 template<class Archive>
@@ -61,6 +102,8 @@ void serialize(Archive &ar, CostComputationOutput &output,
     ar &output.child_counted_pixels;
     ar &output.depth_image;
     ar &output.unadjusted_depth_image;
+    ar &output.last_object_rendered;
+    ar &output.last_object_roi;
 }
 
 } // namespace serialization
@@ -13,6 +13,8 @@
 
 #include <pcl/PolygonMesh.h>
 
+#include <vector>
+
 class ObjectModel {
  public:
   ObjectModel(const pcl::PolygonMesh &mesh, const std::string name, const bool symmetric, const bool flipped);
@@ -21,6 +23,23 @@ class ObjectModel {
   pcl::PolygonMeshPtr GetTransformedMesh(const ContPose & p, double table_height) const;
   pcl::PolygonMeshPtr GetTransformedMesh(const Eigen::Matrix4f &transform) const;
 
+  // Build the level-of-detail chain by repeated quadric edge-collapse
+  // decimation of mesh(). Every level has about half the triangles of the
+  // previous one, and decimation stops at max_levels levels (including
+  // mesh() itself) or when a level would drop below min_triangles.
+  void BuildLODChain(int max_levels, int min_triangles);
+  // Number of levels of detail, 1 if BuildLODChain was not called.
+  int NumLODLevels() const {
+    return 1 + static_cast<int>(lod_meshes_.size());
+  }
+  // Level 0 is mesh(), higher levels are coarser.
+  const pcl::PolygonMesh &lod_mesh(int level) const {
+    return level == 0 ? mesh_ : lod_meshes_[level - 1];
+  }
+  int NumTriangles(int level) const {
+    return static_cast<int>(lod_mesh(level).polygons.size());
+  }
+
   // Accessors
   const pcl::PolygonMesh &mesh() const {
     return mesh_;
@@ -56,6 +75,11 @@ class ObjectModel {
     return preprocessing_transform_;
   }
 
+  // Return the transform that aligns the preprocessed model (i.e, mesh()) to a
+  // continuous pose (x,y,table_height,\theta) in the world frame. This is the
+  // model matrix used when rendering the model at that pose.
+  Eigen::Affine3f GetModelToSceneTransform(const ContPose &p, double table_height) const;
+
   // Return the transform that aligns a raw model (i.e, the one provided to the
   // constructor) to a continuous pose (x,y,table_height,\theta) in the world
   // frame.
@@ -63,6 +87,8 @@ class ObjectModel {
 
  private:
   pcl::PolygonMesh mesh_;
+  // Decimated levels 1, 2, ... of the level-of-detail chain.
+  std::vector<pcl::PolygonMesh> lod_meshes_;
   bool symmetric_;
   std::string name_;
   double min_x_, min_y_, min_z_; // Bounding box in default orientation
@@ -0,0 +1,172 @@
+#pragma once
+
+/**
+ * @file pixel_set.h
+ * @brief Bitmap set of pixel and observed point indices
+ * @author Venkatraman Narayanan
+ * Carnegie Mellon University, 2015
+ */
+
+#include <boost/serialization/access.hpp>
+#include <boost/serialization/split_member.hpp>
+#include <boost/serialization/vector.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+namespace sbpl_perception {
+
+// A set of non-negative indices (pixels of a depth image, or points of the
+// observed cloud) stored as a bitmap, one bit per index up to the largest
+// one inserted. At 307,200 pixels the full bitmap is 38 KB, and union,
+// difference and size are word-parallel passes over it. Elements are
+// iterated in increasing order.
+//
+// When serialized, only the words that have a bit set are written, with
+// their positions, if that is smaller than writing all of them.
+class PixelSet {
+ public:
+  class const_iterator : public std::iterator<std::forward_iterator_tag, int> {
+   public:
+    const_iterator() : words_(nullptr), num_words_(0), word_index_(0),
+      word_(0) {}
+
+    int operator*() const {
+      return static_cast<int>(word_index_ * 64 + __builtin_ctzll(word_));
+    }
+    const_iterator &operator++() {
+      word_ &= word_ - 1;
+      SkipEmptyWords();
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator it = *this;
+      ++(*this);
+      return it;
+    }
+    bool operator==(const const_iterator &other) const {
+      return word_index_ == other.word_index_ && word_ == other.word_;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return !(*this == other);
+    }
+
+   private:
+    friend class PixelSet;
+    const_iterator(const uint64_t *words, size_t num_words, size_t word_index) :
+      words_(words), num_words_(num_words), word_index_(word_index),
+      word_(word_index < num_words ? words[word_index] : 0) {
+      SkipEmptyWords();
+    }
+    void SkipEmptyWords() {
+      while (word_ == 0 && word_index_ < num_words_) {
+        if (++word_index_ < num_words_) {
+          word_ = words_[word_index_];
+        }
+      }
+    }
+
+    const uint64_t *words_;
+    size_t num_words_;
+    size_t word_index_;
+    // Bits of words_[word_index_] not visited yet.
+    uint64_t word_;
+  };
+
+  PixelSet() {}
+
+  void Insert(int index) {
+    const size_t word_index = static_cast<size_t>(index) / 64;
+
+    if (word_index >= words_.size()) {
+      words_.resize(word_index + 1, 0);
+    }
+
+    words_[word_index] |= uint64_t(1) << (index % 64);
+  }
+  bool Contains(int index) const {
+    const size_t word_index = static_cast<size_t>(index) / 64;
+    return word_index < words_.size() &&
+           (words_[word_index] >> (index % 64)) & 1;
+  }
+  // Number of elements.
+  int Size() const;
+  bool Empty() const;
+  void Clear() {
+    words_.clear();
+  }
+
+  // Add every element of other to this set.
+  void Union(const PixelSet &other);
+  // Remove every element of other from this set.
+  void Difference(const PixelSet &other);
+
+  const_iterator begin() const {
+    return const_iterator(words_.data(), words_.size(), 0);
+  }
+  const_iterator end() const {
+    return const_iterator(words_.data(), words_.size(), words_.size());
+  }
+
+  bool operator==(const PixelSet &other) const;
+  bool operator!=(const PixelSet &other) const {
+    return !(*this == other);
+  }
+
+ private:
+  std::vector<uint64_t> words_;
+
+  friend class boost::serialization::access;
+  template <typename Ar> void save(Ar &ar, const unsigned int) const {
+    // Trailing empty words are not written.
+    size_t num_words = words_.size();
+
+    while (num_words > 0 && words_[num_words - 1] == 0) {
+      --num_words;
+    }
+
+    std::vector<uint32_t> word_indices;
+    std::vector<uint64_t> words;
+
+    for (size_t ii = 0; ii < num_words; ++ii) {
+      if (words_[ii] != 0) {
+        word_indices.push_back(static_cast<uint32_t>(ii));
+        words.push_back(words_[ii]);
+      }
+    }
+
+    bool sparse = word_indices.size() * (sizeof(uint32_t) + sizeof(uint64_t)) <
+                  num_words * sizeof(uint64_t);
+    ar &sparse;
+
+    if (sparse) {
+      ar &word_indices;
+      ar &words;
+    } else {
+      words.assign(words_.begin(), words_.begin() + num_words);
+      ar &words;
+    }
+  }
+  template <typename Ar> void load(Ar &ar, const unsigned int) {
+    bool sparse = false;
+    ar &sparse;
+
+    if (sparse) {
+      std::vector<uint32_t> word_indices;
+      std::vector<uint64_t> words;
+      ar &word_indices;
+      ar &words;
+      words_.assign(word_indices.empty() ? 0 : word_indices.back() + 1, 0);
+
+      for (size_t ii = 0; ii < word_indices.size(); ++ii) {
+        words_[word_indices[ii]] = words[ii];
+      }
+    } else {
+      ar &words_;
+    }
+  }
+  BOOST_SERIALIZATION_SPLIT_MEMBER()
+};
+}  // namespace
@@ -10,17 +10,22 @@
 #include <kinect_sim/model.h>
 #include <kinect_sim/scene.h>
 #include <kinect_sim/simulation_io.hpp>
+#include <perception_utils/fixed_radius_index.h>
 #include <perception_utils/pcl_typedefs.h>
 #include <sbpl/headers.h>
+#include <sbpl_perception/camera_model.h>
 #include <sbpl_perception/config_parser.h>
 #include <sbpl_perception/graph_state.h>
 #include <sbpl_perception/mpi_utils.h>
 #include <sbpl_perception/object_model.h>
+#include <sbpl_perception/pixel_set.h>
 #include <sbpl_perception/rcnn_heuristic_factory.h>
+#include <sbpl_perception/template_bank.h>
 #include <sbpl_perception/utils/utils.h>
 #include <sbpl_utils/hash_manager/hash_manager.h>
 
 #include <boost/mpi.hpp>
+#include <boost/serialization/string.hpp>
 #include <Eigen/Dense>
 #include <opencv/cv.h>
 #include <opencv2/core/core.hpp>
@@ -71,6 +76,38 @@ struct PERCHParams {
   int max_icp_iterations;
   bool use_rcnn_heuristic;
   bool use_adaptive_resolution;
+  // If true, render with an offscreen EGL context instead of a GLUT window,
+  // so that no X display is needed on any rank.
+  bool use_headless_rendering;
+  // If true, render depth images on the CPU with the multi-threaded software
+  // rasterizer. No OpenGL context is created and use_headless_rendering is
+  // ignored.
+  bool use_software_rendering;
+  // If true, successors whose new object would occlude an already placed
+  // object are rejected with an occlusion query against the parent depth
+  // image before any of them are rendered and read back.
+  bool use_occlusion_query;
+  // If true, the target, source and last level costs of a successor are
+  // computed by a scoring pass over its rendered depth image instead of
+  // building its point cloud and querying KdTrees.
+  bool use_gpu_scoring;
+  // If true, every model gets a chain of decimated meshes at load time and
+  // objects are rendered with the coarsest one that still has about one
+  // triangle per few pixels of their projected size.
+  bool use_lod;
+  // If true, GetTargetCost looks for the observed neighbours of a rendered
+  // point in a window of the observed depth image around its pixel, instead
+  // of hashing into the observed cloud. Observed pixels in the window
+  // count if their depth is within sensor_resolution of the point's.
+  bool use_projective_association;
+  // If true, projective association also checks the 3D distance to each of
+  // those observed points, which makes it agree with the radius search.
+  // Otherwise points up to the window border away sideways are accepted.
+  bool projective_association_exact;
+  // If not empty, renders of single objects are looked up in (and added to)
+  // a template bank file in this directory, one file per camera pose,
+  // intrinsics, table height and search resolution. The directory must exist.
+  std::string template_bank_dir;
 
   bool vis_expanded_states;
   bool print_expanded_states;
@@ -85,12 +122,33 @@ struct PERCHParams {
     ar &max_icp_iterations;
     ar &use_rcnn_heuristic;
     ar &use_adaptive_resolution;
+    ar &use_headless_rendering;
+    ar &use_software_rendering;
+    ar &use_occlusion_query;
+    ar &use_gpu_scoring;
+    ar &use_lod;
+    ar &use_projective_association;
+    ar &projective_association_exact;
+    ar &template_bank_dir;
     ar &vis_expanded_states;
     ar &print_expanded_states;
     ar &debug_verbose;
   }
 };
 // BOOST_IS_MPI_DATATYPE(PERCHParams);
+
+// Renders of one object at one discrete pose, shared by every level of the
+// search within an episode.
+struct SingleObjectRender {
+  // The object alone at its (unadjusted) pose.
+  pcl::simulation::DepthImageROI depth_image;
+  // The object after ICP alignment at the first level of the search, where
+  // nothing occludes it and no observed points are explained yet, and its
+  // render. The state is empty if that successor was invalid or has not been
+  // evaluated yet.
+  GraphState adjusted_state;
+  pcl::simulation::DepthImageROI adjusted_depth_image;
+};
 // BOOST_IS_BITWISE_SERIALIZABLE(PERCHParams);
 
 class EnvObjectRecognition : public EnvironmentMHA {
@@ -109,8 +167,23 @@ class EnvObjectRecognition : public EnvironmentMHA {
   void PrintState(GraphState s, std::string fname);
   void PrintImage(std::string fname,
                   const std::vector<unsigned short> &depth_image);
-  const float *GetDepthImage(GraphState s,
-                             std::vector<unsigned short> *depth_image);
+  void GetDepthImage(GraphState s, std::vector<unsigned short> *depth_image);
+  // Render several states in one batch using the tiled framebuffer of the
+  // simulator. (*depth_images)[i] is the depth image for states[i].
+  void GetDepthImages(const std::vector<GraphState> &states,
+                      std::vector<std::vector<unsigned short>> *depth_images);
+  // Like GetDepthImage(s), but only render and read back the screen space
+  // bounding box of the objects in s.
+  void GetDepthImageROI(GraphState s, pcl::simulation::DepthImageROI *roi);
+  void GetDepthImagesROI(const std::vector<GraphState> &states,
+                         std::vector<pcl::simulation::DepthImageROI> *rois);
+  // Returns true if the last object of s would occlude any object in the
+  // depth image passed to kinect_simulator_->set_occlusion_reference(),
+  // normally that of s without its last object. Like IsOccluded, but nothing
+  // is read back from the renderer. With OpenGL it may miss pixels less than
+  // 1 mm in front of the reference, so it never rejects a state IsOccluded
+  // would keep.
+  bool IsLastObjectOccluding(const GraphState &s);
 
   pcl::simulation::SimExample::Ptr kinect_simulator_;
 
@@ -127,9 +200,17 @@ class EnvObjectRecognition : public EnvironmentMHA {
   double GetTableHeight();
   void SetBounds(double x_min, double x_max, double y_min, double y_max);
 
+  // Map the template bank for the current camera pose, table height and
+  // models. Called at the end of SetObservation.
+  void OpenTemplateBank();
+  // Merge the single object renders every processor added to the template
+  // bank during the episode into the bank file. This method must be called by
+  // all processors.
+  void SaveTemplateBank();
+
   double GetICPAdjustedPose(const PointCloudPtr cloud_in,
                             const ContPose &pose_in, PointCloudPtr &cloud_out, ContPose *pose_out,
-                            const std::vector<int> counted_indices = std::vector<int>(0));
+                            const PixelSet &counted_indices = PixelSet());
 
   std::vector<unsigned short> GetInputDepthImage() {
     return observed_depth_image_;
@@ -217,6 +298,9 @@ class EnvObjectRecognition : public EnvironmentMHA {
   Heuristics rcnn_heuristics_;
   PointCloudPtr GetGravityAlignedPointCloud(const std::vector<unsigned short>
                                             &depth_image);
+  // Point cloud of only the given pixels of depth_image.
+  PointCloudPtr GetGravityAlignedPointCloud(const std::vector<unsigned short>
+                                            &depth_image, const std::vector<int> &pixel_indices);
   PointCloudPtr GetGravityAlignedOrganizedPointCloud(const std::vector<unsigned short>
                                             &depth_image);
 
@@ -226,6 +310,14 @@ class EnvObjectRecognition : public EnvironmentMHA {
  private:
 
   std::vector<ObjectModel> obj_models_;
+  // GPU-resident render models, one per level of detail of every entry in
+  // obj_models_. These are built once in LoadObjFiles and posed with a model
+  // matrix for every render.
+  std::vector<std::vector<pcl::simulation::Model::Ptr>> obj_render_models_;
+  // Hash of the geometry of every entry in obj_models_, for template keys.
+  std::vector<uint64_t> obj_model_hashes_;
+  // Persistent single object renders, see PERCHParams::template_bank_dir.
+  TemplateBank template_bank_;
   pcl::simulation::Scene::Ptr scene_;
 
   EnvParams env_params_;
@@ -251,26 +343,32 @@ class EnvObjectRecognition : public EnvironmentMHA {
   std::unordered_map<int, int> last_object_rendering_cost_;
 
   /**@brief Mapping from State to State ID**/
-  std::unordered_map<int, std::vector<unsigned short>> depth_image_cache_;
+  std::unordered_map<int, pcl::simulation::DepthImageROI> depth_image_cache_;
   std::unordered_map<int, std::vector<int>> succ_cache;
   std::unordered_map<int, std::vector<int>> cost_cache;
   std::unordered_map<int, unsigned short> minz_map_;
   std::unordered_map<int, unsigned short> maxz_map_;
   std::unordered_map<int, int> g_value_map_;
-  std::unordered_map<int, std::vector<int>>
+  std::unordered_map<int, PixelSet>
                                          counted_pixels_map_; // Keep track of the pixels we have accounted for in cost computation for a given state
 
-  // Maps state hash to depth image.
-  std::unordered_map<GraphState, std::vector<unsigned short>>
-                                                           unadjusted_single_object_depth_image_cache_;
-  std::unordered_map<GraphState, std::vector<unsigned short>>
-                                                           adjusted_single_object_depth_image_cache_;
-  std::unordered_map<GraphState, GraphState> adjusted_single_object_state_cache_;
+  // Maps a single object state, i.e, (model id, DiscPose), to its renders.
+  // This lives on the master, which ships entries to the other processors
+  // with the cost computation input.
+  std::unordered_map<GraphState, SingleObjectRender> single_object_cache_;
 
-  // pcl::search::OrganizedNeighbor<PointT>::Ptr knn;
-  pcl::search::KdTree<PointT>::Ptr knn;
+  // Observed cloud hashed at sensor_resolution, for the nearest neighbour
+  // tests of the costs.
+  perception_utils::FixedRadiusIndex observed_index_;
   pcl::search::KdTree<PointT>::Ptr projected_knn_;
-  std::vector<int> valid_indices_;
+  PixelSet valid_indices_;
+  // Pixel index of each point of observed_cloud_.
+  std::vector<int> observed_pixel_indices_;
+  // Source id of the last image passed to SetReferenceDepthImage, or -1,
+  // and the image the simulator has as reference, if any was uploaded.
+  int reference_source_id_;
+  bool has_reference_depth_image_;
+  pcl::simulation::DepthImageROI reference_depth_image_;
 
   std::vector<unsigned short> observed_depth_image_;
   PointCloudPtr observed_cloud_, downsampled_observed_cloud_,
@@ -283,11 +381,35 @@ class EnvObjectRecognition : public EnvironmentMHA {
 
   Eigen::Matrix4f gl_inverse_transform_;
   Eigen::Isometry3d cam_to_world_;
+  // Pixel rays of cam_to_world_, for converting between depth images and
+  // point clouds.
+  CameraModel camera_model_;
 
   EnvStats env_stats_;
 
   void ResetEnvironmentState();
 
+  // Add the posed render model of every object in s to the scene.
+  void AddObjectsToScene(const GraphState &s,
+                         pcl::simulation::Scene *scene) const;
+
+  // Level of detail to render object_state with, from the projected size of
+  // its circumscribed circle.
+  int GetLODLevel(const ObjectState &object_state) const;
+
+  // Hash of everything other than the object that a single object render
+  // depends on: camera pose and intrinsics, table height, renderer and the
+  // search resolution.
+  uint64_t GetSceneHash() const;
+  // Returns false if object_state is not on the discrete pose grid, in which
+  // case its render is not kept in the template bank.
+  bool GetTemplateKey(const ObjectState &object_state, TemplateKey *key) const;
+  // Same as GetDepthImagesROI for states of a single object each, but
+  // renders found in the template bank are not rendered again, and the
+  // others are added to it.
+  void GetSingleObjectDepthImagesROI(const std::vector<GraphState> &states,
+                                     std::vector<pcl::simulation::DepthImageROI> *rois);
+
   void GenerateSuccessorStates(const GraphState &source_state,
                                std::vector<GraphState> *succ_states) const;
 
@@ -295,47 +417,109 @@ class EnvObjectRecognition : public EnvironmentMHA {
   static bool GetComposedDepthImage(const std::vector<unsigned short>
                                     &source_depth_image, const std::vector<unsigned short>
                                     &last_object_depth_image, std::vector<unsigned short> *composed_depth_image);
+  // Same as above with the last object rendered into a ROI. Only the pixels
+  // inside the ROI are composed, the rest are copied from the source.
+  static bool GetComposedDepthImage(const std::vector<unsigned short>
+                                    &source_depth_image, const pcl::simulation::DepthImageROI
+                                    &last_object_depth_image, std::vector<unsigned short> *composed_depth_image);
+  // Returns false if the requested render of the single object state is not
+  // in single_object_cache_.
   bool GetSingleObjectDepthImage(const GraphState &single_object_graph_state,
-                                 std::vector<unsigned short> *single_object_depth_image, bool after_refinement);
+                                 pcl::simulation::DepthImageROI *single_object_depth_image,
+                                 bool after_refinement);
+  // Fill in the cached renders of the last object of input->child_state, if
+  // any.
+  void SetCachedLastObject(CostComputationInput *input);
+  // Add the renders computed for input to single_object_cache_.
+  void CacheLastObject(const CostComputationInput &input,
+                       const CostComputationOutput &output, bool valid_successor);
 
   // Computes the cost for the parent-child edge. Returns the adjusted child state, where the pose
   // of the last added object is adjusted using ICP and the computed state properties.
+  // If last_object_depth_image is provided, it is used as the rendering of
+  // the (unadjusted) last object alone instead of rendering it here. It only
+  // needs to cover the pixels of the last object, see GetDepthImageROI.
+  // If adjusted_last_object is also provided, and no object in the source
+  // hides the last one, it is taken as the ICP result and
+  // adjusted_last_object_depth_image as its render.
+  // With use_gpu_scoring, source_depth_image must be the reference image of
+  // the simulator, see SetReferenceDepthImage.
   int GetCost(const GraphState &source_state, const GraphState &child_state,
               const std::vector<unsigned short> &source_depth_image,
-              const std::vector<int> &parent_counted_pixels,
-              std::vector<int> *child_counted_pixels,
+              const PixelSet &parent_counted_pixels,
+              PixelSet *child_counted_pixels,
               GraphState *adjusted_child_state,
               GraphStateProperties *state_properties,
               std::vector<unsigned short> *adjusted_child_depth_image,
-              std::vector<unsigned short> *unadjusted_child_depth_image);
+              std::vector<unsigned short> *unadjusted_child_depth_image,
+              const pcl::simulation::DepthImageROI *last_object_depth_image = nullptr,
+              const ObjectState *adjusted_last_object = nullptr,
+              const pcl::simulation::DepthImageROI *adjusted_last_object_depth_image = nullptr);
 
   // Cost for newly rendered object. Input cloud must contain only newly rendered points.
   int GetTargetCost(const PointCloudPtr
                     partial_rendered_cloud);
+  // True if the observed cloud has a point within sensor_resolution of point.
+  bool HasObservedNeighbor(const PointT &point) const;
   // Cost for points in observed cloud that can be computed based on the rendered cloud.
-  int GetSourceCost(const PointCloudPtr full_rendered_cloud,
+  int GetSourceCost(const std::vector<unsigned short> &full_rendered_depth_image,
                     const ObjectState &last_object, const bool last_level,
-                    const std::vector<int> &parent_counted_pixels,
-                    std::vector<int> *child_counted_pixels);
+                    const PixelSet &parent_counted_pixels,
+                    PixelSet *child_counted_pixels);
   // NOTE: updated_counted_pixels should always be equal to the number of
   // points in the input point cloud.
-  int GetLastLevelCost(const PointCloudPtr full_rendered_cloud,
-                    const ObjectState &last_object,
-                    const std::vector<int> &counted_pixels,
-                    std::vector<int> *updated_counted_pixels);
+  int GetLastLevelCost(const std::vector<unsigned short>
+                       &full_rendered_depth_image,
+                       const ObjectState &last_object,
+                       const PixelSet &counted_pixels,
+                       PixelSet *updated_counted_pixels);
+  // True if the rendered depth image has a point within sensor_resolution of
+  // the observed point observed_point_index (an index into observed_cloud_).
+  // This is a projective lookup, so no KdTree is built for the rendered
+  // points.
+  bool HasRenderedNeighbor(const std::vector<unsigned short>
+                           &rendered_depth_image, int observed_point_index) const;
+  // Indices of observed points within the inscribed cylinder of last_object
+  // that are not in counted_pixels.
+  void GetInfeasibleIndices(const ObjectState &last_object,
+                            const PixelSet &counted_pixels,
+                            PixelSet *indices_to_consider);
+  // Same costs as GetTargetCost, GetSourceCost and GetLastLevelCost (if
+  // last_level) for the child state with depth image child_depth_image.
+  // kinect_simulator_ must have rendered the child last, or just the objects
+  // it adds to the parent, and have the parent's depth image as reference
+  // (see SetReferenceDepthImage). The nearest neighbour tests are done by
+  // RangeLikelihood next to the rendered depth, so no point clouds or
+  // KdTrees are built.
+  void GetRenderedCosts(const std::vector<unsigned short> &child_depth_image,
+                        const ObjectState &last_object, bool last_level,
+                        const PixelSet &parent_counted_pixels,
+                        PixelSet *child_counted_pixels, int *target_cost,
+                        int *source_cost, int *last_level_cost);
+  // Make depth_image, the cropped image of the state with id source_id, the
+  // occlusion and scoring reference of the simulator. Nothing is done if
+  // source_id is unchanged since the last call, and the image is uploaded
+  // only if it differs from the current reference. ResetReferenceDepthImage
+  // forgets the id where ids may have been given other images.
+  void SetReferenceDepthImage(const pcl::simulation::DepthImageROI
+                              &depth_image, int source_id);
+  void ResetReferenceDepthImage();
 
   // Computes the cost for the lazy parent-child edge. This is an admissible estimate of the true parent-child edge cost, computed without any
-  // additional renderings. This requires the true source depth image and
-  // unadjusted child depth image (pre-ICP).
+  // additional renderings. This requires the true source depth image, also
+  // cropped (see CropDepthImage), and the cached renders of the last object
+  // alone before and after ICP. The child depth image is composed from the
+  // cropped images and returned cropped.
   int GetLazyCost(const GraphState &source_state, const GraphState &child_state,
                   const std::vector<unsigned short> &source_depth_image,
-                  const std::vector<unsigned short> &unadjusted_last_object_depth_image,
-                  const std::vector<unsigned short> &adjusted_last_object_depth_image,
+                  const pcl::simulation::DepthImageROI &source_depth_image_roi,
+                  const pcl::simulation::DepthImageROI &unadjusted_last_object_depth_image,
+                  const pcl::simulation::DepthImageROI &adjusted_last_object_depth_image,
                   const GraphState &adjusted_last_object_state,
-                  const std::vector<int> &parent_counted_pixels,
+                  const PixelSet &parent_counted_pixels,
                   GraphState *adjusted_child_state,
                   GraphStateProperties *state_properties,
-                  std::vector<unsigned short> *final_depth_image);
+                  pcl::simulation::DepthImageROI *final_depth_image);
 
   // Returns true if parent is occluded by successor. Additionally returns min and max depth for newly rendered pixels
   // when occlusion-free.
@@ -343,6 +527,14 @@ class EnvObjectRecognition : public EnvironmentMHA {
                          const std::vector<unsigned short> &succ_depth_image,
                          std::vector<int> *new_pixel_indices, unsigned short *min_succ_depth,
                          unsigned short *max_succ_depth);
+  // Same as IsOccluded(parent_depth_image, composed_depth_image, ...), where
+  // composed_depth_image is parent_depth_image composed with the last object
+  // alone rendered into last_object_depth_image. Only the pixels of the ROI
+  // are visited, since the composed image equals the parent elsewhere.
+  static bool IsOccluded(const std::vector<unsigned short> &parent_depth_image,
+                         const pcl::simulation::DepthImageROI &last_object_depth_image,
+                         std::vector<int> *new_pixel_indices, unsigned short *min_succ_depth,
+                         unsigned short *max_succ_depth);
 
   bool IsValidPose(GraphState s, int model_id, ContPose p,
                    bool after_refinement) const;
@@ -0,0 +1,105 @@
+#pragma once
+
+/**
+ * @file template_bank.h
+ * @brief Persistent bank of single object depth renders
+ * @author Venkatraman Narayanan
+ * Carnegie Mellon University, 2015
+ */
+
+#include <kinect_sim/simulation_io.hpp>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace sbpl_perception {
+
+// Identifies the render of a single object: the model, its discrete pose and
+// the level of detail it was drawn with. Everything else that affects the
+// render (camera, table height, discretization) is folded into the scene hash
+// of the bank that holds the key.
+struct TemplateKey {
+  uint64_t model_hash;
+  int32_t x;
+  int32_t y;
+  int32_t yaw;
+  int32_t lod_level;
+
+  TemplateKey() : model_hash(0), x(0), y(0), yaw(0), lod_level(0) {}
+  TemplateKey(uint64_t model_hash, int x, int y, int yaw, int lod_level) :
+    model_hash(model_hash), x(x), y(y), yaw(yaw), lod_level(lod_level) {}
+
+  bool operator<(const TemplateKey &other) const;
+  bool operator==(const TemplateKey &other) const;
+};
+
+// 64-bit FNV-1a hash, stable across processes and runs, used to build model
+// and scene hashes.
+uint64_t HashBytes(const void *data, size_t num_bytes,
+                   uint64_t seed = 14695981039346656037ULL);
+
+// On-disk store of single object depth images (pcl::simulation::DepthImageROI)
+// for one scene hash, shared between planning episodes and processes.
+//
+// The file is memory mapped read-only, so every MPI rank on a machine that
+// opens the same bank shares one copy of it in the page cache. Renders added
+// with Add() are kept in memory (and are visible to Find()) until Save()
+// merges them into the file. Save() writes a new file and renames it over the
+// old one, so readers that still have the old file mapped are unaffected.
+class TemplateBank {
+ public:
+  TemplateBank();
+
+  // Map the bank file at path. A missing file, or one written for a
+  // different scene hash or file format, is treated as an empty bank (and is
+  // replaced on the next Save()). Returns the number of mapped templates.
+  size_t Open(const std::string &path, uint64_t scene_hash);
+  void Close();
+  bool IsOpen() const {
+    return !path_.empty();
+  }
+
+  // Returns false if there is no template for key.
+  bool Find(const TemplateKey &key, pcl::simulation::DepthImageROI *roi) const;
+  // Keys already in the bank are ignored.
+  void Add(const TemplateKey &key, const pcl::simulation::DepthImageROI &roi);
+
+  // Templates added since the bank was opened or last saved.
+  const std::map<TemplateKey, pcl::simulation::DepthImageROI> &pending() const {
+    return pending_;
+  }
+
+  // Write the mapped and pending templates to the bank file and map it
+  // again. Returns false if the file could not be written, in which case the
+  // pending templates are kept.
+  bool Save();
+
+  size_t size() const {
+    return num_mapped_ + pending_.size();
+  }
+
+ private:
+  struct FileHeader;
+  struct FileEntry;
+
+  std::string path_;
+  uint64_t scene_hash_;
+
+  std::unique_ptr<boost::interprocess::file_mapping> file_;
+  std::unique_ptr<boost::interprocess::mapped_region> region_;
+  // Sorted by key; these point into region_.
+  const FileEntry *entries_;
+  const char *data_;
+  size_t num_mapped_;
+
+  std::map<TemplateKey, pcl::simulation::DepthImageROI> pending_;
+
+  const FileEntry *FindMapped(const TemplateKey &key) const;
+};
+}  // namespace
@@ -36,9 +36,12 @@ class DatasetGenerator {
   boost::filesystem::path output_dir_;
   pcl::simulation::SimExample::Ptr kinect_simulator_;
   std::vector<ObjectModel> object_models_;
+  // GPU-resident render models, one per entry in object_models_.
+  std::vector<pcl::simulation::Model::Ptr> render_models_;
 
 
-  std::vector<unsigned short> GetDepthImage(const std::vector<ObjectModel>
+  // Render the models (indices into object_models_) placed at the origin.
+  std::vector<unsigned short> GetDepthImage(const std::vector<int>
                                             &models_in_scene, const Eigen::Isometry3d &camera_pose);
 
 
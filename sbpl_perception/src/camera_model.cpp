@@ -0,0 +1,171 @@
+/**
+ * @file camera_model.cpp
+ * @brief Pinhole model of the depth camera with precomputed pixel rays
+ * @author Venkatraman Narayanan
+ * Carnegie Mellon University, 2015
+ */
+
+#include <sbpl_perception/camera_model.h>
+
+#include <sbpl_perception/utils/utils.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+// Optical frame (x right, y up, looking along -z) in the camera body frame
+// (x forward, z up), as in RangeLikelihood.
+Eigen::Matrix4f BodyToOptical() {
+  Eigen::Matrix4f T;
+  T <<  0, 0, -1, 0,
+  -1, 0,  0, 0,
+  0, 1,  0, 0,
+  0, 0,  0, 1;
+  return T;
+}
+}  // namespace
+
+namespace sbpl_perception {
+
+CameraModel::CameraModel() : width_(0), height_(0), fx_(1.0f), fy_(1.0f),
+  cx_(0.0f), cy_(0.0f) {
+  SetCameraPose(Eigen::Isometry3d::Identity());
+}
+
+CameraModel::CameraModel(int width, int height, float fx, float fy,
+                         float cx, float cy) : width_(width), height_(height), fx_(fx), fy_(fy),
+  cx_(cx), cy_(cy) {
+  SetCameraPose(Eigen::Isometry3d::Identity());
+}
+
+void CameraModel::SetCameraPose(const Eigen::Isometry3d &camera_pose) {
+  const Eigen::Matrix4f camera_to_world = camera_pose.matrix().cast<float>() *
+                                          BodyToOptical();
+  const Eigen::Matrix3f rotation = camera_to_world.block<3, 3>(0, 0);
+  origin_x_ = camera_to_world(0, 3);
+  origin_y_ = camera_to_world(1, 3);
+  origin_z_ = camera_to_world(2, 3);
+
+  const int num_pixels = width_ * height_;
+  ray_x_.resize(num_pixels);
+  ray_y_.resize(num_pixels);
+  ray_z_.resize(num_pixels);
+
+  for (int row = 0; row < height_; ++row) {
+    // Rows of the optical frame run bottom-up.
+    const float v = static_cast<float>(height_ - 1 - row);
+
+    for (int u = 0; u < width_; ++u) {
+      const Eigen::Vector3f optical_ray((static_cast<float>(u) - cx_) / fx_,
+                                        (v - cy_) / fy_, -1.0f);
+      const Eigen::Vector3f ray = rotation * optical_ray / 1000.0f;
+      const int index = row * width_ + u;
+      ray_x_[index] = ray[0];
+      ray_y_[index] = ray[1];
+      ray_z_[index] = ray[2];
+    }
+  }
+
+  world_to_camera_rotation_ = rotation.transpose();
+  world_to_camera_translation_ = -world_to_camera_rotation_ *
+                                 camera_to_world.block<3, 1>(0, 3);
+}
+
+void CameraModel::GetWorldPoints(const unsigned short *depth_image, float *x,
+                                 float *y, float *z) const {
+  const int num_pixels = width_ * height_;
+  const float *ray_x = ray_x_.data();
+  const float *ray_y = ray_y_.data();
+  const float *ray_z = ray_z_.data();
+
+  for (int ii = 0; ii < num_pixels; ++ii) {
+    const float depth = static_cast<float>(depth_image[ii]);
+    x[ii] = origin_x_ + depth * ray_x[ii];
+    y[ii] = origin_y_ + depth * ray_y[ii];
+    z[ii] = origin_z_ + depth * ray_z[ii];
+  }
+}
+
+bool CameraModel::Project(const Eigen::Vector3f &world_point, int *index,
+                          float *range) const {
+  const Eigen::Vector3f local_point = world_to_camera_rotation_ * world_point +
+                                      world_to_camera_translation_;
+
+  // Truncated like RangeLikelihood::getCameraCoordinate.
+  const int u = static_cast<int>(-fx_ * local_point[0] / local_point[2] + cx_);
+  const int v = height_ - 1 - static_cast<int>(-fy_ * local_point[1] /
+                                               local_point[2] + cy_);
+  *range = -local_point[2];
+
+  if (u < 0 || v < 0 || u >= width_ || v >= height_) {
+    return false;
+  }
+
+  *index = v * width_ + u;
+  return true;
+}
+
+bool CameraModel::GetNeighborhoodWindow(int index, float range, float radius,
+                                        int *min_u, int *max_u, int *min_row, int *max_row) const {
+  if (range <= radius) {
+    return false;
+  }
+
+  const int u = index % width_;
+  const int row = index / width_;
+  const float v = static_cast<float>(height_ - 1 - row);
+
+  // A point q within radius of p has range at least range - radius, and its
+  // image coordinate differs from that of p by at most
+  // (f + |coordinate - c|) * radius / (range - radius). The pixel of p is
+  // truncated, hence the extra pixel inside and outside of the bound.
+  const float scale = radius / (range - radius);
+  const int window_u = static_cast<int>(std::ceil((fx_ + std::fabs(
+                                                      static_cast<float>(u) - cx_) + 1.0f) * scale)) + 1;
+  const int window_v = static_cast<int>(std::ceil((fy_ + std::fabs(
+                                                      v - cy_) + 1.0f) * scale)) + 1;
+
+  *min_u = std::max(0, u - window_u);
+  *max_u = std::min(width_ - 1, u + window_u);
+  *min_row = std::max(0, row - window_v);
+  *max_row = std::min(height_ - 1, row + window_v);
+  return true;
+}
+
+bool CameraModel::HasNeighborInDepthImage(const unsigned short *depth_image,
+                                          const Eigen::Vector3f &world_point, int index, float range, float radius,
+                                          bool exact) const {
+  int min_u = 0, max_u = width_ - 1, min_row = 0, max_row = height_ - 1;
+
+  // Without a window, the whole image is searched.
+  GetNeighborhoodWindow(index, range, radius, &min_u, &max_u, &min_row,
+                        &max_row);
+
+  // Two points are at least as far apart as their depths. Depths are whole
+  // mm, so a mm more keeps rounding from dropping a neighbour.
+  const float max_depth_difference = 1000.0f * radius + 1.0f;
+  const float depth = 1000.0f * range;
+  const float sqr_radius = radius * radius;
+
+  for (int row = min_row; row <= max_row; ++row) {
+    for (int u = min_u; u <= max_u; ++u) {
+      const int neighbor_index = row * width_ + u;
+      const unsigned short neighbor_depth = depth_image[neighbor_index];
+
+      if (neighbor_depth == kKinectMaxDepth ||
+          std::fabs(static_cast<float>(neighbor_depth) - depth) >
+          max_depth_difference) {
+        continue;
+      }
+
+      if (!exact ||
+          (GetWorldPoint(neighbor_index, neighbor_depth) -
+           world_point).squaredNorm() <= sqr_radius) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+}  // namespace
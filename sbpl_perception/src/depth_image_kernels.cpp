@@ -0,0 +1,547 @@
+/**
+ * @file depth_image_kernels.cpp
+ * @brief Fused per-pixel operations on depth images
+ * @author Venkatraman Narayanan
+ * Carnegie Mellon University, 2015
+ */
+
+#include <sbpl_perception/depth_image_kernels.h>
+
+#include <sbpl_perception/utils/utils.h>
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+using pcl::simulation::DepthImageROI;
+
+namespace sbpl_perception {
+namespace {
+
+// Where one pass writes its results. Image pointers are null if the image
+// is not wanted, and otherwise point at the pixel of the current row.
+struct ComposeOutput {
+  unsigned short *composed;
+  unsigned short *new_object;
+  int *new_indices;
+  int num_new;
+  unsigned short min_new_depth;
+  unsigned short max_new_depth;
+};
+
+// Pixels [begin, end) of a row whose first pixel has index first_index in
+// the full image. Returns true if the object occludes the source.
+bool ComposeRowScalar(const unsigned short *source,
+                      const unsigned short *object, int begin, int end, int first_index,
+                      ComposeOutput *output) {
+  for (int ii = begin; ii < end; ++ii) {
+    const unsigned short source_depth = source[ii];
+    const unsigned short object_depth = object[ii];
+    const bool source_valid = source_depth != kKinectMaxDepth;
+    const bool object_valid = object_depth != kKinectMaxDepth;
+
+    if (source_valid && object_valid && object_depth < source_depth) {
+      return true;
+    }
+
+    const bool is_new = object_valid && !source_valid;
+
+    if (output->composed != nullptr) {
+      output->composed[ii] = std::min(source_depth, object_depth);
+    }
+
+    if (output->new_object != nullptr) {
+      output->new_object[ii] = is_new ? object_depth : kKinectMaxDepth;
+    }
+
+    if (is_new) {
+      output->new_indices[output->num_new++] = first_index + ii;
+      output->min_new_depth = std::min(output->min_new_depth, object_depth);
+      output->max_new_depth = std::max(output->max_new_depth, object_depth);
+    }
+  }
+
+  return false;
+}
+
+#if defined(__AVX2__)
+constexpr int kLanes = 16;
+
+// Same as ComposeRowScalar for the first (end / kLanes) * kLanes pixels.
+bool ComposeRowVector(const unsigned short *source,
+                      const unsigned short *object, int end, int first_index,
+                      ComposeOutput *output) {
+  const __m256i bias = _mm256_set1_epi16(static_cast<short>(0x8000));
+  const __m256i no_return = _mm256_set1_epi16(static_cast<short>
+                                              (kKinectMaxDepth));
+  __m256i min_new = _mm256_set1_epi16(static_cast<short>(0xFFFF));
+  __m256i max_new = _mm256_setzero_si256();
+  bool any_new = false;
+
+  for (int ii = 0; ii + kLanes <= end; ii += kLanes) {
+    const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                         (source + ii));
+    const __m256i o = _mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                         (object + ii));
+    const __m256i s_none = _mm256_cmpeq_epi16(s, no_return);
+    const __m256i o_none = _mm256_cmpeq_epi16(o, no_return);
+    // Unsigned o < s, as a signed comparison of the biased values.
+    const __m256i o_in_front = _mm256_cmpgt_epi16(_mm256_xor_si256(s, bias),
+                                                  _mm256_xor_si256(o, bias));
+
+    if (_mm256_movemask_epi8(_mm256_andnot_si256(_mm256_or_si256(s_none,
+                                                                 o_none), o_in_front)) != 0) {
+      return true;
+    }
+
+    const __m256i is_new = _mm256_andnot_si256(o_none, s_none);
+
+    if (output->composed != nullptr) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(output->composed + ii),
+                          _mm256_min_epu16(s, o));
+    }
+
+    if (output->new_object != nullptr) {
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(output->new_object + ii),
+                          _mm256_blendv_epi8(no_return, o, is_new));
+    }
+
+    // Two mask bits per pixel.
+    unsigned int mask = static_cast<unsigned int>(_mm256_movemask_epi8(is_new));
+
+    if (mask == 0) {
+      continue;
+    }
+
+    any_new = true;
+    min_new = _mm256_min_epu16(min_new, _mm256_blendv_epi8(
+                                 _mm256_set1_epi16(static_cast<short>(0xFFFF)), o, is_new));
+    max_new = _mm256_max_epu16(max_new, _mm256_and_si256(o, is_new));
+
+    while (mask != 0) {
+      output->new_indices[output->num_new++] = first_index + ii +
+                                               __builtin_ctz(mask) / 2;
+      mask &= mask - 1;
+      mask &= mask - 1;
+    }
+  }
+
+  if (any_new) {
+    unsigned short min_lanes[kLanes], max_lanes[kLanes];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(min_lanes), min_new);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(max_lanes), max_new);
+    output->min_new_depth = std::min(output->min_new_depth,
+                                     *std::min_element(min_lanes, min_lanes + kLanes));
+    output->max_new_depth = std::max(output->max_new_depth,
+                                     *std::max_element(max_lanes, max_lanes + kLanes));
+  }
+
+  return false;
+}
+#elif defined(__SSE2__)
+constexpr int kLanes = 8;
+
+// SSE2 only compares signed 16 bit integers, so depths are compared (and
+// the new depth range is kept) with the sign bit flipped.
+inline __m128i Select(__m128i mask, __m128i if_set, __m128i if_clear) {
+  return _mm_or_si128(_mm_and_si128(mask, if_set),
+                      _mm_andnot_si128(mask, if_clear));
+}
+
+// Same as ComposeRowScalar for the first (end / kLanes) * kLanes pixels.
+bool ComposeRowVector(const unsigned short *source,
+                      const unsigned short *object, int end, int first_index,
+                      ComposeOutput *output) {
+  const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+  const __m128i no_return = _mm_set1_epi16(static_cast<short>
+                                           (kKinectMaxDepth));
+  const __m128i biased_max = _mm_set1_epi16(0x7FFF);
+  const __m128i biased_min = bias;
+  __m128i min_new = biased_max;
+  __m128i max_new = biased_min;
+  bool any_new = false;
+
+  for (int ii = 0; ii + kLanes <= end; ii += kLanes) {
+    const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                      (source + ii));
+    const __m128i o = _mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                      (object + ii));
+    const __m128i s_biased = _mm_xor_si128(s, bias);
+    const __m128i o_biased = _mm_xor_si128(o, bias);
+    const __m128i s_none = _mm_cmpeq_epi16(s, no_return);
+    const __m128i o_none = _mm_cmpeq_epi16(o, no_return);
+    const __m128i o_in_front = _mm_cmplt_epi16(o_biased, s_biased);
+
+    if (_mm_movemask_epi8(_mm_andnot_si128(_mm_or_si128(s_none, o_none),
+                                           o_in_front)) != 0) {
+      return true;
+    }
+
+    const __m128i is_new = _mm_andnot_si128(o_none, s_none);
+
+    if (output->composed != nullptr) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(output->composed + ii),
+                       _mm_xor_si128(_mm_min_epi16(s_biased, o_biased), bias));
+    }
+
+    if (output->new_object != nullptr) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(output->new_object + ii),
+                       Select(is_new, o, no_return));
+    }
+
+    // Two mask bits per pixel.
+    unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(is_new));
+
+    if (mask == 0) {
+      continue;
+    }
+
+    any_new = true;
+    min_new = _mm_min_epi16(min_new, Select(is_new, o_biased, biased_max));
+    max_new = _mm_max_epi16(max_new, Select(is_new, o_biased, biased_min));
+
+    while (mask != 0) {
+      output->new_indices[output->num_new++] = first_index + ii +
+                                               __builtin_ctz(mask) / 2;
+      mask &= mask - 1;
+      mask &= mask - 1;
+    }
+  }
+
+  if (any_new) {
+    unsigned short min_lanes[kLanes], max_lanes[kLanes];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(min_lanes),
+                     _mm_xor_si128(min_new, bias));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(max_lanes),
+                     _mm_xor_si128(max_new, bias));
+    output->min_new_depth = std::min(output->min_new_depth,
+                                     *std::min_element(min_lanes, min_lanes + kLanes));
+    output->max_new_depth = std::max(output->max_new_depth,
+                                     *std::max_element(max_lanes, max_lanes + kLanes));
+  }
+
+  return false;
+}
+#endif
+
+bool ComposeRow(const unsigned short *source, const unsigned short *object,
+                int length, int first_index, ComposeOutput *output) {
+  int vector_end = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+  vector_end = (length / kLanes) * kLanes;
+
+  if (ComposeRowVector(source, object, vector_end, first_index, output)) {
+    return true;
+  }
+
+#endif
+  return ComposeRowScalar(source, object, vector_end, length, first_index,
+                          output);
+}
+
+// The object's render covers the rectangle (x, y, width, height), and row v
+// of it starts at object + v * object_stride.
+bool ComposeObject(const std::vector<unsigned short> &source_depth_image,
+                   const unsigned short *object, int object_stride, int x, int y,
+                   int width, int height,
+                   std::vector<unsigned short> *composed_depth_image,
+                   std::vector<int> *new_pixel_indices, unsigned short *min_new_depth,
+                   unsigned short *max_new_depth,
+                   std::vector<unsigned short> *new_object_depth_image) {
+  assert(static_cast<int>(source_depth_image.size()) == kNumPixels);
+  assert(x >= 0 && y >= 0 && x + width <= kDepthImageWidth &&
+         y + height <= kDepthImageHeight);
+  const bool full_image = width == kDepthImageWidth &&
+                          height == kDepthImageHeight;
+
+  // Pixels outside of the ROI are those of the source and of an empty image.
+  if (composed_depth_image != nullptr) {
+    if (full_image) {
+      composed_depth_image->resize(kNumPixels);
+    } else {
+      *composed_depth_image = source_depth_image;
+    }
+  }
+
+  if (new_object_depth_image != nullptr) {
+    if (full_image) {
+      new_object_depth_image->resize(kNumPixels);
+    } else {
+      new_object_depth_image->assign(kNumPixels, kKinectMaxDepth);
+    }
+  }
+
+  // Room for every pixel of the ROI, trimmed to the new ones at the end.
+  new_pixel_indices->resize(static_cast<size_t>(width) * height);
+
+  ComposeOutput output;
+  output.new_indices = new_pixel_indices->data();
+  output.num_new = 0;
+  output.min_new_depth = kKinectMaxDepth;
+  output.max_new_depth = 0;
+  bool is_occluded = false;
+
+  for (int v = 0; v < height && !is_occluded; ++v) {
+    const int first_index = (y + v) * kDepthImageWidth + x;
+    output.composed = composed_depth_image == nullptr ? nullptr :
+                      composed_depth_image->data() + first_index;
+    output.new_object = new_object_depth_image == nullptr ? nullptr :
+                        new_object_depth_image->data() + first_index;
+    is_occluded = ComposeRow(source_depth_image.data() + first_index,
+                             object + v * object_stride, width, first_index, &output);
+  }
+
+  if (is_occluded) {
+    new_pixel_indices->clear();
+    *min_new_depth = kKinectMaxDepth;
+    *max_new_depth = 0;
+
+    if (composed_depth_image != nullptr) {
+      composed_depth_image->clear();
+    }
+
+    if (new_object_depth_image != nullptr) {
+      new_object_depth_image->clear();
+    }
+
+    return true;
+  }
+
+  new_pixel_indices->resize(output.num_new);
+  *min_new_depth = output.min_new_depth;
+  *max_new_depth = output.max_new_depth;
+  return false;
+}
+}  // namespace
+
+bool ComposeObjectDepthImage(const std::vector<unsigned short>
+                             &source_depth_image, const DepthImageROI &object_depth_image,
+                             std::vector<unsigned short> *composed_depth_image,
+                             std::vector<int> *new_pixel_indices, unsigned short *min_new_depth,
+                             unsigned short *max_new_depth,
+                             std::vector<unsigned short> *new_object_depth_image) {
+  const DepthImageROI &roi = object_depth_image;
+  assert(static_cast<int>(roi.depth.size()) == roi.width * roi.height);
+  return ComposeObject(source_depth_image, roi.depth.data(), roi.width, roi.x,
+                       roi.y, roi.width, roi.height, composed_depth_image, new_pixel_indices,
+                       min_new_depth, max_new_depth, new_object_depth_image);
+}
+
+bool ComposeObjectDepthImage(const std::vector<unsigned short>
+                             &source_depth_image, const std::vector<unsigned short> &object_depth_image,
+                             std::vector<unsigned short> *composed_depth_image,
+                             std::vector<int> *new_pixel_indices, unsigned short *min_new_depth,
+                             unsigned short *max_new_depth,
+                             std::vector<unsigned short> *new_object_depth_image) {
+  assert(static_cast<int>(object_depth_image.size()) == kNumPixels);
+  return ComposeObject(source_depth_image, object_depth_image.data(),
+                       kDepthImageWidth, 0, 0, kDepthImageWidth, kDepthImageHeight,
+                       composed_depth_image, new_pixel_indices, min_new_depth, max_new_depth,
+                       new_object_depth_image);
+}
+
+void ComposeDepthImages(const unsigned short *first,
+                        const unsigned short *second, size_t num_pixels,
+                        unsigned short *composed) {
+  size_t ii = 0;
+#if defined(__AVX2__)
+
+  for (; ii + 16 <= num_pixels; ii += 16) {
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                         (first + ii));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                         (second + ii));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(composed + ii),
+                        _mm256_min_epu16(a, b));
+  }
+
+#elif defined(__SSE2__)
+  const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+
+  for (; ii + 8 <= num_pixels; ii += 8) {
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                      (first + ii));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                      (second + ii));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(composed + ii),
+                     _mm_xor_si128(_mm_min_epi16(_mm_xor_si128(a, bias), _mm_xor_si128(b,
+                                                                                        bias)), bias));
+  }
+
+#endif
+
+  for (; ii < num_pixels; ++ii) {
+    composed[ii] = std::min(first[ii], second[ii]);
+  }
+}
+
+void MaskOccludedPixels(const unsigned short *input,
+                        const unsigned short *mask, size_t num_pixels,
+                        unsigned short *masked) {
+  size_t ii = 0;
+#if defined(__AVX2__)
+  const __m256i bias = _mm256_set1_epi16(static_cast<short>(0x8000));
+  const __m256i no_return = _mm256_set1_epi16(static_cast<short>
+                                              (kKinectMaxDepth));
+
+  for (; ii + 16 <= num_pixels; ii += 16) {
+    const __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                          (input + ii));
+    const __m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                         (mask + ii));
+    const __m256i in_front = _mm256_cmpgt_epi16(_mm256_xor_si256(m, bias),
+                                                _mm256_xor_si256(in, bias));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(masked + ii),
+                        _mm256_blendv_epi8(no_return, in, in_front));
+  }
+
+#elif defined(__SSE2__)
+  const __m128i bias = _mm_set1_epi16(static_cast<short>(0x8000));
+  const __m128i no_return = _mm_set1_epi16(static_cast<short>
+                                           (kKinectMaxDepth));
+
+  for (; ii + 8 <= num_pixels; ii += 8) {
+    const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                       (input + ii));
+    const __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                      (mask + ii));
+    const __m128i in_front = _mm_cmplt_epi16(_mm_xor_si128(in, bias),
+                                             _mm_xor_si128(m, bias));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(masked + ii),
+                     Select(in_front, in, no_return));
+  }
+
+#endif
+
+  for (; ii < num_pixels; ++ii) {
+    masked[ii] = mask[ii] > input[ii] ? input[ii] : kKinectMaxDepth;
+  }
+}
+
+void CropDepthImage(const std::vector<unsigned short> &depth_image,
+                    DepthImageROI *roi) {
+  assert(static_cast<int>(depth_image.size()) == kNumPixels);
+  int min_u = kDepthImageWidth, min_v = kDepthImageHeight;
+  int max_u = -1, max_v = -1;
+
+  for (int v = 0; v < kDepthImageHeight; ++v) {
+    const unsigned short *row = depth_image.data() + v * kDepthImageWidth;
+    int first = 0;
+
+    while (first < kDepthImageWidth && row[first] == kKinectMaxDepth) {
+      ++first;
+    }
+
+    if (first == kDepthImageWidth) {
+      continue;
+    }
+
+    int last = kDepthImageWidth - 1;
+
+    while (row[last] == kKinectMaxDepth) {
+      --last;
+    }
+
+    min_u = std::min(min_u, first);
+    max_u = std::max(max_u, last);
+    min_v = std::min(min_v, v);
+    max_v = v;
+  }
+
+  *roi = DepthImageROI();
+
+  if (max_u < 0) {
+    return;
+  }
+
+  roi->x = min_u;
+  roi->y = min_v;
+  roi->width = max_u - min_u + 1;
+  roi->height = max_v - min_v + 1;
+  roi->depth.resize(roi->width * roi->height);
+
+  for (int v = 0; v < roi->height; ++v) {
+    const auto row_begin = depth_image.begin() + (roi->y + v) * kDepthImageWidth +
+                           roi->x;
+    std::copy(row_begin, row_begin + roi->width,
+              roi->depth.begin() + v * roi->width);
+  }
+}
+
+void ExpandDepthImage(const DepthImageROI &roi,
+                      std::vector<unsigned short> *depth_image) {
+  depth_image->assign(kNumPixels, kKinectMaxDepth);
+
+  for (int v = 0; v < roi.height; ++v) {
+    std::copy(roi.depth.begin() + v * roi.width,
+              roi.depth.begin() + (v + 1) * roi.width,
+              depth_image->begin() + (roi.y + v) * kDepthImageWidth + roi.x);
+  }
+}
+
+void ComposeDepthImages(const DepthImageROI &first,
+                        const DepthImageROI &second, DepthImageROI *composed) {
+  if (first.depth.empty() || second.depth.empty()) {
+    *composed = first.depth.empty() ? second : first;
+    return;
+  }
+
+  DepthImageROI result;
+  result.x = std::min(first.x, second.x);
+  result.y = std::min(first.y, second.y);
+  result.width = std::max(first.x + first.width,
+                          second.x + second.width) - result.x;
+  result.height = std::max(first.y + first.height,
+                           second.y + second.height) - result.y;
+  result.depth.assign(result.width * result.height, kKinectMaxDepth);
+
+  const DepthImageROI *rois[] = {&first, &second};
+
+  for (const DepthImageROI *roi : rois) {
+    for (int v = 0; v < roi->height; ++v) {
+      unsigned short *row = result.depth.data() + (roi->y - result.y + v) *
+                            result.width + roi->x - result.x;
+      ComposeDepthImages(row, roi->depth.data() + v * roi->width, roi->width, row);
+    }
+  }
+
+  *composed = std::move(result);
+}
+
+bool SameDepthImage(const DepthImageROI &first,
+                    const DepthImageROI &second) {
+  if (first.x == second.x && first.y == second.y &&
+      first.width == second.width && first.height == second.height) {
+    return first.depth == second.depth;
+  }
+
+  // Depth of a pixel of the full size image roi stands for.
+  auto depth_at = [](const DepthImageROI & roi, int u, int v) {
+    return u < roi.x || v < roi.y || u >= roi.x + roi.width ||
+           v >= roi.y + roi.height ? kKinectMaxDepth :
+           roi.depth[(v - roi.y) * roi.width + u - roi.x];
+  };
+
+  const DepthImageROI *rois[] = {&first, &second};
+
+  for (const DepthImageROI *roi : rois) {
+    const DepthImageROI &other = roi == &first ? second : first;
+
+    for (int v = roi->y; v < roi->y + roi->height; ++v) {
+      for (int u = roi->x; u < roi->x + roi->width; ++u) {
+        if (depth_at(*roi, u, v) != depth_at(other, u, v)) {
+          return false;
+        }
+      }
+    }
+  }
+
+  return true;
+}
+}  // namespace
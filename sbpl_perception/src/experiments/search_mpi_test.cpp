@@ -58,7 +58,7 @@ template<class InputType, class OutputType, class MapFunction> void map(
 
 CostComputationOutput Mapper(const CostComputationInput &input) {
   CostComputationOutput output;
-  output.cost = input.source_depth_image.size();
+  output.cost = input.source_depth_image.depth.size();
   return output;
 }
 
@@ -76,7 +76,7 @@ int main(int argc, char *argv[]) {
   for (int ii = 0; ii < 10; ++ii) {
     CostComputationInput cc;
     cc.source_id = ii;
-    cc.source_depth_image.resize(ii);
+    cc.source_depth_image.depth.resize(ii);
     cc.child_id = 0;
     input.push_back(cc);
   }
@@ -15,6 +15,7 @@
 #include <pcl/filters/filter.h>
 #include <pcl_ros/transforms.h>
 #include <pcl/PCLPointCloud2.h>
+#include <pcl/surface/vtk_smoothing/vtk_mesh_quadric_decimation.h>
 #include <pcl_conversions/pcl_conversions.h>
 
 #include <kinect_sim/model.h>
@@ -135,6 +136,29 @@ void ObjectModel::SetObjectProperties() {
   max_z_ = max_pt.z;
 }
 
+void ObjectModel::BuildLODChain(int max_levels, int min_triangles) {
+  lod_meshes_.clear();
+  pcl::PolygonMesh::Ptr previous(new pcl::PolygonMesh(mesh_));
+
+  while (NumLODLevels() < max_levels &&
+         static_cast<int>(previous->polygons.size()) >= 2 * min_triangles) {
+    pcl::PolygonMesh::Ptr decimated(new pcl::PolygonMesh);
+    pcl::MeshQuadricDecimationVTK decimation;
+    decimation.setInputMesh(previous);
+    decimation.setTargetReductionFactor(0.5);
+    decimation.process(*decimated);
+
+    // Stop if the decimation could not remove anything.
+    if (decimated->polygons.empty() ||
+        decimated->polygons.size() >= previous->polygons.size()) {
+      break;
+    }
+
+    lod_meshes_.push_back(*decimated);
+    previous = decimated;
+  }
+}
+
 double ObjectModel::GetInscribedRadius() const {
   return std::min(fabs(max_x_ - min_x_), fabs(max_y_ - min_y_)) / 2.0;
 }
@@ -146,16 +170,7 @@ double ObjectModel::GetCircumscribedRadius() const {
 
 pcl::PolygonMeshPtr ObjectModel::GetTransformedMesh(const ContPose &p,
                                                     double table_height) const {
-  pcl::PolygonMeshPtr mesh_in(new pcl::PolygonMesh(mesh_));
-  pcl::PolygonMeshPtr transformed_mesh(new pcl::PolygonMesh);
-  Eigen::Matrix4f transform;
-  transform <<
-            cos(p.yaw()), -sin(p.yaw()) , 0, p.x(),
-                sin(p.yaw()) , cos(p.yaw()) , 0, p.y(),
-                0, 0 , 1 , table_height,
-                0, 0 , 0 , 1;
-  TransformPolyMesh(mesh_in, transformed_mesh, transform);
-  return transformed_mesh;
+  return GetTransformedMesh(GetModelToSceneTransform(p, table_height).matrix());
 }
 
 pcl::PolygonMeshPtr ObjectModel::GetTransformedMesh(const Eigen::Matrix4f &transform ) const {
@@ -165,7 +180,8 @@ pcl::PolygonMeshPtr ObjectModel::GetTransformedMesh(const Eigen::Matrix4f &trans
   return transformed_mesh;
 }
 
-Eigen::Affine3f ObjectModel::GetRawModelToSceneTransform(const ContPose &p, double table_height) const {
+Eigen::Affine3f ObjectModel::GetModelToSceneTransform(const ContPose &p,
+                                                      double table_height) const {
   Eigen::Matrix4f transform;
   transform <<
             cos(p.yaw()), -sin(p.yaw()) , 0, p.x(),
@@ -173,6 +189,10 @@ Eigen::Affine3f ObjectModel::GetRawModelToSceneTransform(const ContPose &p, doub
                 0, 0 , 1 , table_height,
                 0, 0 , 0 , 1;
   Eigen::Affine3f model_to_scene_transform;
-  model_to_scene_transform.matrix() = transform.matrix() * preprocessing_transform_.matrix();
+  model_to_scene_transform.matrix() = transform;
   return model_to_scene_transform;
 }
+
+Eigen::Affine3f ObjectModel::GetRawModelToSceneTransform(const ContPose &p, double table_height) const {
+  return GetModelToSceneTransform(p, table_height) * preprocessing_transform_;
+}
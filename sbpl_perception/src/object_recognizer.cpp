@@ -295,6 +295,9 @@ bool ObjectRecognizer::RunPlanner(vector<ContPose> *detected_poses) const {
     }
   }
 
+  // Keep this episode's renders for the next one.
+  env_obj_->SaveTemplateBank();
+
   broadcast(*mpi_world_, plan_success, kMasterRank);
   broadcast(*mpi_world_, *detected_poses, kMasterRank);
   mpi_world_->barrier();
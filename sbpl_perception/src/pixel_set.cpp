@@ -0,0 +1,132 @@
+/**
+ * @file pixel_set.cpp
+ * @brief Bitmap set of pixel and observed point indices
+ * @author Venkatraman Narayanan
+ * Carnegie Mellon University, 2015
+ */
+
+#include <sbpl_perception/pixel_set.h>
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace sbpl_perception {
+namespace {
+
+// words[ii] |= other[ii] for the first num_words words.
+void OrWords(uint64_t *words, const uint64_t *other, size_t num_words) {
+  size_t ii = 0;
+#if defined(__AVX2__)
+
+  for (; ii + 4 <= num_words; ii += 4) {
+    __m256i *destination = reinterpret_cast<__m256i *>(words + ii);
+    const __m256i source = _mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                              (other + ii));
+    _mm256_storeu_si256(destination, _mm256_or_si256(_mm256_loadu_si256(
+                                                       destination), source));
+  }
+
+#elif defined(__SSE2__)
+
+  for (; ii + 2 <= num_words; ii += 2) {
+    __m128i *destination = reinterpret_cast<__m128i *>(words + ii);
+    const __m128i source = _mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                           (other + ii));
+    _mm_storeu_si128(destination, _mm_or_si128(_mm_loadu_si128(destination),
+                                               source));
+  }
+
+#endif
+
+  for (; ii < num_words; ++ii) {
+    words[ii] |= other[ii];
+  }
+}
+
+// words[ii] &= ~other[ii] for the first num_words words.
+void AndNotWords(uint64_t *words, const uint64_t *other, size_t num_words) {
+  size_t ii = 0;
+#if defined(__AVX2__)
+
+  for (; ii + 4 <= num_words; ii += 4) {
+    __m256i *destination = reinterpret_cast<__m256i *>(words + ii);
+    const __m256i source = _mm256_loadu_si256(reinterpret_cast<const __m256i *>
+                                              (other + ii));
+    _mm256_storeu_si256(destination, _mm256_andnot_si256(source,
+                                                         _mm256_loadu_si256(destination)));
+  }
+
+#elif defined(__SSE2__)
+
+  for (; ii + 2 <= num_words; ii += 2) {
+    __m128i *destination = reinterpret_cast<__m128i *>(words + ii);
+    const __m128i source = _mm_loadu_si128(reinterpret_cast<const __m128i *>
+                                           (other + ii));
+    _mm_storeu_si128(destination, _mm_andnot_si128(source,
+                                                   _mm_loadu_si128(destination)));
+  }
+
+#endif
+
+  for (; ii < num_words; ++ii) {
+    words[ii] &= ~other[ii];
+  }
+}
+}  // namespace
+
+int PixelSet::Size() const {
+  // Four independent counts, so that popcnt instructions can overlap.
+  int counts[4] = {0, 0, 0, 0};
+  size_t ii = 0;
+
+  for (; ii + 4 <= words_.size(); ii += 4) {
+    counts[0] += __builtin_popcountll(words_[ii]);
+    counts[1] += __builtin_popcountll(words_[ii + 1]);
+    counts[2] += __builtin_popcountll(words_[ii + 2]);
+    counts[3] += __builtin_popcountll(words_[ii + 3]);
+  }
+
+  for (; ii < words_.size(); ++ii) {
+    counts[0] += __builtin_popcountll(words_[ii]);
+  }
+
+  return counts[0] + counts[1] + counts[2] + counts[3];
+}
+
+bool PixelSet::Empty() const {
+  return std::all_of(words_.begin(), words_.end(), [](uint64_t word) {
+    return word == 0;
+  });
+}
+
+void PixelSet::Union(const PixelSet &other) {
+  if (other.words_.size() > words_.size()) {
+    words_.resize(other.words_.size(), 0);
+  }
+
+  OrWords(words_.data(), other.words_.data(), other.words_.size());
+}
+
+void PixelSet::Difference(const PixelSet &other) {
+  AndNotWords(words_.data(), other.words_.data(), std::min(words_.size(),
+                                                           other.words_.size()));
+}
+
+bool PixelSet::operator==(const PixelSet &other) const {
+  // Equal up to trailing empty words.
+  const std::vector<uint64_t> &shorter = words_.size() < other.words_.size() ?
+                                         words_ : other.words_;
+  const std::vector<uint64_t> &longer = words_.size() < other.words_.size() ?
+                                        other.words_ : words_;
+  return std::equal(shorter.begin(), shorter.end(), longer.begin()) &&
+         std::all_of(longer.begin() + shorter.size(), longer.end(),
+  [](uint64_t word) {
+    return word == 0;
+  });
+}
+}  // namespace
@@ -8,6 +8,7 @@
 #include <sbpl_perception/search_env.h>
 
 #include <perception_utils/perception_utils.h>
+#include <sbpl_perception/depth_image_kernels.h>
 #include <sbpl_perception/discretization_manager.h>
 
 #include <ros/ros.h>
@@ -33,6 +34,7 @@
 #include <boost/lexical_cast.hpp>
 #include <omp.h>
 #include <algorithm>
+#include <cmath>
 
 using namespace std;
 using namespace perception_utils;
@@ -44,26 +46,23 @@ namespace {
 // indicator(pixel explained) * range_in_meters(pixel). Otherwise, cost is
 // indicator(pixel explained).
 constexpr bool kUseDepthSensitiveCost = false;
+
+// Level-of-detail chain of every model: at most this many levels, none with
+// fewer than kMinLODTriangles triangles. A level is used for an object if it
+// has at least one triangle per kLODPixelsPerTriangle projected pixels.
+constexpr int kMaxLODLevels = 5;
+constexpr int kMinLODTriangles = 200;
+constexpr double kLODPixelsPerTriangle = 2.0;
 }  // namespace
 
 namespace sbpl_perception {
 
 EnvObjectRecognition::EnvObjectRecognition(const
                                            std::shared_ptr<boost::mpi::communicator> &comm) :
-  mpi_comm_(comm),
+  mpi_comm_(comm), reference_source_id_(-1), has_reference_depth_image_(false),
   image_debug_(false), debug_dir_(ros::package::getPath("sbpl_perception") +
                                   "/visualization/"), env_stats_ {0, 0} {
 
-  // OpenGL requires argc and argv
-  char **argv;
-  argv = new char *[2];
-  argv[0] = new char[1];
-  argv[1] = new char[1];
-  argv[0] = "0";
-  argv[1] = "1";
-  kinect_simulator_ = SimExample::Ptr(new SimExample(0, argv,
-  kDepthImageHeight, kDepthImageWidth));
-  scene_ = kinect_simulator_->scene_;
   observed_cloud_.reset(new PointCloud);
   projected_cloud_.reset(new PointCloud);
   observed_organized_cloud_.reset(new PointCloud);
@@ -96,6 +95,21 @@ EnvObjectRecognition::EnvObjectRecognition(const
     private_nh.param("use_adaptive_resolution",
                      perch_params_.use_adaptive_resolution, false);
     private_nh.param("use_rcnn_heuristic", perch_params_.use_rcnn_heuristic, true);
+    private_nh.param("use_headless_rendering",
+                     perch_params_.use_headless_rendering, false);
+    private_nh.param("use_software_rendering",
+                     perch_params_.use_software_rendering, false);
+    private_nh.param("use_occlusion_query",
+                     perch_params_.use_occlusion_query, false);
+    private_nh.param("use_gpu_scoring",
+                     perch_params_.use_gpu_scoring, false);
+    private_nh.param("use_lod", perch_params_.use_lod, false);
+    private_nh.param("use_projective_association",
+                     perch_params_.use_projective_association, false);
+    private_nh.param("projective_association_exact",
+                     perch_params_.projective_association_exact, true);
+    private_nh.param("template_bank_dir", perch_params_.template_bank_dir,
+                     string(""));
 
     private_nh.param("visualize_expanded_states",
                      perch_params_.vis_expanded_states, false);
@@ -110,6 +124,15 @@ EnvObjectRecognition::EnvObjectRecognition(const
            perch_params_.min_neighbor_points_for_valid_pose);
     printf("Max ICP Iterations: %d\n", perch_params_.max_icp_iterations);
     printf("RCNN Heuristic: %d\n", perch_params_.use_rcnn_heuristic);
+    printf("Headless Rendering: %d\n", perch_params_.use_headless_rendering);
+    printf("Software Rendering: %d\n", perch_params_.use_software_rendering);
+    printf("Occlusion Query: %d\n", perch_params_.use_occlusion_query);
+    printf("GPU Scoring: %d\n", perch_params_.use_gpu_scoring);
+    printf("LOD: %d\n", perch_params_.use_lod);
+    printf("Projective Association: %d (exact: %d)\n",
+           perch_params_.use_projective_association,
+           perch_params_.projective_association_exact);
+    printf("Template Bank Dir: %s\n", perch_params_.template_bank_dir.c_str());
     printf("Vis Expansions: %d\n", perch_params_.vis_expanded_states);
     printf("Print Expansions: %d\n", perch_params_.print_expanded_states);
     printf("Debug Verbose: %d\n", perch_params_.debug_verbose);
@@ -118,6 +141,25 @@ EnvObjectRecognition::EnvObjectRecognition(const
   mpi_comm_->barrier();
   broadcast(*mpi_comm_, perch_params_, kMasterRank);
   assert(perch_params_.initialized);
+
+  // The rendering context is created only once every rank knows whether it
+  // should be headless.
+  SimExample::ContextType context_type = SimExample::CONTEXT_GLUT;
+  if (perch_params_.use_software_rendering) {
+    context_type = SimExample::CONTEXT_SOFTWARE;
+  } else if (perch_params_.use_headless_rendering) {
+    context_type = SimExample::CONTEXT_EGL;
+  }
+  // OpenGL requires argc and argv
+  char **argv;
+  argv = new char *[2];
+  argv[0] = new char[1];
+  argv[1] = new char[1];
+  argv[0] = "0";
+  argv[1] = "1";
+  kinect_simulator_ = SimExample::Ptr(new SimExample(0, argv,
+  kDepthImageHeight, kDepthImageWidth, context_type));
+  scene_ = kinect_simulator_->scene_;
 }
 
 EnvObjectRecognition::~EnvObjectRecognition() {
@@ -133,6 +175,8 @@ void EnvObjectRecognition::LoadObjFiles(const vector<ModelMetaData>
   env_params_.num_models = static_cast<int>(model_names.size());
 
   obj_models_.clear();
+  obj_render_models_.clear();
+  obj_model_hashes_.clear();
 
   for (int ii = 0; ii < env_params_.num_models; ++ii) {
     // TODO: this should be made efficient using a hash map when the number of models in the
@@ -154,8 +198,32 @@ void EnvObjectRecognition::LoadObjFiles(const vector<ModelMetaData>
     ObjectModel obj_model(mesh, model_bank_it->file.c_str(),
                           model_bank_it->symmetric,
                           model_bank_it->flipped);
+
+    if (perch_params_.use_lod) {
+      obj_model.BuildLODChain(kMaxLODLevels, kMinLODTriangles);
+    }
+
     obj_models_.push_back(obj_model);
 
+    // Templates stay valid as long as the preprocessed geometry does.
+    const auto &model_cloud_data = obj_model.mesh().cloud.data;
+    const int num_triangles = obj_model.NumTriangles(0);
+    uint64_t model_hash = HashBytes(model_cloud_data.data(),
+                                    model_cloud_data.size());
+    model_hash = HashBytes(&num_triangles, sizeof(num_triangles), model_hash);
+    obj_model_hashes_.push_back(model_hash);
+
+    // Upload the preprocessed meshes once; renders only supply a model matrix.
+    vector<Model::Ptr> render_models;
+
+    for (int level = 0; level < obj_model.NumLODLevels(); ++level) {
+      pcl::PolygonMesh::Ptr render_mesh(new pcl::PolygonMesh(obj_model.lod_mesh(
+                                                               level)));
+      render_models.push_back(Model::Ptr(new TriangleMeshModel(render_mesh)));
+    }
+
+    obj_render_models_.push_back(render_models);
+
     if (IsMaster(mpi_comm_)) {
       printf("Read %s with %d polygons and %d triangles\n", model_name.c_str(),
              static_cast<int>(mesh.polygons.size()),
@@ -165,6 +233,11 @@ void EnvObjectRecognition::LoadObjFiles(const vector<ModelMetaData>
              obj_model.max_x(), obj_model.min_y(), obj_model.max_y(), obj_model.min_z(),
              obj_model.max_z(), obj_model.GetCircumscribedRadius(),
              obj_model.GetInscribedRadius());
+
+      for (int level = 1; level < obj_model.NumLODLevels(); ++level) {
+        printf("LOD %d: %d triangles\n", level, obj_model.NumTriangles(level));
+      }
+
       printf("\n");
     }
   }
@@ -323,6 +396,8 @@ void EnvObjectRecognition::GetSuccs(int source_state_id,
 
   vector<unsigned short> source_depth_image;
   GetDepthImage(source_state, &source_depth_image);
+  DepthImageROI source_depth_image_roi;
+  CropDepthImage(source_depth_image, &source_depth_image_roi);
 
   candidate_costs.resize(candidate_succ_ids.size());
 
@@ -335,8 +410,9 @@ void EnvObjectRecognition::GetSuccs(int source_state_id,
     input_unit.child_state = candidate_succs[ii];
     input_unit.source_id = source_state_id;
     input_unit.child_id = candidate_succ_ids[ii];
-    input_unit.source_depth_image = source_depth_image;
+    input_unit.source_depth_image = source_depth_image_roi;
     input_unit.source_counted_pixels = counted_pixels_map_[source_state_id];
+    SetCachedLastObject(&input_unit);
   }
 
   vector<CostComputationOutput> cost_computation_output;
@@ -381,7 +457,6 @@ void EnvObjectRecognition::GetSuccs(int source_state_id,
       candidate_costs[ii] = -1;
     } else {
       adjusted_states_[candidate_succ_ids[ii]] = output_unit.adjusted_state;
-      assert(output_unit.depth_image.size() != 0);
       candidate_costs[ii] = output_unit.cost;
       minz_map_[candidate_succ_ids[ii]] =
         output_unit.state_properties.last_min_depth;
@@ -394,24 +469,9 @@ void EnvObjectRecognition::GetSuccs(int source_state_id,
       last_object_rendering_cost_[candidate_succ_ids[ii]] =
         output_unit.state_properties.target_cost +
         output_unit.state_properties.source_cost;
-
-      // Cache the depth image only for single object renderings, *only* if valid.
-      // NOTE: The hash key is computed on the *unadjusted* child state.
-      if (source_state.NumObjects() == 0) {
-        // depth_image_cache_[candidate_succ_ids[ii]] = output_unit.depth_image;
-        adjusted_single_object_depth_image_cache_[cost_computation_input[ii].child_state]
-          =
-            output_unit.depth_image;
-        unadjusted_single_object_depth_image_cache_[cost_computation_input[ii].child_state]
-          =
-            output_unit.unadjusted_depth_image;
-        adjusted_single_object_state_cache_[cost_computation_input[ii].child_state] =
-          output_unit.adjusted_state;
-        assert(output_unit.adjusted_state.object_states().size() > 0);
-        assert(adjusted_single_object_state_cache_[cost_computation_input[ii].child_state].object_states().size()
-               > 0);
-      }
     }
+
+    CacheLastObject(input_unit, output_unit, !invalid_state);
   }
 
   //--------------------------------------//
@@ -436,7 +496,9 @@ void EnvObjectRecognition::GetSuccs(int source_state_id,
       std::stringstream ss;
       ss.precision(20);
       ss << debug_dir_ + "succ_" << candidate_succ_ids[ii] << ".png";
-      PrintImage(ss.str(), output_unit.depth_image);
+      vector<unsigned short> depth_image;
+      ExpandDepthImage(output_unit.depth_image, &depth_image);
+      PrintImage(ss.str(), depth_image);
       printf("State %d,       %d      %d      %d      %d      %d\n",
              candidate_succ_ids[ii],
              output_unit.state_properties.target_cost,
@@ -519,11 +581,58 @@ void EnvObjectRecognition::ComputeCostsInParallel(const
 
   int recvcount = count / num_processors;
 
+  // The master may have adjusted the state of an id since the last batch, so
+  // the reference image is keyed on source ids only within a batch.
+  ResetReferenceDepthImage();
+
   std::vector<CostComputationInput> input_partition(recvcount);
   std::vector<CostComputationOutput> output_partition(recvcount);
   boost::mpi::scatter(*mpi_comm_, appended_input, &input_partition[0], recvcount,
                       kMasterRank);
 
+  // Render the newly added object of every child in this partition in a
+  // single batch, rather than one at a time inside GetCost.
+  vector<int> last_object_image_idx(recvcount, -1);
+  vector<DepthImageROI> last_object_depth_images;
+
+  // Full size source image of the inputs, expanded only when the source
+  // changes since all inputs of an expansion share it.
+  vector<unsigned short> source_depth_image;
+  int source_depth_image_id = -1;
+
+  if (!lazy) {
+    vector<GraphState> last_object_states;
+
+    for (int ii = 0; ii < recvcount; ++ii) {
+      const auto &input_unit = input_partition[ii];
+
+      // Cached renders need neither rendering nor an occlusion query.
+      if (input_unit.source_id == -1 || input_unit.last_object_cached) {
+        continue;
+      }
+
+      const auto &last_object = input_unit.child_state.object_states().back();
+      GraphState s_new_obj;
+      s_new_obj.AppendObject(ObjectState(last_object.id(),
+                                         obj_models_[last_object.id()].symmetric(),
+                                         last_object.cont_pose()));
+
+      if (perch_params_.use_occlusion_query) {
+        SetReferenceDepthImage(input_unit.source_depth_image, input_unit.source_id);
+
+        // Left at -1 and skipped below: GetCost would reject it anyway.
+        if (IsLastObjectOccluding(s_new_obj)) {
+          continue;
+        }
+      }
+
+      last_object_image_idx[ii] = static_cast<int>(last_object_states.size());
+      last_object_states.push_back(s_new_obj);
+    }
+
+    GetSingleObjectDepthImagesROI(last_object_states, &last_object_depth_images);
+  }
+
   for (int ii = 0; ii < recvcount; ++ii) {
     const auto &input_unit = input_partition[ii];
     auto &output_unit = output_partition[ii];
@@ -534,21 +643,54 @@ void EnvObjectRecognition::ComputeCostsInParallel(const
       continue;
     }
 
+    // Rejected by the occlusion query.
+    if (!lazy && !input_unit.last_object_cached &&
+        last_object_image_idx[ii] == -1) {
+      output_unit.cost = -1;
+      continue;
+    }
+
+    if (input_unit.source_id != source_depth_image_id) {
+      ExpandDepthImage(input_unit.source_depth_image, &source_depth_image);
+      source_depth_image_id = input_unit.source_id;
+    }
+
+    if (!lazy && perch_params_.use_gpu_scoring) {
+      SetReferenceDepthImage(input_unit.source_depth_image, input_unit.source_id);
+    }
+
+    vector<unsigned short> depth_image, unadjusted_depth_image;
+
     if (!lazy) {
+      const DepthImageROI *last_object_depth_image = &input_unit.last_object_roi;
+
+      if (!input_unit.last_object_cached) {
+        last_object_depth_image = &last_object_depth_images[last_object_image_idx[ii]];
+        output_unit.last_object_rendered = true;
+        output_unit.last_object_roi = *last_object_depth_image;
+      }
+
+      const bool icp_cached = input_unit.last_object_cached &&
+                              input_unit.adjusted_last_object_state.NumObjects() > 0;
       output_unit.cost = GetCost(input_unit.source_state, input_unit.child_state,
-                                 input_unit.source_depth_image,
+                                 source_depth_image,
                                  input_unit.source_counted_pixels,
                                  &output_unit.child_counted_pixels, &output_unit.adjusted_state,
-                                 &output_unit.state_properties, &output_unit.depth_image,
-                                 &output_unit.unadjusted_depth_image);
+                                 &output_unit.state_properties, &depth_image,
+                                 &unadjusted_depth_image,
+                                 last_object_depth_image,
+                                 icp_cached ? &input_unit.adjusted_last_object_state.object_states().back() :
+                                 nullptr,
+                                 icp_cached ? &input_unit.adjusted_last_object_roi : nullptr);
     } else {
-      if (input_unit.unadjusted_last_object_depth_image.empty()) {
+      if (input_unit.adjusted_last_object_state.NumObjects() == 0) {
         output_unit.cost = -1;
       } else {
         output_unit.cost = GetLazyCost(input_unit.source_state, input_unit.child_state,
+                                       source_depth_image,
                                        input_unit.source_depth_image,
-                                       input_unit.unadjusted_last_object_depth_image,
-                                       input_unit.adjusted_last_object_depth_image,
+                                       input_unit.last_object_roi,
+                                       input_unit.adjusted_last_object_roi,
                                        input_unit.adjusted_last_object_state,
                                        input_unit.source_counted_pixels,
                                        &output_unit.adjusted_state,
@@ -556,6 +698,14 @@ void EnvObjectRecognition::ComputeCostsInParallel(const
                                        &output_unit.depth_image);
       }
     }
+
+    if (!lazy && output_unit.cost != -1) {
+      CropDepthImage(depth_image, &output_unit.depth_image);
+    }
+
+    if (!unadjusted_depth_image.empty()) {
+      CropDepthImage(unadjusted_depth_image, &output_unit.unadjusted_depth_image);
+    }
   }
 
   boost::mpi::gather(*mpi_comm_, &output_partition[0], recvcount, *output,
@@ -641,6 +791,8 @@ void EnvObjectRecognition::GetLazySuccs(int source_state_id,
 
   vector<unsigned short> source_depth_image;
   GetDepthImage(source_state, &source_depth_image);
+  DepthImageROI source_depth_image_roi;
+  CropDepthImage(source_depth_image, &source_depth_image_roi);
 
   // Prepare the cost computation input vector.
   vector<CostComputationInput> cost_computation_input(candidate_succ_ids.size());
@@ -651,7 +803,7 @@ void EnvObjectRecognition::GetLazySuccs(int source_state_id,
     input_unit.child_state = candidate_succs[ii];
     input_unit.source_id = source_state_id;
     input_unit.child_id = candidate_succ_ids[ii];
-    input_unit.source_depth_image = source_depth_image;
+    input_unit.source_depth_image = source_depth_image_roi;
     input_unit.source_counted_pixels = counted_pixels_map_[source_state_id];
 
     const ObjectState &last_object_state =
@@ -659,19 +811,18 @@ void EnvObjectRecognition::GetLazySuccs(int source_state_id,
     GraphState single_object_graph_state;
     single_object_graph_state.AppendObject(last_object_state);
 
+    // Only objects that were valid at the first level have an adjusted render.
     const bool valid_state = GetSingleObjectDepthImage(single_object_graph_state,
-                                                       &input_unit.unadjusted_last_object_depth_image, false);
+                                                       &input_unit.adjusted_last_object_roi, true);
 
     if (!valid_state) {
       continue;
     }
 
     GetSingleObjectDepthImage(single_object_graph_state,
-                              &input_unit.adjusted_last_object_depth_image, true);
-    assert(adjusted_single_object_state_cache_.find(single_object_graph_state) !=
-           adjusted_single_object_state_cache_.end());
+                              &input_unit.last_object_roi, false);
     input_unit.adjusted_last_object_state =
-      adjusted_single_object_state_cache_[single_object_graph_state];
+      single_object_cache_[single_object_graph_state].adjusted_state;
   }
 
   vector<CostComputationOutput> cost_computation_output;
@@ -707,7 +858,9 @@ void EnvObjectRecognition::GetLazySuccs(int source_state_id,
       std::stringstream ss;
       ss.precision(20);
       ss << debug_dir_ + "succ_" << candidate_succ_ids[ii] << "_lazy.png";
-      PrintImage(ss.str(), output_unit.depth_image);
+      vector<unsigned short> depth_image;
+      ExpandDepthImage(output_unit.depth_image, &depth_image);
+      PrintImage(ss.str(), depth_image);
       // printf("State %d,       %d\n", candidate_succ_ids[ii],
       //        output_unit.cost);
       // printf("State %d,       %d      %d      %d      %d\n", candidate_succ_ids[ii],
@@ -770,15 +923,35 @@ int EnvObjectRecognition::GetTrueCost(int source_state_id,
   GraphState child_state = hash_manager_.GetState(child_state_id);
   vector<unsigned short> source_depth_image;
   GetDepthImage(source_state, &source_depth_image);
-  vector<int> source_counted_pixels = counted_pixels_map_[source_state_id];
+  PixelSet source_counted_pixels = counted_pixels_map_[source_state_id];
+
+  CostComputationInput input_unit;
+  input_unit.child_state = child_state;
+  SetCachedLastObject(&input_unit);
+  const bool icp_cached = input_unit.last_object_cached &&
+                          input_unit.adjusted_last_object_state.NumObjects() > 0;
+
+  if (perch_params_.use_gpu_scoring) {
+    // The state of source_state_id may have been adjusted since it was last
+    // the reference, so the images are compared.
+    DepthImageROI source_depth_image_roi;
+    CropDepthImage(source_depth_image, &source_depth_image_roi);
+    ResetReferenceDepthImage();
+    SetReferenceDepthImage(source_depth_image_roi, source_state_id);
+  }
 
   CostComputationOutput output_unit;
+  vector<unsigned short> depth_image, unadjusted_depth_image;
   output_unit.cost = GetCost(source_state, child_state,
                              source_depth_image,
                              source_counted_pixels,
                              &output_unit.child_counted_pixels, &output_unit.adjusted_state,
-                             &output_unit.state_properties, &output_unit.depth_image,
-                             &output_unit.unadjusted_depth_image);
+                             &output_unit.state_properties, &depth_image,
+                             &unadjusted_depth_image,
+                             input_unit.last_object_cached ? &input_unit.last_object_roi : nullptr,
+                             icp_cached ? &input_unit.adjusted_last_object_state.object_states().back() :
+                             nullptr,
+                             icp_cached ? &input_unit.adjusted_last_object_roi : nullptr);
 
   bool invalid_state = output_unit.cost == -1;
 
@@ -788,7 +961,7 @@ int EnvObjectRecognition::GetTrueCost(int source_state_id,
 
   adjusted_states_[child_state_id] = output_unit.adjusted_state;
 
-  assert(output_unit.depth_image.size() != 0);
+  assert(depth_image.size() != 0);
   minz_map_[child_state_id] =
     output_unit.state_properties.last_min_depth;
   maxz_map_[child_state_id] =
@@ -799,7 +972,7 @@ int EnvObjectRecognition::GetTrueCost(int source_state_id,
 
   // Cache the depth image only for single object renderings.
   if (source_state.NumObjects() == 0) {
-    depth_image_cache_[child_state_id] = output_unit.depth_image;
+    CropDepthImage(depth_image, &depth_image_cache_[child_state_id]);
   }
 
   //--------------------------------------//
@@ -807,7 +980,7 @@ int EnvObjectRecognition::GetTrueCost(int source_state_id,
     std::stringstream ss;
     ss.precision(20);
     ss << debug_dir_ + "succ_" << child_state_id << ".png";
-    PrintImage(ss.str(), output_unit.depth_image);
+    PrintImage(ss.str(), depth_image);
     printf("State %d,       %d      %d      %d      %d\n", child_state_id,
            output_unit.state_properties.target_cost,
            output_unit.state_properties.source_cost,
@@ -893,15 +1066,16 @@ int EnvObjectRecognition::GetGoalHeuristic(int q_id, int state_id) {
 int EnvObjectRecognition::GetLazyCost(const GraphState &source_state,
                                       const GraphState &child_state,
                                       const std::vector<unsigned short> &source_depth_image,
-                                      const std::vector<unsigned short> &unadjusted_last_object_depth_image,
-                                      const std::vector<unsigned short> &adjusted_last_object_depth_image,
+                                      const DepthImageROI &source_depth_image_roi,
+                                      const DepthImageROI &unadjusted_last_object_depth_image,
+                                      const DepthImageROI &adjusted_last_object_depth_image,
                                       const GraphState &adjusted_last_object_state,
-                                      const std::vector<int> &parent_counted_pixels,
+                                      const PixelSet &parent_counted_pixels,
                                       GraphState *adjusted_child_state,
                                       GraphStateProperties *child_properties,
-                                      vector<unsigned short> *final_depth_image) {
+                                      DepthImageROI *final_depth_image) {
   assert(child_state.NumObjects() > 0);
-  final_depth_image->clear();
+  *final_depth_image = DepthImageROI();
   *adjusted_child_state = child_state;
 
   child_properties->last_max_depth = kKinectMaxDepth;
@@ -920,29 +1094,28 @@ int EnvObjectRecognition::GetLazyCost(const GraphState &source_state,
   unsigned short succ_min_depth, succ_max_depth;
   vector<int> new_pixel_indices;
 
-  vector<unsigned short> child_depth_image;
-  GetComposedDepthImage(source_depth_image, unadjusted_last_object_depth_image,
-                        &child_depth_image);
+  // The unoccluded pixels of the last object are all we need of the child,
+  // in full for the costs and cropped for composing the child image.
+  vector<unsigned short> new_obj_depth_image;
+  DepthImageROI new_obj_depth_image_roi;
 
-  if (IsOccluded(source_depth_image, child_depth_image, &new_pixel_indices,
-                 &succ_min_depth,
-                 &succ_max_depth)) {
+  if (ComposeObjectDepthImage(source_depth_image,
+                              unadjusted_last_object_depth_image, nullptr, &new_pixel_indices,
+                              &succ_min_depth, &succ_max_depth, &new_obj_depth_image)) {
     return -1;
   }
 
-  vector<unsigned short> new_obj_depth_image(kDepthImageWidth *
-                                             kDepthImageHeight, kKinectMaxDepth);
-
   // Do ICP alignment on object *only* if it has been occluded by an existing
   // object in the scene. Otherwise, we could simply use the cached depth image corresponding to the unoccluded ICP adjustement.
 
-  if (static_cast<int>(new_pixel_indices.size()) != GetNumValidPixels(
-        unadjusted_last_object_depth_image)) {
+  const int num_last_object_pixels = static_cast<int>(std::count_if(
+                                                        unadjusted_last_object_depth_image.depth.begin(),
+                                                        unadjusted_last_object_depth_image.depth.end(),
+  [](unsigned short depth) {
+    return depth != kKinectMaxDepth;
+  }));
 
-    for (size_t ii = 0; ii < new_pixel_indices.size(); ++ii) {
-      new_obj_depth_image[new_pixel_indices[ii]] =
-        child_depth_image[new_pixel_indices[ii]];
-    }
+  if (static_cast<int>(new_pixel_indices.size()) != num_last_object_pixels) {
 
     // Create point cloud (cloud_in) corresponding to new pixels.
     cloud_in = GetGravityAlignedPointCloud(new_obj_depth_image);
@@ -988,9 +1161,11 @@ int EnvObjectRecognition::GetLazyCost(const GraphState &source_state,
 
     new_obj_depth_image = ApplyOcclusionMask(new_obj_depth_image,
                                              source_depth_image);
+    CropDepthImage(new_obj_depth_image, &new_obj_depth_image_roi);
 
   } else {
-    new_obj_depth_image = adjusted_last_object_depth_image;
+    new_obj_depth_image_roi = adjusted_last_object_depth_image;
+    ExpandDepthImage(new_obj_depth_image_roi, &new_obj_depth_image);
     int last_idx = child_state.NumObjects() - 1;
     assert(last_idx >= 0);
     assert(adjusted_last_object_state.object_states().size() > 0);
@@ -1007,7 +1182,7 @@ int EnvObjectRecognition::GetLazyCost(const GraphState &source_state,
     vector<int> new_pixel_indices_unused;
     unsigned short succ_min_depth_unused, succ_max_depth_unused;
 
-    if (IsOccluded(source_depth_image, new_obj_depth_image,
+    if (IsOccluded(source_depth_image, new_obj_depth_image_roi,
                    &new_pixel_indices_unused,
                    &succ_min_depth,
                    &succ_max_depth)) {
@@ -1030,8 +1205,8 @@ int EnvObjectRecognition::GetLazyCost(const GraphState &source_state,
   int target_cost = 0, source_cost = 0, last_level_cost = 0, total_cost = 0;
   target_cost = GetTargetCost(cloud_out);
 
-  vector<int> child_counted_pixels;
-  source_cost = GetSourceCost(cloud_out,
+  PixelSet child_counted_pixels;
+  source_cost = GetSourceCost(new_obj_depth_image,
                               adjusted_child_state->object_states().back(),
                               last_level, parent_counted_pixels, &child_counted_pixels);
 
@@ -1060,19 +1235,21 @@ int EnvObjectRecognition::GetLazyCost(const GraphState &source_state,
   //   writer.writeBinary (ss3.str()  , *succ_cloud);
   // }
 
-  GetComposedDepthImage(source_depth_image,
-                        new_obj_depth_image,
-                        final_depth_image);
+  ComposeDepthImages(source_depth_image_roi, new_obj_depth_image_roi,
+                     final_depth_image);
   return total_cost;
 }
 
 int EnvObjectRecognition::GetCost(const GraphState &source_state,
                                   const GraphState &child_state,
                                   const vector<unsigned short> &source_depth_image,
-                                  const vector<int> &parent_counted_pixels, vector<int> *child_counted_pixels,
+                                  const PixelSet &parent_counted_pixels, PixelSet *child_counted_pixels,
                                   GraphState *adjusted_child_state, GraphStateProperties *child_properties,
                                   vector<unsigned short> *final_depth_image,
-                                  vector<unsigned short> *unadjusted_depth_image) {
+                                  vector<unsigned short> *unadjusted_depth_image,
+                                  const DepthImageROI *last_object_depth_image,
+                                  const ObjectState *adjusted_last_object,
+                                  const DepthImageROI *adjusted_last_object_depth_image) {
 
   assert(child_state.NumObjects() > 0);
 
@@ -1084,8 +1261,8 @@ int EnvObjectRecognition::GetCost(const GraphState &source_state,
   ContPose child_pose = last_object.cont_pose();
   int last_object_id = last_object.id();
 
-  vector<unsigned short> depth_image, last_obj_depth_image;
-  const float *succ_depth_buffer;
+  vector<unsigned short> depth_image;
+  DepthImageROI last_obj_depth_image;
   ContPose pose_in(child_pose.x(), child_pose.y(), child_pose.yaw()),
            pose_out(child_pose.x(), child_pose.y(), child_pose.yaw());
   PointCloudPtr cloud_in(new PointCloud);
@@ -1093,45 +1270,50 @@ int EnvObjectRecognition::GetCost(const GraphState &source_state,
   PointCloudPtr cloud_out(new PointCloud);
 
   // Begin ICP Adjustment
-  GraphState s_new_obj;
-  s_new_obj.AppendObject(ObjectState(last_object_id,
-                                     obj_models_[last_object_id].symmetric(), child_pose));
-  succ_depth_buffer = GetDepthImage(s_new_obj, &last_obj_depth_image);
-
-  unadjusted_depth_image->clear();
-  GetComposedDepthImage(source_depth_image, last_obj_depth_image,
-                        unadjusted_depth_image);
+  if (last_object_depth_image != nullptr) {
+    last_obj_depth_image = *last_object_depth_image;
+  } else {
+    GraphState s_new_obj;
+    s_new_obj.AppendObject(ObjectState(last_object_id,
+                                       obj_models_[last_object_id].symmetric(), child_pose));
+    GetDepthImageROI(s_new_obj, &last_obj_depth_image);
+  }
 
   unsigned short succ_min_depth_unused, succ_max_depth_unused;
   vector<int> new_pixel_indices;
 
-  if (IsOccluded(source_depth_image, *unadjusted_depth_image, &new_pixel_indices,
-                 &succ_min_depth_unused,
-                 &succ_max_depth_unused)) {
+  if (ComposeObjectDepthImage(source_depth_image, last_obj_depth_image,
+                              unadjusted_depth_image, &new_pixel_indices, &succ_min_depth_unused,
+                              &succ_max_depth_unused)) {
     // final_depth_image->clear();
     // *final_depth_image = *unadjusted_depth_image;
     return -1;
   }
 
-  vector<unsigned short> new_obj_depth_image(kDepthImageWidth *
-                                             kDepthImageHeight, kKinectMaxDepth);
-
   // Do ICP alignment on object *only* if it has been occluded by an existing
-  // object in the scene. Otherwise, we could simply use the cached depth image corresponding to the unoccluded ICP adjustement.
-
-  for (size_t ii = 0; ii < new_pixel_indices.size(); ++ii) {
-    new_obj_depth_image[new_pixel_indices[ii]] =
-      unadjusted_depth_image->at(new_pixel_indices[ii]);
-  }
-
-  // Create point cloud (cloud_in) corresponding to new pixels.
-  cloud_in = GetGravityAlignedPointCloud(new_obj_depth_image);
+  // object in the scene. Otherwise, we simply use the cached result of the
+  // unoccluded ICP adjustment, as GetLazyCost does.
+  const int num_last_object_pixels = static_cast<int>(std::count_if(
+                                                        last_obj_depth_image.depth.begin(), last_obj_depth_image.depth.end(),
+  [](unsigned short depth) {
+    return depth != kKinectMaxDepth;
+  }));
+  const bool reuse_icp = adjusted_last_object != nullptr &&
+                         static_cast<int>(new_pixel_indices.size()) == num_last_object_pixels;
+
+  if (reuse_icp) {
+    pose_out = adjusted_last_object->cont_pose();
+  } else {
+    // Create point cloud (cloud_in) corresponding to new pixels.
+    cloud_in = GetGravityAlignedPointCloud(*unadjusted_depth_image,
+                                           new_pixel_indices);
 
-  // Align with ICP
-  // Only non-occluded points
+    // Align with ICP
+    // Only non-occluded points
 
-  GetICPAdjustedPose(cloud_in, pose_in, cloud_out, &pose_out,
-                     parent_counted_pixels);
+    GetICPAdjustedPose(cloud_in, pose_in, cloud_out, &pose_out,
+                       parent_counted_pixels);
+  }
   // icp_cost = static_cast<int>(kICPCostMultiplier * icp_fitness_score);
   int last_idx = child_state.NumObjects() - 1;
 
@@ -1145,37 +1327,46 @@ int EnvObjectRecognition::GetCost(const GraphState &source_state,
   if (!IsValidPose(source_state, last_object_id,
                    adjusted_child_state->object_states().back().cont_pose(), true)) {
     // printf(" state %d is invalid\n ", child_id);
-    // succ_depth_buffer = GetDepthImage(*adjusted_child_state, &depth_image);
+    // GetDepthImage(*adjusted_child_state, &depth_image);
     // final_depth_image->clear();
     // *final_depth_image = depth_image;
     return -1;
   }
 
-  succ_depth_buffer = GetDepthImage(*adjusted_child_state, &depth_image);
-  // All points
-  succ_cloud = GetGravityAlignedPointCloud(depth_image);
-
+  const bool rendered_scoring = perch_params_.use_gpu_scoring &&
+                                !kUseDepthSensitiveCost;
   unsigned short succ_min_depth, succ_max_depth;
   new_pixel_indices.clear();
-  new_obj_depth_image.clear();
-  new_obj_depth_image.resize(kNumPixels, kKinectMaxDepth);
 
-  if (IsOccluded(source_depth_image, depth_image, &new_pixel_indices,
-                 &succ_min_depth,
-                 &succ_max_depth)) {
+  // The child is the source with the adjusted last object on top, so its
+  // depth image is the source image composed with a render of that object
+  // alone, rendered here or taken from the cache.
+  GraphState s_adjusted_obj;
+  s_adjusted_obj.AppendObject(modified_last_object);
+  DepthImageROI adjusted_obj_depth_image;
+
+  if (rendered_scoring) {
+    // The scoring pass reads the render on the GPU, composed with the source
+    // there, so the object has to be the last thing rendered.
+    adjusted_obj_depth_image.width = kDepthImageWidth;
+    adjusted_obj_depth_image.height = kDepthImageHeight;
+    GetDepthImage(s_adjusted_obj, &adjusted_obj_depth_image.depth);
+  } else if (reuse_icp) {
+    adjusted_obj_depth_image = *adjusted_last_object_depth_image;
+  } else {
+    GetDepthImageROI(s_adjusted_obj, &adjusted_obj_depth_image);
+  }
+
+  const bool is_occluded = ComposeObjectDepthImage(source_depth_image,
+                                                   adjusted_obj_depth_image, &depth_image, &new_pixel_indices,
+                                                   &succ_min_depth, &succ_max_depth);
+
+  if (is_occluded) {
     // final_depth_image->clear();
     // *final_depth_image = depth_image;
     return -1;
   }
 
-  for (size_t ii = 0; ii < new_pixel_indices.size(); ++ii) {
-    new_obj_depth_image[new_pixel_indices[ii]] =
-      depth_image[new_pixel_indices[ii]];
-  }
-
-  // Create point cloud (cloud_out) corresponding to new pixels.
-  cloud_out = GetGravityAlignedPointCloud(new_obj_depth_image);
-
   // Cache the min and max depths
   child_properties->last_min_depth = succ_min_depth;
   child_properties->last_max_depth = succ_max_depth;
@@ -1184,21 +1375,32 @@ int EnvObjectRecognition::GetCost(const GraphState &source_state,
   const bool last_level = static_cast<int>(child_state.NumObjects()) ==
                           env_params_.num_objects;
   int target_cost = 0, source_cost = 0, last_level_cost = 0, total_cost = 0;
-  target_cost = GetTargetCost(cloud_out);
 
-  // source_cost = GetSourceCost(succ_cloud,
-  //                             adjusted_child_state->object_states().back(),
-  //                             last_level, parent_counted_pixels, child_counted_pixels);
-  source_cost = GetSourceCost(succ_cloud,
-                              adjusted_child_state->object_states().back(),
-                              false, parent_counted_pixels, child_counted_pixels);
-
-  if (last_level) {
-    vector<int> updated_counted_pixels;
-    last_level_cost = GetLastLevelCost(succ_cloud,
-                                       adjusted_child_state->object_states().back(), *child_counted_pixels,
-                                       &updated_counted_pixels);
-    *child_counted_pixels = updated_counted_pixels;
+  if (rendered_scoring) {
+    GetRenderedCosts(depth_image,
+                     adjusted_child_state->object_states().back(), last_level,
+                     parent_counted_pixels, child_counted_pixels, &target_cost,
+                     &source_cost, &last_level_cost);
+  } else {
+    // Create point cloud (cloud_out) corresponding to new pixels.
+    cloud_out = GetGravityAlignedPointCloud(depth_image, new_pixel_indices);
+
+    target_cost = GetTargetCost(cloud_out);
+
+    // source_cost = GetSourceCost(succ_cloud,
+    //                             adjusted_child_state->object_states().back(),
+    //                             last_level, parent_counted_pixels, child_counted_pixels);
+    source_cost = GetSourceCost(depth_image,
+                                adjusted_child_state->object_states().back(),
+                                false, parent_counted_pixels, child_counted_pixels);
+
+    if (last_level) {
+      PixelSet updated_counted_pixels;
+      last_level_cost = GetLastLevelCost(depth_image,
+                                         adjusted_child_state->object_states().back(), *child_counted_pixels,
+                                         &updated_counted_pixels);
+      *child_counted_pixels = updated_counted_pixels;
+    }
   }
 
   total_cost = source_cost + target_cost + last_level_cost;
@@ -1236,55 +1438,20 @@ bool EnvObjectRecognition::IsOccluded(const vector<unsigned short>
                                       &parent_depth_image, const vector<unsigned short> &succ_depth_image,
                                       vector<int> *new_pixel_indices, unsigned short *min_succ_depth,
                                       unsigned short *max_succ_depth) {
-
-  assert(static_cast<int>(parent_depth_image.size()) == kNumPixels);
   assert(static_cast<int>(succ_depth_image.size()) == kNumPixels);
+  return ComposeObjectDepthImage(parent_depth_image, succ_depth_image, nullptr,
+                                 new_pixel_indices, min_succ_depth, max_succ_depth);
+}
 
-  new_pixel_indices->clear();
-  *min_succ_depth = kKinectMaxDepth;
-  *max_succ_depth = 0;
-
-  bool is_occluded = false;
-
-  for (int jj = 0; jj < kNumPixels; ++jj) {
-
-    if (succ_depth_image[jj] != kKinectMaxDepth &&
-        parent_depth_image[jj] == kKinectMaxDepth) {
-      new_pixel_indices->push_back(jj);
-
-      // Find mininum depth of new pixels
-      if (succ_depth_image[jj] != kKinectMaxDepth &&
-          succ_depth_image[jj] < *min_succ_depth) {
-        *min_succ_depth = succ_depth_image[jj];
-      }
-
-      // Find maximum depth of new pixels
-      if (succ_depth_image[jj] != kKinectMaxDepth &&
-          succ_depth_image[jj] > *max_succ_depth) {
-        *max_succ_depth = succ_depth_image[jj];
-      }
-    }
-
-    // Occlusion
-    if (succ_depth_image[jj] != kKinectMaxDepth &&
-        parent_depth_image[jj] != kKinectMaxDepth &&
-        succ_depth_image[jj] < parent_depth_image[jj]) {
-      is_occluded = true;
-      break;
-    }
-
-    // if (succ_depth_image[jj] == kKinectMaxDepth && observed_depth_image_[jj] != kKinectMaxDepth) {
-    //   obs_pixels.push_back(jj);
-    // }
-  }
-
-  if (is_occluded) {
-    new_pixel_indices->clear();
-    *min_succ_depth = kKinectMaxDepth;
-    *max_succ_depth = 0;
-  }
-
-  return is_occluded;
+bool EnvObjectRecognition::IsOccluded(const vector<unsigned short>
+                                      &parent_depth_image, const DepthImageROI &last_object_depth_image,
+                                      vector<int> *new_pixel_indices, unsigned short *min_succ_depth,
+                                      unsigned short *max_succ_depth) {
+  // Inside the ROI the composed depth is min(parent, last object), so a new
+  // pixel is one where only the last object is seen, and the parent is
+  // occluded wherever the last object is strictly in front of it.
+  return ComposeObjectDepthImage(parent_depth_image, last_object_depth_image,
+                                 nullptr, new_pixel_indices, min_succ_depth, max_succ_depth);
 }
 
 int EnvObjectRecognition::GetTargetCost(const PointCloudPtr
@@ -1293,15 +1460,8 @@ int EnvObjectRecognition::GetTargetCost(const PointCloudPtr
   double nn_score = 0;
 
   for (size_t ii = 0; ii < partial_rendered_cloud->points.size(); ++ii) {
-    vector<int> indices;
-    vector<float> sqr_dists;
     PointT point = partial_rendered_cloud->points[ii];
-    int num_neighbors_found = knn->radiusSearch(point,
-                                                perch_params_.sensor_resolution,
-                                                indices,
-                                                sqr_dists, 1);
-    const bool point_unexplained = num_neighbors_found == 0;
-
+    const bool point_unexplained = !HasObservedNeighbor(point);
 
     double cost = 0;
 
@@ -1329,95 +1489,56 @@ int EnvObjectRecognition::GetTargetCost(const PointCloudPtr
   return target_cost;
 }
 
-int EnvObjectRecognition::GetSourceCost(const PointCloudPtr
-                                        full_rendered_cloud, const ObjectState &last_object, const bool last_level,
-                                        const std::vector<int> &parent_counted_pixels,
-                                        std::vector<int> *child_counted_pixels) {
+bool EnvObjectRecognition::HasObservedNeighbor(const PointT &point) const {
+  const Eigen::Vector3f world_point(point.x, point.y, point.z);
+  int index = 0;
+  float range = 0.0f;
+
+  // Points outside of the image can have neighbours anywhere, so they go to
+  // the voxel hash.
+  if (!perch_params_.use_projective_association ||
+      !camera_model_.Project(world_point, &index, &range)) {
+    return observed_index_.HasNeighbor(point);
+  }
+
+  return camera_model_.HasNeighborInDepthImage(observed_depth_image_.data(),
+                                               world_point, index, range, perch_params_.sensor_resolution,
+                                               perch_params_.projective_association_exact);
+}
+
+int EnvObjectRecognition::GetSourceCost(const vector<unsigned short>
+                                        &full_rendered_depth_image, const ObjectState &last_object,
+                                        const bool last_level,
+                                        const PixelSet &parent_counted_pixels,
+                                        PixelSet *child_counted_pixels) {
 
   //TODO: TESTING
   assert(!last_level);
 
   // Compute the cost of points made infeasible in the observed point cloud.
-  pcl::search::KdTree<PointT>::Ptr knn_reverse;
-  knn_reverse.reset(new pcl::search::KdTree<PointT>(true));
-  knn_reverse->setInputCloud(full_rendered_cloud);
-
-  child_counted_pixels->clear();
   *child_counted_pixels = parent_counted_pixels;
 
   // TODO: make principled
-  if (full_rendered_cloud->points.empty()) {
+  if (GetNumValidPixels(full_rendered_depth_image) == 0) {
     return 100000;
   }
 
-  std::sort(child_counted_pixels->begin(), child_counted_pixels->end());
-
-  vector<int> indices_to_consider;
+  PixelSet indices_to_consider;
 
   if (last_level) {
-    indices_to_consider.resize(valid_indices_.size());
-    auto it = std::set_difference(valid_indices_.begin(), valid_indices_.end(),
-                                  child_counted_pixels->begin(), child_counted_pixels->end(),
-                                  indices_to_consider.begin());
-    indices_to_consider.resize(it - indices_to_consider.begin());
+    indices_to_consider = valid_indices_;
+    indices_to_consider.Difference(*child_counted_pixels);
   } else {
-    ContPose last_obj_pose = last_object.cont_pose();
-    int last_obj_id = last_object.id();
-    PointT obj_center;
-    obj_center.x = last_obj_pose.x();
-    obj_center.y = last_obj_pose.y();
-    obj_center.z = env_params_.table_height;
-
-    vector<float> sqr_dists;
-    vector<int> validation_points;
-
-    // Check that this object state is valid, i.e, it has at least
-    // perch_params_.min_neighbor_points_for_valid_pose within the circumscribed cylinder.
-    // This should be true if we correctly validate successors.
-    const double validation_search_rad =
-      obj_models_[last_obj_id].GetCircumscribedRadius();
-    int num_validation_neighbors = projected_knn_->radiusSearch(obj_center,
-                                                                validation_search_rad,
-                                                                validation_points,
-                                                                sqr_dists, kNumPixels);
-    assert(num_validation_neighbors >=
-           perch_params_.min_neighbor_points_for_valid_pose);
-
-    // The points within the inscribed cylinder are the ones made
-    // "infeasible".
-    const double inscribed_rad = obj_models_[last_obj_id].GetInscribedRadius();
-    const double inscribed_rad_sq = inscribed_rad * inscribed_rad;
-    vector<int> infeasible_points;
-    infeasible_points.reserve(validation_points.size());
-
-    for (size_t ii = 0; ii < validation_points.size(); ++ii) {
-      if (sqr_dists[ii] <= inscribed_rad_sq) {
-        infeasible_points.push_back(validation_points[ii]);
-      }
-    }
-
-    std::sort(infeasible_points.begin(), infeasible_points.end());
-    indices_to_consider.resize(infeasible_points.size());
-    auto it = std::set_difference(infeasible_points.begin(),
-                                  infeasible_points.end(),
-                                  child_counted_pixels->begin(), child_counted_pixels->end(),
-                                  indices_to_consider.begin());
-    indices_to_consider.resize(it - indices_to_consider.begin());
+    GetInfeasibleIndices(last_object, *child_counted_pixels,
+                         &indices_to_consider);
   }
 
+  child_counted_pixels->Union(indices_to_consider);
   double nn_score = 0.0;
 
   for (const int ii : indices_to_consider) {
-    child_counted_pixels->push_back(ii);
-
-    PointT point = observed_cloud_->points[ii];
-    vector<float> sqr_dists;
-    vector<int> indices;
-    int num_neighbors_found = knn_reverse->radiusSearch(point,
-                                                        perch_params_.sensor_resolution,
-                                                        indices,
-                                                        sqr_dists, 1);
-    bool point_unexplained = num_neighbors_found == 0;
+    bool point_unexplained = !HasRenderedNeighbor(full_rendered_depth_image,
+                                                  ii);
 
     if (point_unexplained) {
       if (kUseDepthSensitiveCost) {
@@ -1433,47 +1554,67 @@ int EnvObjectRecognition::GetSourceCost(const PointCloudPtr
   return source_cost;
 }
 
-int EnvObjectRecognition::GetLastLevelCost(const PointCloudPtr
-                                           full_rendered_cloud,
+void EnvObjectRecognition::GetInfeasibleIndices(const ObjectState
+                                                &last_object, const PixelSet &counted_pixels,
+                                                PixelSet *indices_to_consider) {
+  ContPose last_obj_pose = last_object.cont_pose();
+  int last_obj_id = last_object.id();
+  PointT obj_center;
+  obj_center.x = last_obj_pose.x();
+  obj_center.y = last_obj_pose.y();
+  obj_center.z = env_params_.table_height;
+
+  vector<float> sqr_dists;
+  vector<int> validation_points;
+
+  // Check that this object state is valid, i.e, it has at least
+  // perch_params_.min_neighbor_points_for_valid_pose within the circumscribed cylinder.
+  // This should be true if we correctly validate successors.
+  const double validation_search_rad =
+    obj_models_[last_obj_id].GetCircumscribedRadius();
+  int num_validation_neighbors = projected_knn_->radiusSearch(obj_center,
+                                                              validation_search_rad,
+                                                              validation_points,
+                                                              sqr_dists, kNumPixels);
+  assert(num_validation_neighbors >=
+         perch_params_.min_neighbor_points_for_valid_pose);
+
+  // The points within the inscribed cylinder are the ones made
+  // "infeasible".
+  const double inscribed_rad = obj_models_[last_obj_id].GetInscribedRadius();
+  const double inscribed_rad_sq = inscribed_rad * inscribed_rad;
+  indices_to_consider->Clear();
+
+  for (size_t ii = 0; ii < validation_points.size(); ++ii) {
+    if (sqr_dists[ii] <= inscribed_rad_sq) {
+      indices_to_consider->Insert(validation_points[ii]);
+    }
+  }
+
+  indices_to_consider->Difference(counted_pixels);
+}
+
+int EnvObjectRecognition::GetLastLevelCost(const vector<unsigned short>
+                                           &full_rendered_depth_image,
                                            const ObjectState &last_object,
-                                           const std::vector<int> &counted_pixels,
-                                           std::vector<int> *updated_counted_pixels) {
+                                           const PixelSet &counted_pixels,
+                                           PixelSet *updated_counted_pixels) {
   // Compute the cost of points made infeasible in the observed point cloud.
-  pcl::search::KdTree<PointT>::Ptr knn_reverse;
-  knn_reverse.reset(new pcl::search::KdTree<PointT>(true));
-  knn_reverse->setInputCloud(full_rendered_cloud);
-
-  updated_counted_pixels->clear();
   *updated_counted_pixels = counted_pixels;
 
   // TODO: make principled
-  if (full_rendered_cloud->points.empty()) {
+  if (GetNumValidPixels(full_rendered_depth_image) == 0) {
     return 100000;
   }
 
-  std::sort(updated_counted_pixels->begin(), updated_counted_pixels->end());
-
-  vector<int> indices_to_consider;
-
-  indices_to_consider.resize(valid_indices_.size());
-  auto it = std::set_difference(valid_indices_.begin(), valid_indices_.end(),
-                                updated_counted_pixels->begin(), updated_counted_pixels->end(),
-                                indices_to_consider.begin());
-  indices_to_consider.resize(it - indices_to_consider.begin());
-
+  PixelSet indices_to_consider = valid_indices_;
+  indices_to_consider.Difference(*updated_counted_pixels);
+  updated_counted_pixels->Union(indices_to_consider);
   double nn_score = 0.0;
 
   for (const int ii : indices_to_consider) {
-    updated_counted_pixels->push_back(ii);
-
-    PointT point = observed_cloud_->points[ii];
-    vector<float> sqr_dists;
-    vector<int> indices;
-    int num_neighbors_found = knn_reverse->radiusSearch(point,
-                                                        perch_params_.sensor_resolution,
-                                                        indices,
-                                                        sqr_dists, 1);
-    bool point_unexplained = num_neighbors_found == 0;
+    bool point_unexplained = !HasRenderedNeighbor(full_rendered_depth_image,
+                                                  ii);
 
     if (point_unexplained) {
       if (kUseDepthSensitiveCost) {
@@ -1485,12 +1626,103 @@ int EnvObjectRecognition::GetLastLevelCost(const PointCloudPtr
     }
   }
 
-  assert(updated_counted_pixels->size() == valid_indices_.size());
+  assert(updated_counted_pixels->Size() == valid_indices_.Size());
 
   int last_level_cost = static_cast<int>(nn_score);
   return last_level_cost;
 }
 
+bool EnvObjectRecognition::HasRenderedNeighbor(const vector<unsigned short>
+                                               &rendered_depth_image, int observed_point_index) const {
+  const int index = observed_pixel_indices_[observed_point_index];
+  const PointT &point = observed_cloud_->points[observed_point_index];
+  // The rendered points are computed from the same pixel rays as the
+  // observed cloud, so the 3D check gives the same answer as a radius search
+  // over the rendered cloud.
+  return camera_model_.HasNeighborInDepthImage(rendered_depth_image.data(),
+                                               Eigen::Vector3f(point.x, point.y, point.z), index,
+                                               static_cast<float>(observed_depth_image_[index]) / 1000.0f,
+                                               perch_params_.sensor_resolution, true);
+}
+
+void EnvObjectRecognition::GetRenderedCosts(const vector<unsigned short>
+                                            &child_depth_image,
+                                            const ObjectState &last_object, bool last_level,
+                                            const PixelSet &parent_counted_pixels,
+                                            PixelSet *child_counted_pixels, int *target_cost, int *source_cost,
+                                            int *last_level_cost) {
+  *child_counted_pixels = parent_counted_pixels;
+  *target_cost = 0;
+  *source_cost = 0;
+  *last_level_cost = 0;
+
+  // TODO: make principled
+  if (GetNumValidPixels(child_depth_image) == 0) {
+    *source_cost = 100000;
+    *last_level_cost = last_level ? 100000 : 0;
+    return;
+  }
+
+  // The observed points of the source cost get mask value 1 and those of
+  // the last level cost 2, so all three costs come out of one scoring pass.
+  PixelSet indices_to_consider;
+  GetInfeasibleIndices(last_object, *child_counted_pixels,
+                       &indices_to_consider);
+  child_counted_pixels->Union(indices_to_consider);
+
+  vector<uint8_t> mask(kNumPixels, 0);
+
+  for (const int ii : indices_to_consider) {
+    mask[observed_pixel_indices_[ii]] = 1;
+  }
+
+  if (last_level) {
+    indices_to_consider = valid_indices_;
+    indices_to_consider.Difference(*child_counted_pixels);
+    child_counted_pixels->Union(indices_to_consider);
+
+    for (const int ii : indices_to_consider) {
+      mask[observed_pixel_indices_[ii]] = 2;
+    }
+  }
+
+  // Pixels of the parent image are not new, so they are excluded from the
+  // target cost by the reference image.
+  kinect_simulator_->rl_->setObservedMask(&mask[0]);
+  float counts[4];
+  kinect_simulator_->rl_->countUnexplainedPoints(static_cast<float>
+                                                 (perch_params_.sensor_resolution), counts);
+  *target_cost = static_cast<int>(counts[0]);
+  *source_cost = static_cast<int>(counts[1]);
+  *last_level_cost = static_cast<int>(counts[2]);
+}
+
+void EnvObjectRecognition::SetReferenceDepthImage(const DepthImageROI
+                                                  &depth_image, int source_id) {
+  // Children mostly share their source, so nothing is compared until the
+  // source changes, and the cropped images are compared before uploading.
+  if (source_id == reference_source_id_) {
+    return;
+  }
+
+  reference_source_id_ = source_id;
+
+  if (has_reference_depth_image_ &&
+      SameDepthImage(depth_image, reference_depth_image_)) {
+    return;
+  }
+
+  has_reference_depth_image_ = true;
+  reference_depth_image_ = depth_image;
+  vector<unsigned short> full_depth_image;
+  ExpandDepthImage(depth_image, &full_depth_image);
+  kinect_simulator_->set_occlusion_reference(full_depth_image);
+}
+
+void EnvObjectRecognition::ResetReferenceDepthImage() {
+  reference_source_id_ = -1;
+}
+
 PointCloudPtr EnvObjectRecognition::GetGravityAlignedPointCloud(
   const vector<unsigned short> &depth_image) {
   PointCloudPtr cloud(new PointCloud);
@@ -1501,22 +1733,37 @@ PointCloudPtr EnvObjectRecognition::GetGravityAlignedPointCloud(
       continue;
     }
 
-    vector<int> indices;
-    vector<float> sqr_dists;
+    const Eigen::Vector3f point_eig = camera_model_.GetWorldPoint(ii,
+                                                                  depth_image[ii]);
     PointT point;
+    point.x = point_eig[0];
+    point.y = point_eig[1];
+    point.z = point_eig[2];
+    cloud->points.push_back(point);
+  }
 
-    // int u = kDepthImageWidth - ii % kDepthImageWidth;
-    int u = ii % kDepthImageWidth;
-    int v = ii / kDepthImageWidth;
-    v = kDepthImageHeight - 1 - v;
-    // int idx = y * camera_width_ + x;
-    //         int i_in = (camera_height_ - 1 - y) * camera_width_ + x;
-    // point = observed_organized_cloud_->at(v, u);
-
-    Eigen::Vector3f point_eig;
-    kinect_simulator_->rl_->getGlobalPoint(u, v,
-                                           static_cast<float>(depth_image[ii]) / 1000.0, cam_to_world_,
-                                           point_eig);
+  cloud->width = 1;
+  cloud->height = cloud->points.size();
+  cloud->is_dense = false;
+  return cloud;
+}
+
+PointCloudPtr EnvObjectRecognition::GetGravityAlignedPointCloud(
+  const vector<unsigned short> &depth_image, const vector<int> &pixel_indices) {
+  PointCloudPtr cloud(new PointCloud);
+  cloud->points.reserve(pixel_indices.size());
+
+  for (size_t ii = 0; ii < pixel_indices.size(); ++ii) {
+    const int idx = pixel_indices[ii];
+
+    // Skip if empty pixel
+    if (depth_image[idx] == kKinectMaxDepth) {
+      continue;
+    }
+
+    const Eigen::Vector3f point_eig = camera_model_.GetWorldPoint(idx,
+                                                                  depth_image[idx]);
+    PointT point;
     point.x = point_eig[0];
     point.y = point_eig[1];
     point.z = point_eig[2];
@@ -1537,6 +1784,10 @@ PointCloudPtr EnvObjectRecognition::GetGravityAlignedOrganizedPointCloud(
   cloud->points.resize(kNumPixels);
   cloud->is_dense = true;
 
+  vector<float> x(kNumPixels), y(kNumPixels), z(kNumPixels);
+  camera_model_.GetWorldPoints(depth_image.data(), x.data(), y.data(),
+                               z.data());
+
   for (int ii = 0; ii < kNumPixels; ++ii) {
     auto &point = cloud->points[VectorIndexToPCLIndex(ii)];
     // Skip if empty pixel
@@ -1547,21 +1798,9 @@ PointCloudPtr EnvObjectRecognition::GetGravityAlignedOrganizedPointCloud(
       continue;
     }
 
-    // int u = kDepthImageWidth - ii % kDepthImageWidth;
-    int u = ii % kDepthImageWidth;
-    int v = ii / kDepthImageWidth;
-    v = kDepthImageHeight - 1 - v;
-    // int idx = y * camera_width_ + x;
-    //         int i_in = (camera_height_ - 1 - y) * camera_width_ + x;
-    // point = observed_organized_cloud_->at(v, u);
-
-    Eigen::Vector3f point_eig;
-    kinect_simulator_->rl_->getGlobalPoint(u, v,
-                                           static_cast<float>(depth_image[ii]) / 1000.0, cam_to_world_,
-                                           point_eig);
-    point.x = point_eig[0];
-    point.y = point_eig[1];
-    point.z = point_eig[2];
+    point.x = x[ii];
+    point.y = y[ii];
+    point.z = z[ii];
   }
 
   return cloud;
@@ -1572,20 +1811,15 @@ vector<unsigned short> EnvObjectRecognition::GetDepthImageFromPointCloud(
   vector<unsigned short> depth_image(kNumPixels, kKinectMaxDepth);
 
   for (size_t ii = 0; ii < cloud->size(); ++ii) {
-    PointT point = cloud->points[ii];
-    Eigen::Vector3f world_point(point.x, point.y, point.z);
-    int u = 0;
-    int v = 0;
+    const PointT &point = cloud->points[ii];
+    int idx = 0;
     float range = 0.0;
-    kinect_simulator_->rl_->getCameraCoordinate(cam_to_world_, world_point, u, v,
-                                                range);
-    v = kDepthImageHeight - 1 - v;
 
-    if (v < 0 || u < 0 || v >= kDepthImageHeight || u >= kDepthImageWidth) {
+    if (!camera_model_.Project(Eigen::Vector3f(point.x, point.y, point.z), &idx,
+                               &range)) {
       continue;
     }
 
-    const int idx = v * kDepthImageWidth + u;
     assert(idx >= 0 && idx < kNumPixels);
     depth_image[idx] = std::min(static_cast<unsigned short>(1000.0 * range),
                                 depth_image[idx]);
@@ -1724,32 +1958,18 @@ bool EnvObjectRecognition::IsGoalState(GraphState state) {
 }
 
 
-const float *EnvObjectRecognition::GetDepthImage(GraphState s,
-                                                 vector<unsigned short> *depth_image) {
+void EnvObjectRecognition::GetDepthImage(GraphState s,
+                                         vector<unsigned short> *depth_image) {
   if (scene_ == NULL) {
     printf("ERROR: Scene is not set\n");
   }
 
   scene_->clear();
+  AddObjectsToScene(s, scene_.get());
 
-  const auto &object_states = s.object_states();
-
-  for (size_t ii = 0; ii < object_states.size(); ++ii) {
-    const auto &object_state = object_states[ii];
-    ObjectModel obj_model = obj_models_[object_state.id()];
-    ContPose p = object_state.cont_pose();
-
-    auto transformed_mesh = obj_model.GetTransformedMesh(p,
-                                                         env_params_.table_height);
-
-    PolygonMeshModel::Ptr model = PolygonMeshModel::Ptr (new PolygonMeshModel (
-                                                           GL_POLYGON, transformed_mesh));
-    scene_->add (model);
-  }
-
-  kinect_simulator_->doSim(env_params_.camera_pose);
-  const float *depth_buffer = kinect_simulator_->rl_->getDepthBuffer();
-  kinect_simulator_->get_depth_image_uint(depth_buffer, depth_image);
+  kinect_simulator_->doRender(env_params_.camera_pose);
+  // Linearized and quantized to mm on the render side.
+  kinect_simulator_->get_depth_image_uint(depth_image);
 
   // kinect_simulator_->get_depth_image_cv(depth_buffer, depth_image);
   // cv_depth_image = cv::Mat(kDepthImageHeight, kDepthImageWidth, CV_16UC1, depth_image->data());
@@ -1759,13 +1979,251 @@ const float *EnvObjectRecognition::GetDepthImage(GraphState s,
   //   cv::imshow("depth image", c_image);
   //   cv::waitKey(1);
   // }
-
-  return depth_buffer;
 };
 
+void EnvObjectRecognition::GetDepthImages(const vector<GraphState> &states,
+                                          vector<vector<unsigned short>> *depth_images) {
+  vector<Scene::Ptr> scenes(states.size());
+  vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+      camera_poses(states.size(), env_params_.camera_pose);
+
+  for (size_t ii = 0; ii < states.size(); ++ii) {
+    scenes[ii].reset(new Scene);
+    AddObjectsToScene(states[ii], scenes[ii].get());
+  }
+
+  kinect_simulator_->get_depth_images_uint(scenes, camera_poses, depth_images);
+}
+
+void EnvObjectRecognition::GetDepthImageROI(GraphState s,
+                                            DepthImageROI *roi) {
+  if (scene_ == NULL) {
+    printf("ERROR: Scene is not set\n");
+  }
+
+  scene_->clear();
+  AddObjectsToScene(s, scene_.get());
+
+  kinect_simulator_->doRenderROI(env_params_.camera_pose, roi);
+}
+
+void EnvObjectRecognition::GetDepthImagesROI(const vector<GraphState> &states,
+                                             vector<DepthImageROI> *rois) {
+  vector<Scene::Ptr> scenes(states.size());
+  vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>
+      camera_poses(states.size(), env_params_.camera_pose);
+
+  for (size_t ii = 0; ii < states.size(); ++ii) {
+    scenes[ii].reset(new Scene);
+    AddObjectsToScene(states[ii], scenes[ii].get());
+  }
+
+  kinect_simulator_->get_depth_images_roi(scenes, camera_poses, rois);
+}
+
+void EnvObjectRecognition::GetSingleObjectDepthImagesROI(
+  const vector<GraphState> &states, vector<DepthImageROI> *rois) {
+  if (!template_bank_.IsOpen()) {
+    GetDepthImagesROI(states, rois);
+    return;
+  }
+
+  rois->assign(states.size(), DepthImageROI());
+  vector<TemplateKey> keys(states.size());
+  vector<bool> has_key(states.size(), false);
+  vector<GraphState> missing_states;
+  vector<int> missing_indices;
+
+  for (size_t ii = 0; ii < states.size(); ++ii) {
+    assert(states[ii].NumObjects() == 1);
+    has_key[ii] = GetTemplateKey(states[ii].object_states().back(), &keys[ii]);
+
+    if (has_key[ii] && template_bank_.Find(keys[ii], &rois->at(ii))) {
+      continue;
+    }
+
+    missing_indices.push_back(static_cast<int>(ii));
+    missing_states.push_back(states[ii]);
+  }
+
+  vector<DepthImageROI> missing_rois;
+  GetDepthImagesROI(missing_states, &missing_rois);
+
+  for (size_t ii = 0; ii < missing_indices.size(); ++ii) {
+    const int idx = missing_indices[ii];
+    rois->at(idx) = std::move(missing_rois[ii]);
+
+    if (has_key[idx]) {
+      template_bank_.Add(keys[idx], rois->at(idx));
+    }
+  }
+}
+
+bool EnvObjectRecognition::IsLastObjectOccluding(const GraphState &s) {
+  if (scene_ == NULL) {
+    printf("ERROR: Scene is not set\n");
+  }
+
+  GraphState s_last_obj;
+  s_last_obj.AppendObject(s.object_states().back());
+  scene_->clear();
+  AddObjectsToScene(s_last_obj, scene_.get());
+
+  return kinect_simulator_->count_occluding_pixels(env_params_.camera_pose) > 0;
+}
+
+void EnvObjectRecognition::AddObjectsToScene(const GraphState &s,
+                                             Scene *scene) const {
+  const auto &object_states = s.object_states();
+
+  for (size_t ii = 0; ii < object_states.size(); ++ii) {
+    const auto &object_state = object_states[ii];
+    const ObjectModel &obj_model = obj_models_[object_state.id()];
+    const ContPose &p = object_state.cont_pose();
+
+    const Eigen::Affine3f model_to_scene = obj_model.GetModelToSceneTransform(p,
+                                                                              env_params_.table_height);
+    scene->add(Model::Ptr(new TransformedModel(
+                            obj_render_models_[object_state.id()][GetLODLevel(object_state)],
+                            model_to_scene.matrix())));
+  }
+}
+
+int EnvObjectRecognition::GetLODLevel(const ObjectState &object_state) const {
+  const ObjectModel &obj_model = obj_models_[object_state.id()];
+
+  if (obj_model.NumLODLevels() == 1) {
+    return 0;
+  }
+
+  const ContPose &p = object_state.cont_pose();
+  const Eigen::Vector3d center(p.x(), p.y(), env_params_.table_height);
+  const double distance = (center - env_params_.camera_pose.translation()).norm();
+  const double radius = obj_model.GetCircumscribedRadius();
+
+  if (distance <= radius) {
+    return 0;
+  }
+
+  const double radius_px = kinect_simulator_->rl_->getCameraFX() * radius /
+                           distance;
+  const double needed_triangles = M_PI * radius_px * radius_px /
+                                  kLODPixelsPerTriangle;
+  int level = 0;
+
+  while (level + 1 < obj_model.NumLODLevels() &&
+         obj_model.NumTriangles(level + 1) >= needed_triangles) {
+    ++level;
+  }
+
+  return level;
+}
+
+uint64_t EnvObjectRecognition::GetSceneHash() const {
+  const auto &rl = kinect_simulator_->rl_;
+  vector<double> values = {
+    rl->getCameraFX(), rl->getCameraFY(), rl->getCameraCX(), rl->getCameraCY(),
+    static_cast<double>(kDepthImageWidth), static_cast<double>(kDepthImageHeight),
+    static_cast<double>(perch_params_.use_software_rendering),
+    static_cast<double>(perch_params_.use_lod),
+    env_params_.table_height, env_params_.res, env_params_.theta_res
+  };
+  const Eigen::Matrix4d camera_pose = env_params_.camera_pose.matrix();
+  values.insert(values.end(), camera_pose.data(),
+                camera_pose.data() + camera_pose.size());
+
+  // Round to micrometres (and microradians), so that the same scene read
+  // back from a file hashes the same.
+  vector<int64_t> quantized_values(values.size());
+
+  for (size_t ii = 0; ii < values.size(); ++ii) {
+    quantized_values[ii] = static_cast<int64_t>(std::llround(values[ii] * 1e6));
+  }
+
+  return HashBytes(quantized_values.data(),
+                   quantized_values.size() * sizeof(int64_t));
+}
+
+bool EnvObjectRecognition::GetTemplateKey(const ObjectState &object_state,
+                                          TemplateKey *key) const {
+  const DiscPose &disc_pose = object_state.disc_pose();
+
+  if (ContPose(disc_pose) != object_state.cont_pose()) {
+    return false;
+  }
+
+  *key = TemplateKey(obj_model_hashes_[object_state.id()], disc_pose.x(),
+                     disc_pose.y(), disc_pose.yaw(), GetLODLevel(object_state));
+  return true;
+}
+
+void EnvObjectRecognition::OpenTemplateBank() {
+  if (perch_params_.template_bank_dir.empty()) {
+    template_bank_.Close();
+    return;
+  }
+
+  const uint64_t scene_hash = GetSceneHash();
+  char file_name[32];
+  snprintf(file_name, sizeof(file_name), "%016llx.bank",
+           static_cast<unsigned long long>(scene_hash));
+  const string path = perch_params_.template_bank_dir + "/" + file_name;
+  const size_t num_templates = template_bank_.Open(path, scene_hash);
+
+  if (IsMaster(mpi_comm_)) {
+    printf("Template bank %s has %zu templates\n", path.c_str(), num_templates);
+  }
+}
+
+void EnvObjectRecognition::SaveTemplateBank() {
+  if (perch_params_.template_bank_dir.empty()) {
+    return;
+  }
+
+  vector<TemplateKey> keys;
+  vector<DepthImageROI> rois;
+
+  for (const auto &entry : template_bank_.pending()) {
+    keys.push_back(entry.first);
+    rois.push_back(entry.second);
+  }
+
+  vector<vector<TemplateKey>> all_keys;
+  vector<vector<DepthImageROI>> all_rois;
+  boost::mpi::gather(*mpi_comm_, keys, all_keys, kMasterRank);
+  boost::mpi::gather(*mpi_comm_, rois, all_rois, kMasterRank);
+
+  if (IsMaster(mpi_comm_)) {
+    for (size_t rank = 0; rank < all_keys.size(); ++rank) {
+      for (size_t ii = 0; ii < all_keys[rank].size(); ++ii) {
+        template_bank_.Add(all_keys[rank][ii], all_rois[rank][ii]);
+      }
+    }
+
+    const size_t num_new_templates = template_bank_.pending().size();
+
+    if (template_bank_.Save()) {
+      printf("Added %zu templates to the template bank, now %zu\n",
+             num_new_templates, template_bank_.size());
+    }
+  }
+
+  // The other processors map the new file once master has written it.
+  mpi_comm_->barrier();
+
+  if (!IsMaster(mpi_comm_)) {
+    OpenTemplateBank();
+  }
+}
+
 void EnvObjectRecognition::SetCameraPose(Eigen::Isometry3d camera_pose) {
   env_params_.camera_pose = camera_pose;
   cam_to_world_ = camera_pose;
+
+  const auto &rl = kinect_simulator_->rl_;
+  camera_model_ = CameraModel(kDepthImageWidth, kDepthImageHeight,
+                              rl->getCameraFX(), rl->getCameraFY(), rl->getCameraCX(), rl->getCameraCY());
+  camera_model_.SetCameraPose(camera_pose);
   return;
 }
 
@@ -1823,8 +2281,9 @@ void EnvObjectRecognition::SetObservation(int num_objects,
   vector<int> nan_indices;
   downsampled_observed_cloud_ = DownsamplePointCloud(observed_cloud_);
 
-  knn.reset(new pcl::search::KdTree<PointT>(true));
-  knn->setInputCloud(observed_cloud_);
+  observed_index_ = perception_utils::FixedRadiusIndex(
+                      perch_params_.sensor_resolution);
+  observed_index_.SetInputCloud(*observed_cloud_);
 
   if (mpi_comm_->rank() == kMasterRank) {
     LabelEuclideanClusters();
@@ -1833,12 +2292,26 @@ void EnvObjectRecognition::SetObservation(int num_objects,
   // Project point cloud to table.
   *projected_cloud_ = *observed_cloud_;
 
-  valid_indices_.reserve(projected_cloud_->size());
+  // observed_cloud_ has a point for every pixel with a return, in pixel order.
+  observed_pixel_indices_.clear();
+  observed_pixel_indices_.reserve(observed_cloud_->size());
+
+  for (int ii = 0; ii < kNumPixels; ++ii) {
+    if (observed_depth_image_[ii] != kKinectMaxDepth) {
+      observed_pixel_indices_.push_back(ii);
+    }
+  }
+
+  if (perch_params_.use_gpu_scoring) {
+    kinect_simulator_->rl_->setObservedDepth(&observed_depth_image_[0]);
+  }
+
+  valid_indices_.Clear();
 
   for (size_t ii = 0; ii < projected_cloud_->size(); ++ii) {
     if (!(std::isnan(projected_cloud_->points[ii].z) ||
           std::isinf(projected_cloud_->points[ii].z))) {
-      valid_indices_.push_back(static_cast<int>(ii));
+      valid_indices_.Insert(static_cast<int>(ii));
     }
 
     projected_cloud_->points[ii].z = env_params_.table_height;
@@ -1885,6 +2358,8 @@ void EnvObjectRecognition::SetObservation(int num_objects,
     pcl::PCDWriter writer;
     writer.writeBinary (ss.str()  , *projected_cloud_);
   }
+
+  OpenTemplateBank();
 }
 
 void EnvObjectRecognition::ResetEnvironmentState() {
@@ -1917,9 +2392,8 @@ void EnvObjectRecognition::ResetEnvironmentState() {
   cost_cache.clear();
   depth_image_cache_.clear();
   counted_pixels_map_.clear();
-  adjusted_single_object_depth_image_cache_.clear();
-  unadjusted_single_object_depth_image_cache_.clear();
-  adjusted_single_object_state_cache_.clear();
+  single_object_cache_.clear();
+  ResetReferenceDepthImage();
 
   minz_map_[env_params_.start_state_id] = 0;
   maxz_map_[env_params_.start_state_id] = 0;
@@ -2018,7 +2492,7 @@ void EnvObjectRecognition::Initialize(const EnvConfig &env_config) {
 
 double EnvObjectRecognition::GetICPAdjustedPose(const PointCloudPtr cloud_in,
                                                 const ContPose &pose_in, PointCloudPtr &cloud_out, ContPose *pose_out,
-                                                const std::vector<int> counted_indices /*= std::vector<int>(0)*/) {
+                                                const PixelSet &counted_indices /*= PixelSet()*/) {
   *pose_out = pose_in;
 
   pcl::IterativeClosestPointNonLinear<PointT, PointT> icp;
@@ -2033,8 +2507,17 @@ double EnvObjectRecognition::GetICPAdjustedPose(const PointCloudPtr cloud_in,
     icp.setInputSource(cloud_in);
   }
 
+  vector<int> remaining_indices;
+  remaining_indices.reserve(observed_cloud_->size());
+
+  for (int ii = 0; ii < static_cast<int>(observed_cloud_->size()); ++ii) {
+    if (!counted_indices.Contains(ii)) {
+      remaining_indices.push_back(ii);
+    }
+  }
+
   const PointCloudPtr remaining_observed_cloud = perception_utils::IndexFilter(
-                                                   observed_cloud_, counted_indices, true);
+                                                   observed_cloud_, remaining_indices);
   const PointCloudPtr remaining_downsampled_observed_cloud =
     DownsamplePointCloud(remaining_observed_cloud);
   icp.setInputTarget(remaining_downsampled_observed_cloud);
@@ -2329,53 +2812,97 @@ bool EnvObjectRecognition::GetComposedDepthImage(const vector<unsigned short>
                                                  &source_depth_image, const vector<unsigned short> &last_object_depth_image,
                                                  vector<unsigned short> *composed_depth_image) {
 
-  composed_depth_image->clear();
-  composed_depth_image->resize(source_depth_image.size(), kKinectMaxDepth);
   assert(source_depth_image.size() == last_object_depth_image.size());
+  composed_depth_image->resize(source_depth_image.size());
+  ComposeDepthImages(source_depth_image.data(), last_object_depth_image.data(),
+                     source_depth_image.size(), composed_depth_image->data());
+  return true;
+}
 
-  #pragma omp parallel for
+bool EnvObjectRecognition::GetComposedDepthImage(const vector<unsigned short>
+                                                 &source_depth_image, const DepthImageROI &last_object_depth_image,
+                                                 vector<unsigned short> *composed_depth_image) {
+  const DepthImageROI &roi = last_object_depth_image;
+  *composed_depth_image = source_depth_image;
 
-  for (size_t ii = 0; ii < source_depth_image.size(); ++ii) {
-    composed_depth_image->at(ii) = std::min(source_depth_image[ii],
-                                            last_object_depth_image[ii]);
+  for (int v = 0; v < roi.height; ++v) {
+    unsigned short *row = &composed_depth_image->at((roi.y + v) *
+                                                    kDepthImageWidth + roi.x);
+    ComposeDepthImages(row, &roi.depth[v * roi.width], roi.width, row);
   }
 
   return true;
 }
 
 bool EnvObjectRecognition::GetSingleObjectDepthImage(const GraphState
-                                                     &single_object_graph_state, vector<unsigned short> *single_object_depth_image,
+                                                     &single_object_graph_state, DepthImageROI *single_object_depth_image,
                                                      bool after_refinement) {
 
-  single_object_depth_image->clear();
+  *single_object_depth_image = DepthImageROI();
 
   assert(single_object_graph_state.NumObjects() == 1);
 
-  auto &cache = after_refinement ? adjusted_single_object_depth_image_cache_ :
-                unadjusted_single_object_depth_image_cache_;
+  auto it = single_object_cache_.find(single_object_graph_state);
 
-  // TODO: Verify there are no cases where this will fail.
-  if (cache.find(single_object_graph_state) ==
-      cache.end()) {
+  if (it == single_object_cache_.end()) {
     return false;
   }
 
-  *single_object_depth_image =
-    cache[single_object_graph_state];
+  const SingleObjectRender &render = it->second;
+
+  if (after_refinement && render.adjusted_state.NumObjects() == 0) {
+    return false;
+  }
 
+  *single_object_depth_image = after_refinement ? render.adjusted_depth_image :
+                               render.depth_image;
   return true;
 }
 
-vector<unsigned short> EnvObjectRecognition::ApplyOcclusionMask(
-  const vector<unsigned short> input_depth_image,
-  const vector<unsigned short> masking_depth_image) {
-  vector<unsigned short> masked_depth_image(kNumPixels, kKinectMaxDepth);
+void EnvObjectRecognition::SetCachedLastObject(CostComputationInput *input) {
+  GraphState single_object_graph_state;
+  single_object_graph_state.AppendObject(
+    input->child_state.object_states().back());
+  auto it = single_object_cache_.find(single_object_graph_state);
 
-  for (int ii = 0; ii < kNumPixels; ++ii) {
-    masked_depth_image[ii] = masking_depth_image[ii] > input_depth_image[ii] ?
-                             input_depth_image[ii] : kKinectMaxDepth;
+  if (it == single_object_cache_.end()) {
+    return;
   }
 
+  input->last_object_cached = true;
+  input->last_object_roi = it->second.depth_image;
+  input->adjusted_last_object_state = it->second.adjusted_state;
+  input->adjusted_last_object_roi = it->second.adjusted_depth_image;
+}
+
+void EnvObjectRecognition::CacheLastObject(const CostComputationInput &input,
+                                           const CostComputationOutput &output, bool valid_successor) {
+  // NOTE: The hash key is computed on the *unadjusted* child state.
+  GraphState single_object_graph_state;
+  single_object_graph_state.AppendObject(
+    input.child_state.object_states().back());
+
+  if (output.last_object_rendered) {
+    single_object_cache_[single_object_graph_state].depth_image =
+      output.last_object_roi;
+  }
+
+  // ICP results are cached *only* from the first level, where the object is
+  // alone in the scene, and *only* if valid.
+  if (valid_successor && input.source_state.NumObjects() == 0) {
+    assert(output.adjusted_state.NumObjects() > 0);
+    SingleObjectRender &render = single_object_cache_[single_object_graph_state];
+    render.adjusted_state = output.adjusted_state;
+    render.adjusted_depth_image = output.depth_image;
+  }
+}
+
+vector<unsigned short> EnvObjectRecognition::ApplyOcclusionMask(
+  const vector<unsigned short> input_depth_image,
+  const vector<unsigned short> masking_depth_image) {
+  vector<unsigned short> masked_depth_image(kNumPixels);
+  MaskOccludedPixels(input_depth_image.data(), masking_depth_image.data(),
+                     kNumPixels, masked_depth_image.data());
   return masked_depth_image;
 }
 }  // namespace
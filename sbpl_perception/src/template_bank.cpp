@@ -0,0 +1,280 @@
+/**
+ * @file template_bank.cpp
+ * @brief Persistent bank of single object depth renders
+ * @author Venkatraman Narayanan
+ * Carnegie Mellon University, 2015
+ */
+
+#include <sbpl_perception/template_bank.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <tuple>
+
+using pcl::simulation::DepthImageROI;
+
+namespace {
+constexpr char kBankMagic[8] = {'P', 'E', 'R', 'C', 'H', 'T', 'B', 'K'};
+// Bump whenever the file layout or the way templates are rendered changes.
+constexpr uint32_t kBankVersion = 1;
+}  // namespace
+
+namespace sbpl_perception {
+
+// File layout: FileHeader, num_entries FileEntry's sorted by key, and then the
+// depth values (unsigned short, row major) of every entry.
+struct TemplateBank::FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_entries;
+  uint64_t scene_hash;
+};
+
+struct TemplateBank::FileEntry {
+  TemplateKey key;
+  int32_t x;
+  int32_t y;
+  int32_t width;
+  int32_t height;
+  // In bytes from the end of the entry table.
+  uint64_t offset;
+};
+
+bool TemplateKey::operator<(const TemplateKey &other) const {
+  return std::tie(model_hash, x, y, yaw, lod_level) <
+         std::tie(other.model_hash, other.x, other.y, other.yaw, other.lod_level);
+}
+
+bool TemplateKey::operator==(const TemplateKey &other) const {
+  return model_hash == other.model_hash && x == other.x && y == other.y &&
+         yaw == other.yaw && lod_level == other.lod_level;
+}
+
+uint64_t HashBytes(const void *data, size_t num_bytes, uint64_t seed) {
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  uint64_t hash = seed;
+
+  for (size_t ii = 0; ii < num_bytes; ++ii) {
+    hash ^= bytes[ii];
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+TemplateBank::TemplateBank() : scene_hash_(0), entries_(nullptr),
+  data_(nullptr), num_mapped_(0) {}
+
+size_t TemplateBank::Open(const std::string &path, uint64_t scene_hash) {
+  using namespace boost::interprocess;
+
+  Close();
+  path_ = path;
+  scene_hash_ = scene_hash;
+
+  std::ifstream file(path_.c_str(), std::ios::binary | std::ios::ate);
+
+  if (!file.good() || static_cast<size_t>(file.tellg()) < sizeof(FileHeader)) {
+    return 0;
+  }
+
+  const size_t file_size = static_cast<size_t>(file.tellg());
+  file.close();
+
+  try {
+    file_.reset(new file_mapping(path_.c_str(), read_only));
+    region_.reset(new mapped_region(*file_, read_only));
+  } catch (const interprocess_exception &e) {
+    printf("Could not map template bank %s: %s\n", path_.c_str(), e.what());
+    region_.reset();
+    file_.reset();
+    return 0;
+  }
+
+  const char *base = static_cast<const char *>(region_->get_address());
+  const FileHeader *header = reinterpret_cast<const FileHeader *>(base);
+
+  if (memcmp(header->magic, kBankMagic, sizeof(kBankMagic)) != 0 ||
+      header->version != kBankVersion || header->scene_hash != scene_hash_) {
+    printf("Ignoring stale template bank %s\n", path_.c_str());
+    region_.reset();
+    file_.reset();
+    return 0;
+  }
+
+  // A truncated or otherwise corrupt file must not make Find read past the
+  // end of the mapping. num_entries is compared before it is multiplied, so
+  // that data_begin cannot overflow.
+  const FileEntry *entries = reinterpret_cast<const FileEntry *>
+                             (base + sizeof(FileHeader));
+  bool corrupt = header->num_entries > (file_size - sizeof(FileHeader)) /
+                 sizeof(FileEntry);
+  const size_t data_begin = corrupt ? 0 : sizeof(FileHeader) +
+                            header->num_entries * sizeof(FileEntry);
+  const uint64_t data_size = corrupt ? 0 : file_size - data_begin;
+
+  for (uint32_t ii = 0; !corrupt && ii < header->num_entries; ++ii) {
+    const FileEntry &entry = entries[ii];
+
+    if (entry.width < 0 || entry.height < 0 || entry.offset > data_size) {
+      corrupt = true;
+      break;
+    }
+
+    const uint64_t num_bytes = static_cast<uint64_t>(entry.width) *
+                               static_cast<uint64_t>(entry.height) * sizeof(unsigned short);
+    corrupt = num_bytes > data_size - entry.offset;
+  }
+
+  if (corrupt) {
+    printf("Ignoring corrupt template bank %s\n", path_.c_str());
+    region_.reset();
+    file_.reset();
+    return 0;
+  }
+
+  entries_ = entries;
+  data_ = base + data_begin;
+  num_mapped_ = header->num_entries;
+  return num_mapped_;
+}
+
+void TemplateBank::Close() {
+  region_.reset();
+  file_.reset();
+  entries_ = nullptr;
+  data_ = nullptr;
+  num_mapped_ = 0;
+  pending_.clear();
+  path_.clear();
+}
+
+const TemplateBank::FileEntry *TemplateBank::FindMapped(
+  const TemplateKey &key) const {
+  const FileEntry *end = entries_ + num_mapped_;
+  const FileEntry *it = std::lower_bound(entries_, end, key,
+  [](const FileEntry & entry, const TemplateKey & key) {
+    return entry.key < key;
+  });
+
+  if (it == end || !(it->key == key)) {
+    return nullptr;
+  }
+
+  return it;
+}
+
+bool TemplateBank::Find(const TemplateKey &key, DepthImageROI *roi) const {
+  const FileEntry *entry = FindMapped(key);
+
+  if (entry != nullptr) {
+    roi->x = entry->x;
+    roi->y = entry->y;
+    roi->width = entry->width;
+    roi->height = entry->height;
+    roi->depth.resize(entry->width * entry->height);
+
+    if (!roi->depth.empty()) {
+      memcpy(roi->depth.data(), data_ + entry->offset,
+             roi->depth.size() * sizeof(unsigned short));
+    }
+
+    return true;
+  }
+
+  auto it = pending_.find(key);
+
+  if (it == pending_.end()) {
+    return false;
+  }
+
+  *roi = it->second;
+  return true;
+}
+
+void TemplateBank::Add(const TemplateKey &key, const DepthImageROI &roi) {
+  if (FindMapped(key) != nullptr) {
+    return;
+  }
+
+  pending_.insert(std::make_pair(key, roi));
+}
+
+bool TemplateBank::Save() {
+  if (!IsOpen() || pending_.empty()) {
+    return true;
+  }
+
+  // Merge the mapped and pending templates, both of which are sorted.
+  std::vector<FileEntry> entries;
+  std::vector<const unsigned short *> depths;
+  entries.reserve(size());
+  depths.reserve(size());
+
+  size_t mapped_idx = 0;
+  auto pending_it = pending_.begin();
+  uint64_t offset = 0;
+
+  while (mapped_idx < num_mapped_ || pending_it != pending_.end()) {
+    FileEntry entry;
+    const unsigned short *depth = nullptr;
+
+    if (pending_it == pending_.end() ||
+        (mapped_idx < num_mapped_ && entries_[mapped_idx].key < pending_it->first)) {
+      entry = entries_[mapped_idx];
+      depth = reinterpret_cast<const unsigned short *>(data_ + entry.offset);
+      ++mapped_idx;
+    } else {
+      const DepthImageROI &roi = pending_it->second;
+      entry.key = pending_it->first;
+      entry.x = roi.x;
+      entry.y = roi.y;
+      entry.width = roi.width;
+      entry.height = roi.height;
+      depth = roi.depth.data();
+      ++pending_it;
+    }
+
+    entry.offset = offset;
+    offset += static_cast<uint64_t>(entry.width) * entry.height * sizeof(
+                unsigned short);
+    entries.push_back(entry);
+    depths.push_back(depth);
+  }
+
+  FileHeader header;
+  memcpy(header.magic, kBankMagic, sizeof(kBankMagic));
+  header.version = kBankVersion;
+  header.num_entries = static_cast<uint32_t>(entries.size());
+  header.scene_hash = scene_hash_;
+
+  // Write to a temporary file first: other processes may have the bank
+  // mapped, and must never see a partially written file.
+  const std::string tmp_path = path_ + ".tmp." + std::to_string(getpid());
+  std::ofstream file(tmp_path.c_str(), std::ios::binary | std::ios::trunc);
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(entries.data()),
+             entries.size() * sizeof(FileEntry));
+
+  for (size_t ii = 0; ii < entries.size(); ++ii) {
+    file.write(reinterpret_cast<const char *>(depths[ii]),
+               entries[ii].width * entries[ii].height * sizeof(unsigned short));
+  }
+
+  file.close();
+
+  if (!file.good() || std::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+    printf("Could not write template bank %s\n", path_.c_str());
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+
+  const std::string path = path_;
+  Open(path, scene_hash_);
+  return true;
+}
+}  // namespace
@@ -144,6 +144,7 @@ DatasetGenerator::DatasetGenerator(int argc, char **argv) : output_dir_("") {
 
   // Now create the models.
   object_models_.clear();
+  render_models_.clear();
 
   for (const auto &model_meta_data : model_bank) {
     pcl::PolygonMesh mesh;
@@ -152,6 +153,9 @@ DatasetGenerator::DatasetGenerator(int argc, char **argv) : output_dir_("") {
                           model_meta_data.symmetric,
                           model_meta_data.flipped);
     object_models_.push_back(obj_model);
+
+    pcl::PolygonMesh::Ptr render_mesh(new pcl::PolygonMesh(obj_model.mesh()));
+    render_models_.push_back(Model::Ptr(new TriangleMeshModel(render_mesh)));
   }
 }
 
@@ -187,7 +191,7 @@ void DatasetGenerator::GenerateHaloPoses(Eigen::Vector3d focus_center,
 }
 
 vector<unsigned short> DatasetGenerator::GetDepthImage(const
-                                                       std::vector<ObjectModel>
+                                                       std::vector<int>
                                                        &models_in_scene, const Eigen::Isometry3d &camera_pose) {
 
   auto &scene_ = kinect_simulator_->scene_;
@@ -199,21 +203,18 @@ vector<unsigned short> DatasetGenerator::GetDepthImage(const
   scene_->clear();
 
   for (size_t ii = 0; ii < models_in_scene.size(); ++ii) {
-    ObjectModel object_model = models_in_scene[ii];
+    const int model_id = models_in_scene[ii];
     ContPose p(0, 0, 0);
 
-    auto transformed_mesh = object_model.GetTransformedMesh(p, 0.0);
-    PolygonMeshModel::Ptr model = PolygonMeshModel::Ptr (new PolygonMeshModel (
-                                                           GL_POLYGON, transformed_mesh));
-    scene_->add (model);
+    const Eigen::Affine3f model_to_scene =
+      object_models_[model_id].GetModelToSceneTransform(p, 0.0);
+    scene_->add(Model::Ptr(new TransformedModel(render_models_[model_id],
+                                                model_to_scene.matrix())));
   }
 
-  kinect_simulator_->doSim(camera_pose);
-  const float *depth_buffer = kinect_simulator_->rl_->getDepthBuffer();
+  kinect_simulator_->doRender(camera_pose);
   vector<unsigned short> depth_image;
-  kinect_simulator_->get_depth_image_uint(depth_buffer, &depth_image);
-
-  // kinect_simulator_->get_depth_image_cv(depth_buffer, depth_image);
+  kinect_simulator_->get_depth_image_uint(&depth_image);
   return depth_image;
 }
 
@@ -235,7 +236,7 @@ void DatasetGenerator::GenerateCylindersDataset(double min_radius,
   int model_num = 0;
 
   for (const auto &object_model : object_models_) {
-    vector<ObjectModel> models_in_scene = {object_model};
+    vector<int> models_in_scene = {model_num};
     int num_images = 0;
     int image_id = 0;
 
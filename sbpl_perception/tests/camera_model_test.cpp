@@ -0,0 +1,199 @@
+#include <sbpl_perception/camera_model.h>
+#include <sbpl_perception/utils/utils.h>
+
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <vector>
+
+using sbpl_perception::CameraModel;
+using sbpl_perception::kKinectMaxDepth;
+
+namespace {
+constexpr int kWidth = 640;
+constexpr int kHeight = 480;
+constexpr float kFocalLength = 576.09757860f;
+constexpr float kCx = 321.06398107f;
+constexpr float kCy = 242.97676897f;
+
+Eigen::Isometry3d CameraPose() {
+  Eigen::Isometry3d pose = Eigen::Isometry3d::Identity();
+  pose.translate(Eigen::Vector3d(0.2, -0.5, 1.3));
+  pose.rotate(Eigen::AngleAxisd(0.4, Eigen::Vector3d::UnitZ()) *
+              Eigen::AngleAxisd(0.6, Eigen::Vector3d::UnitY()));
+  return pose;
+}
+
+// RangeLikelihood::getGlobalPoint for pixel (u, row) of a top-down depth
+// image.
+Eigen::Vector3f GlobalPoint(const Eigen::Isometry3d &pose, int u, int row,
+                            unsigned short depth_mm) {
+  const float range = static_cast<float>(depth_mm) / 1000.0f;
+  const float v = static_cast<float>(kHeight - 1 - row);
+  const Eigen::Vector3f optical_point((u - kCx) * range / kFocalLength,
+                                      (v - kCy) * range / kFocalLength, -range);
+  Eigen::Matrix4f T;
+  T <<  0, 0, -1, 0,
+  -1, 0,  0, 0,
+  0, 1,  0, 0,
+  0, 0,  0, 1;
+  const Eigen::Matrix4f transform = pose.matrix().cast<float>() * T;
+  return transform.block<3, 3>(0, 0) * optical_point + transform.block<3, 1>(0,
+                                                                              3);
+}
+}  // namespace
+
+TEST(CameraModelTest, WorldPoints) {
+  CameraModel camera_model(kWidth, kHeight, kFocalLength, kFocalLength, kCx,
+                           kCy);
+  const Eigen::Isometry3d pose = CameraPose();
+  camera_model.SetCameraPose(pose);
+
+  const int pixels[][2] = {{0, 0}, {kWidth - 1, 0}, {320, 240}, {17, kHeight - 1}, {601, 93}};
+
+  for (const auto &pixel : pixels) {
+    const int index = pixel[1] * kWidth + pixel[0];
+    const Eigen::Vector3f expected = GlobalPoint(pose, pixel[0], pixel[1], 1234);
+    EXPECT_TRUE(camera_model.GetWorldPoint(index, 1234).isApprox(expected,
+                                                                1e-5)) << index;
+  }
+
+  std::vector<unsigned short> depth_image(kWidth * kHeight, 2500);
+  std::vector<float> x(depth_image.size()), y(depth_image.size()),
+      z(depth_image.size());
+  camera_model.GetWorldPoints(depth_image.data(), x.data(), y.data(), z.data());
+  const int index = 93 * kWidth + 601;
+  EXPECT_TRUE(Eigen::Vector3f(x[index], y[index],
+                              z[index]).isApprox(GlobalPoint(pose, 601, 93, 2500), 1e-5));
+}
+
+TEST(CameraModelTest, ProjectionInvertsDeprojection) {
+  CameraModel camera_model(kWidth, kHeight, kFocalLength, kFocalLength, kCx,
+                           kCy);
+  camera_model.SetCameraPose(CameraPose());
+
+  for (int index = 0; index < kWidth * kHeight; index += 997) {
+    int projected_index = -1;
+    float range = 0.0f;
+    // Push the point towards the centre of its pixel, since projection
+    // truncates.
+    const int u = index % kWidth;
+    const int row = index / kWidth;
+    const Eigen::Vector3f point = GlobalPoint(CameraPose(), u, row, 3000);
+    const Eigen::Vector3f centre = GlobalPoint(CameraPose(), u + 1, row - 1,
+                                               3000);
+    ASSERT_TRUE(camera_model.Project(0.5f * (point + centre), &projected_index,
+                                     &range));
+    EXPECT_EQ(index, projected_index);
+    EXPECT_NEAR(3.0f, range, 1e-4);
+  }
+
+  int projected_index = -1;
+  float range = 0.0f;
+  EXPECT_FALSE(camera_model.Project(GlobalPoint(CameraPose(), -5, 10, 3000),
+                                    &projected_index, &range));
+  EXPECT_FALSE(camera_model.Project(GlobalPoint(CameraPose(), 10, kHeight + 5,
+                                                3000), &projected_index, &range));
+}
+
+TEST(CameraModelTest, NeighborhoodWindowContainsNeighbors) {
+  CameraModel camera_model(kWidth, kHeight, kFocalLength, kFocalLength, kCx,
+                           kCy);
+  camera_model.SetCameraPose(CameraPose());
+  const float radius = 0.01f;
+  srand(1);
+
+  const int pixels[][2] = {{0, 0}, {kWidth - 1, kHeight - 1}, {320, 240}, {3, 470}, {555, 61}};
+  const unsigned short depths[] = {300, 1000, 4000};
+
+  for (const auto &pixel : pixels) {
+    for (const unsigned short depth : depths) {
+      const int index = pixel[1] * kWidth + pixel[0];
+      const Eigen::Vector3f point = camera_model.GetWorldPoint(index, depth);
+      int projected_index = -1;
+      float range = 0.0f;
+      ASSERT_TRUE(camera_model.Project(point, &projected_index, &range));
+      int min_u, max_u, min_row, max_row;
+      ASSERT_TRUE(camera_model.GetNeighborhoodWindow(projected_index, range,
+                                                     radius, &min_u, &max_u, &min_row, &max_row));
+
+      for (int ii = 0; ii < 1000; ++ii) {
+        const Eigen::Vector3f offset = Eigen::Vector3f::Random().normalized() *
+                                       radius * static_cast<float>(rand()) / RAND_MAX;
+        int neighbor_index = -1;
+        float neighbor_range = 0.0f;
+
+        if (!camera_model.Project(point + offset, &neighbor_index,
+                                  &neighbor_range)) {
+          continue;
+        }
+
+        const int u = neighbor_index % kWidth;
+        const int row = neighbor_index / kWidth;
+        EXPECT_TRUE(u >= min_u && u <= max_u && row >= min_row &&
+                    row <= max_row) << index << " " << depth;
+      }
+    }
+  }
+
+  EXPECT_FALSE(camera_model.GetNeighborhoodWindow(0, radius, radius, nullptr,
+                                                  nullptr, nullptr, nullptr));
+}
+
+TEST(CameraModelTest, NeighborsInDepthImageMatchRadiusSearch) {
+  CameraModel camera_model(kWidth, kHeight, kFocalLength, kFocalLength, kCx,
+                           kCy);
+  camera_model.SetCameraPose(CameraPose());
+  const float radius = 0.005f;
+  srand(2);
+
+  // A rendered object over a background with no returns, and observed depths
+  // around it.
+  std::vector<unsigned short> rendered_depth_image(kWidth * kHeight,
+                                                   kKinectMaxDepth);
+
+  for (int row = 200; row < 300; ++row) {
+    for (int u = 250; u < 400; ++u) {
+      rendered_depth_image[row * kWidth + u] = 1500 + (u + row) % 7 + rand() % 4;
+    }
+  }
+
+  std::vector<Eigen::Vector3f> rendered_points;
+
+  for (int ii = 0; ii < kWidth * kHeight; ++ii) {
+    if (rendered_depth_image[ii] != kKinectMaxDepth) {
+      rendered_points.push_back(camera_model.GetWorldPoint(ii,
+                                                           rendered_depth_image[ii]));
+    }
+  }
+
+  int num_explained = 0;
+
+  for (int ii = 0; ii < 2000; ++ii) {
+    const int index = (190 + rand() % 120) * kWidth + 240 + rand() % 170;
+    const unsigned short depth = static_cast<unsigned short>(1490 + rand() % 30);
+    const Eigen::Vector3f point = camera_model.GetWorldPoint(index, depth);
+    bool expected = false;
+
+    for (const auto &rendered_point : rendered_points) {
+      if ((rendered_point - point).squaredNorm() <= radius * radius) {
+        expected = true;
+        break;
+      }
+    }
+
+    EXPECT_EQ(expected, camera_model.HasNeighborInDepthImage(
+                rendered_depth_image.data(), point, index,
+                static_cast<float>(depth) / 1000.0f, radius, true)) << index << " " << depth;
+    num_explained += expected;
+  }
+
+  // Both answers should be well represented.
+  EXPECT_GT(num_explained, 200);
+  EXPECT_LT(num_explained, 1800);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,207 @@
+#include <sbpl_perception/depth_image_kernels.h>
+#include <sbpl_perception/utils/utils.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+using pcl::simulation::DepthImageROI;
+using namespace sbpl_perception;
+
+namespace {
+// Random depths, no return for roughly no_return_percent of the pixels.
+std::vector<unsigned short> RandomDepthImage(int num_pixels,
+                                             unsigned short min_depth, unsigned short max_depth,
+                                             int no_return_percent) {
+  std::vector<unsigned short> depth_image(num_pixels);
+
+  for (int ii = 0; ii < num_pixels; ++ii) {
+    depth_image[ii] = rand() % 100 < no_return_percent ? kKinectMaxDepth :
+                      static_cast<unsigned short>(min_depth + rand() % (max_depth - min_depth));
+  }
+
+  return depth_image;
+}
+
+DepthImageROI RandomROI(int x, int y, int width, int height,
+                        unsigned short min_depth, unsigned short max_depth) {
+  DepthImageROI roi;
+  roi.x = x;
+  roi.y = y;
+  roi.width = width;
+  roi.height = height;
+  roi.depth = RandomDepthImage(width * height, min_depth, max_depth, 30);
+  return roi;
+}
+
+std::vector<unsigned short> FullImage(const DepthImageROI &roi) {
+  std::vector<unsigned short> depth_image(kNumPixels, kKinectMaxDepth);
+
+  for (int v = 0; v < roi.height; ++v) {
+    for (int u = 0; u < roi.width; ++u) {
+      depth_image[(roi.y + v) * kDepthImageWidth + roi.x + u] =
+        roi.depth[v * roi.width + u];
+    }
+  }
+
+  return depth_image;
+}
+
+// Pixel by pixel definition of ComposeObjectDepthImage.
+bool ReferenceCompose(const std::vector<unsigned short> &source,
+                      const std::vector<unsigned short> &object,
+                      std::vector<unsigned short> *composed, std::vector<int> *new_pixel_indices,
+                      unsigned short *min_new_depth, unsigned short *max_new_depth,
+                      std::vector<unsigned short> *new_object) {
+  composed->assign(kNumPixels, kKinectMaxDepth);
+  new_object->assign(kNumPixels, kKinectMaxDepth);
+  new_pixel_indices->clear();
+  *min_new_depth = kKinectMaxDepth;
+  *max_new_depth = 0;
+
+  for (int ii = 0; ii < kNumPixels; ++ii) {
+    if (source[ii] != kKinectMaxDepth && object[ii] != kKinectMaxDepth &&
+        object[ii] < source[ii]) {
+      return true;
+    }
+
+    (*composed)[ii] = std::min(source[ii], object[ii]);
+
+    if (source[ii] == kKinectMaxDepth && object[ii] != kKinectMaxDepth) {
+      (*new_object)[ii] = object[ii];
+      new_pixel_indices->push_back(ii);
+      *min_new_depth = std::min(*min_new_depth, object[ii]);
+      *max_new_depth = std::max(*max_new_depth, object[ii]);
+    }
+  }
+
+  return false;
+}
+
+void ExpectSameComposition(const std::vector<unsigned short> &source,
+                           const DepthImageROI &roi) {
+  std::vector<unsigned short> composed, new_object;
+  std::vector<int> new_pixel_indices;
+  unsigned short min_new_depth, max_new_depth;
+  std::vector<unsigned short> expected_composed, expected_new_object;
+  std::vector<int> expected_new_pixel_indices;
+  unsigned short expected_min_new_depth, expected_max_new_depth;
+  const std::vector<unsigned short> object = FullImage(roi);
+
+  const bool expected_occluded = ReferenceCompose(source, object,
+                                                  &expected_composed, &expected_new_pixel_indices,
+                                                  &expected_min_new_depth, &expected_max_new_depth,
+                                                  &expected_new_object);
+
+  // Both the ROI and the full image versions.
+  for (int full = 0; full < 2; ++full) {
+    const bool occluded = full ?
+                          ComposeObjectDepthImage(source, object, &composed, &new_pixel_indices,
+                                                  &min_new_depth, &max_new_depth, &new_object) :
+                          ComposeObjectDepthImage(source, roi, &composed, &new_pixel_indices,
+                                                  &min_new_depth, &max_new_depth, &new_object);
+    ASSERT_EQ(expected_occluded, occluded);
+
+    if (occluded) {
+      EXPECT_TRUE(new_pixel_indices.empty());
+      EXPECT_EQ(kKinectMaxDepth, min_new_depth);
+      EXPECT_EQ(0, max_new_depth);
+      continue;
+    }
+
+    EXPECT_EQ(expected_composed, composed);
+    EXPECT_EQ(expected_new_object, new_object);
+    EXPECT_EQ(expected_new_pixel_indices, new_pixel_indices);
+    EXPECT_EQ(expected_min_new_depth, min_new_depth);
+    EXPECT_EQ(expected_max_new_depth, max_new_depth);
+  }
+}
+}  // namespace
+
+TEST(DepthImageKernelsTest, ComposeUnoccluded) {
+  srand(1);
+  // Objects behind every source pixel never occlude it.
+  const std::vector<unsigned short> source = RandomDepthImage(kNumPixels, 3000,
+                                                              6000, 50);
+  // ROI widths that are not a multiple of the vector width.
+  ExpectSameComposition(source, RandomROI(13, 7, 37, 29, 6000, 9000));
+  ExpectSameComposition(source, RandomROI(0, 0, 1, 1, 6000, 9000));
+  ExpectSameComposition(source, RandomROI(600, 400, 40, 80, 6000, 9000));
+  ExpectSameComposition(source, RandomROI(0, 0, kDepthImageWidth,
+                                          kDepthImageHeight, 6000, 9000));
+}
+
+TEST(DepthImageKernelsTest, ComposeOccluded) {
+  srand(2);
+  const std::vector<unsigned short> source = RandomDepthImage(kNumPixels, 3000,
+                                                              6000, 50);
+  ExpectSameComposition(source, RandomROI(101, 203, 67, 45, 1000, 9000));
+
+  // A single occluding pixel in the vector tail of the last row.
+  DepthImageROI roi = RandomROI(20, 30, 21, 3, 6000, 9000);
+  std::vector<unsigned short> occluded_source = source;
+  occluded_source[32 * kDepthImageWidth + 40] = 7000;
+  roi.depth.back() = 6500;
+  ExpectSameComposition(occluded_source, roi);
+}
+
+TEST(DepthImageKernelsTest, ComposeAndMask) {
+  srand(3);
+  const std::vector<unsigned short> first = RandomDepthImage(1003, 500, 20000,
+                                                             20);
+  const std::vector<unsigned short> second = RandomDepthImage(1003, 500, 20000,
+                                                              20);
+  std::vector<unsigned short> composed(first.size()), masked(first.size());
+  ComposeDepthImages(first.data(), second.data(), first.size(), composed.data());
+  MaskOccludedPixels(first.data(), second.data(), first.size(), masked.data());
+
+  for (size_t ii = 0; ii < first.size(); ++ii) {
+    EXPECT_EQ(std::min(first[ii], second[ii]), composed[ii]);
+    EXPECT_EQ(first[ii] < second[ii] ? first[ii] : kKinectMaxDepth, masked[ii]);
+  }
+}
+
+TEST(DepthImageKernelsTest, SparseDepthImages) {
+  srand(4);
+  const DepthImageROI first = RandomROI(13, 7, 37, 29, 500, 9000);
+  const DepthImageROI second = RandomROI(30, 20, 100, 3, 500, 9000);
+  const std::vector<unsigned short> first_image = FullImage(first);
+
+  std::vector<unsigned short> expanded;
+  ExpandDepthImage(first, &expanded);
+  EXPECT_EQ(first_image, expanded);
+
+  // Cropping drops the rows and columns without returns around the ROI.
+  DepthImageROI cropped;
+  CropDepthImage(first_image, &cropped);
+  EXPECT_TRUE(SameDepthImage(first, cropped));
+  EXPECT_LE(cropped.width, first.width);
+  EXPECT_LE(cropped.height, first.height);
+  EXPECT_NE(kKinectMaxDepth, *std::min_element(cropped.depth.begin(),
+                                               cropped.depth.begin() + cropped.width));
+  ExpandDepthImage(cropped, &expanded);
+  EXPECT_EQ(first_image, expanded);
+
+  DepthImageROI composed;
+  ComposeDepthImages(first, second, &composed);
+  std::vector<unsigned short> expected_composed(kNumPixels);
+  ComposeDepthImages(first_image.data(), FullImage(second).data(), kNumPixels,
+                     expected_composed.data());
+  EXPECT_EQ(expected_composed, FullImage(composed));
+  EXPECT_FALSE(SameDepthImage(first, composed));
+
+  // Images without returns.
+  CropDepthImage(std::vector<unsigned short>(kNumPixels, kKinectMaxDepth),
+                 &cropped);
+  EXPECT_TRUE(cropped.depth.empty());
+  EXPECT_TRUE(SameDepthImage(cropped, DepthImageROI()));
+  ComposeDepthImages(cropped, second, &composed);
+  EXPECT_TRUE(SameDepthImage(second, composed));
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,126 @@
+#include <perception_utils/fixed_radius_index.h>
+
+#include <pcl/point_types.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <vector>
+
+using perception_utils::FixedRadiusIndex;
+
+namespace {
+float RandomFloat(float min_value, float max_value) {
+  return min_value + (max_value - min_value) * static_cast<float>(rand()) /
+         RAND_MAX;
+}
+
+// Points around a few centres, so that cells hold many points, plus some
+// without a position.
+pcl::PointCloud<pcl::PointXYZ> RandomCloud(int num_points) {
+  pcl::PointCloud<pcl::PointXYZ> cloud;
+  const float centres[][3] = {{0.0f, 0.0f, 0.0f}, {1.2f, -0.3f, 0.8f}, {-2.0f, 3.0f, -0.05f}};
+
+  for (int ii = 0; ii < num_points; ++ii) {
+    const float *centre = centres[ii % 3];
+    cloud.push_back(pcl::PointXYZ(centre[0] + RandomFloat(-0.1f, 0.1f),
+                                  centre[1] + RandomFloat(-0.1f, 0.1f),
+                                  centre[2] + RandomFloat(-0.1f, 0.1f)));
+  }
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  cloud.push_back(pcl::PointXYZ(nan, nan, nan));
+  cloud.push_back(pcl::PointXYZ(0.0f, nan, 0.0f));
+  return cloud;
+}
+
+int BruteForceCount(const pcl::PointCloud<pcl::PointXYZ> &cloud,
+                    const pcl::PointXYZ &query, double radius) {
+  const float sqr_radius = static_cast<float>(radius * radius);
+  int count = 0;
+
+  for (const auto &point : cloud.points) {
+    const float diff_x = point.x - query.x;
+    const float diff_y = point.y - query.y;
+    const float diff_z = point.z - query.z;
+
+    if (diff_x * diff_x + diff_y * diff_y + diff_z * diff_z <= sqr_radius) {
+      ++count;
+    }
+  }
+
+  return count;
+}
+
+void ExpectSameAsBruteForce(const FixedRadiusIndex &index,
+                            const pcl::PointCloud<pcl::PointXYZ> &cloud) {
+  pcl::PointCloud<pcl::PointXYZ> queries;
+
+  for (int ii = 0; ii < 2000; ++ii) {
+    // Queries on and between the indexed points.
+    const pcl::PointXYZ &point = cloud.points[rand() % (cloud.points.size() - 2)];
+    queries.push_back(ii % 2 ? point : pcl::PointXYZ(point.x + RandomFloat(-0.02f,
+                                                                           0.02f), point.y + RandomFloat(-0.02f, 0.02f),
+                                                     point.z + RandomFloat(-0.02f, 0.02f)));
+  }
+
+  std::vector<int> counts;
+  std::vector<bool> has_neighbor;
+  index.CountNeighbors(queries, &counts);
+  index.HasNeighbors(queries, &has_neighbor);
+  int num_with_neighbors = 0;
+
+  for (size_t ii = 0; ii < queries.points.size(); ++ii) {
+    const int expected = BruteForceCount(cloud, queries.points[ii],
+                                         index.radius());
+    EXPECT_EQ(expected, counts[ii]) << ii;
+    EXPECT_EQ(expected > 0, has_neighbor[ii]) << ii;
+    EXPECT_EQ(std::min(expected, 3), index.CountNeighbors(queries.points[ii], 3));
+    num_with_neighbors += expected > 0;
+  }
+
+  // Both answers should be well represented.
+  EXPECT_GT(num_with_neighbors, 1000);
+  EXPECT_LT(num_with_neighbors, 2000);
+}
+}  // namespace
+
+TEST(FixedRadiusIndexTest, MatchesBruteForce) {
+  srand(1);
+  const pcl::PointCloud<pcl::PointXYZ> cloud = RandomCloud(20000);
+
+  const double radii[] = {0.003, 0.01};
+
+  for (const double radius : radii) {
+    FixedRadiusIndex index(radius);
+    index.SetInputCloud(cloud);
+    EXPECT_EQ(20000, index.size());
+    ExpectSameAsBruteForce(index, cloud);
+  }
+}
+
+TEST(FixedRadiusIndexTest, Rebuild) {
+  srand(2);
+  FixedRadiusIndex index(0.005);
+  EXPECT_FALSE(index.HasNeighbor(pcl::PointXYZ(0.0f, 0.0f, 0.0f)));
+
+  index.SetInputCloud(RandomCloud(30000));
+  const pcl::PointCloud<pcl::PointXYZ> cloud = RandomCloud(5000);
+  index.SetInputCloud(cloud);
+  EXPECT_EQ(5000, index.size());
+  ExpectSameAsBruteForce(index, cloud);
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  EXPECT_EQ(0, index.CountNeighbors(pcl::PointXYZ(nan, 0.0f, 0.0f)));
+
+  index.SetInputCloud(pcl::PointCloud<pcl::PointXYZ>());
+  EXPECT_EQ(0, index.size());
+  EXPECT_FALSE(index.HasNeighbor(cloud.points[0]));
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
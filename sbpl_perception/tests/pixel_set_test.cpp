@@ -0,0 +1,130 @@
+#include <sbpl_perception/pixel_set.h>
+
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <set>
+#include <sstream>
+#include <vector>
+
+using sbpl_perception::PixelSet;
+
+namespace {
+// Random indices below max_index, in runs, like the pixels of objects.
+std::set<int> RandomIndices(int max_index, int num_runs, int max_run_length) {
+  std::set<int> indices;
+
+  for (int ii = 0; ii < num_runs; ++ii) {
+    const int begin = rand() % max_index;
+    const int end = std::min(max_index, begin + 1 + rand() % max_run_length);
+
+    for (int index = begin; index < end; ++index) {
+      indices.insert(index);
+    }
+  }
+
+  return indices;
+}
+
+PixelSet ToPixelSet(const std::set<int> &indices) {
+  PixelSet pixel_set;
+
+  for (const int index : indices) {
+    pixel_set.Insert(index);
+  }
+
+  return pixel_set;
+}
+
+void ExpectSameElements(const std::set<int> &expected,
+                        const PixelSet &pixel_set) {
+  EXPECT_EQ(static_cast<int>(expected.size()), pixel_set.Size());
+  EXPECT_EQ(expected.empty(), pixel_set.Empty());
+  EXPECT_EQ(std::vector<int>(expected.begin(), expected.end()),
+            std::vector<int>(pixel_set.begin(), pixel_set.end()));
+}
+
+PixelSet SerializedCopy(const PixelSet &pixel_set, size_t *num_bytes) {
+  std::stringstream stream;
+  {
+    boost::archive::binary_oarchive output_archive(stream);
+    output_archive << pixel_set;
+  }
+  *num_bytes = stream.str().size();
+  PixelSet copy;
+  boost::archive::binary_iarchive input_archive(stream);
+  input_archive >> copy;
+  return copy;
+}
+}  // namespace
+
+TEST(PixelSetTest, SetOperations) {
+  srand(1);
+  const int kNumPixels = 640 * 480;
+
+  for (int trial = 0; trial < 20; ++trial) {
+    const std::set<int> first = RandomIndices(kNumPixels, 1 + rand() % 50, 500);
+    const std::set<int> second = RandomIndices(kNumPixels / (1 + trial % 3),
+                                               1 + rand() % 50, 500);
+    PixelSet first_set = ToPixelSet(first);
+    const PixelSet second_set = ToPixelSet(second);
+    ExpectSameElements(first, first_set);
+
+    for (int ii = 0; ii < 1000; ++ii) {
+      const int index = rand() % kNumPixels;
+      EXPECT_EQ(first.count(index) > 0, first_set.Contains(index));
+    }
+
+    std::set<int> expected_union = first;
+    expected_union.insert(second.begin(), second.end());
+    PixelSet union_set = first_set;
+    union_set.Union(second_set);
+    ExpectSameElements(expected_union, union_set);
+
+    std::set<int> expected_difference;
+
+    for (const int index : first) {
+      if (second.count(index) == 0) {
+        expected_difference.insert(index);
+      }
+    }
+
+    first_set.Difference(second_set);
+    ExpectSameElements(expected_difference, first_set);
+  }
+
+  PixelSet empty_set;
+  ExpectSameElements(std::set<int>(), empty_set);
+  empty_set.Insert(130);
+  empty_set.Difference(ToPixelSet({130}));
+  ExpectSameElements(std::set<int>(), empty_set);
+  EXPECT_EQ(PixelSet(), empty_set);
+}
+
+TEST(PixelSetTest, Serialization) {
+  srand(2);
+  const int kNumPixels = 640 * 480;
+  size_t empty_bytes = 0;
+  EXPECT_EQ(PixelSet(), SerializedCopy(PixelSet(), &empty_bytes));
+
+  // A few objects, which is written sparsely.
+  const PixelSet sparse_set = ToPixelSet(RandomIndices(kNumPixels, 5, 300));
+  size_t sparse_bytes = 0;
+  const PixelSet sparse_copy = SerializedCopy(sparse_set, &sparse_bytes);
+  EXPECT_EQ(sparse_set, sparse_copy);
+  EXPECT_LT(sparse_bytes, empty_bytes + 100 * sizeof(uint64_t));
+
+  // Most of the image, which is written densely.
+  const PixelSet dense_set = ToPixelSet(RandomIndices(kNumPixels, 2000, 500));
+  size_t dense_bytes = 0;
+  EXPECT_EQ(dense_set, SerializedCopy(dense_set, &dense_bytes));
+  EXPECT_LE(dense_bytes, empty_bytes + kNumPixels / 8);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,165 @@
+#include <sbpl_perception/template_bank.h>
+
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using pcl::simulation::DepthImageROI;
+using sbpl_perception::TemplateBank;
+using sbpl_perception::TemplateKey;
+
+namespace {
+constexpr uint64_t kSceneHash = 42;
+
+DepthImageROI MakeROI(int x, int y, int width, int height,
+                      unsigned short depth) {
+  DepthImageROI roi;
+  roi.x = x;
+  roi.y = y;
+  roi.width = width;
+  roi.height = height;
+  roi.depth.resize(width * height);
+
+  for (size_t ii = 0; ii < roi.depth.size(); ++ii) {
+    roi.depth[ii] = static_cast<unsigned short>(depth + ii);
+  }
+
+  return roi;
+}
+
+void ExpectSameROI(const DepthImageROI &expected, const DepthImageROI &roi) {
+  EXPECT_EQ(expected.x, roi.x);
+  EXPECT_EQ(expected.y, roi.y);
+  EXPECT_EQ(expected.width, roi.width);
+  EXPECT_EQ(expected.height, roi.height);
+  EXPECT_EQ(expected.depth, roi.depth);
+}
+}
+
+class TemplateBankTest : public testing::Test {
+ protected:
+  virtual void SetUp() {
+    path_ = "/tmp/template_bank_test_" + std::to_string(getpid()) + ".bank";
+    std::remove(path_.c_str());
+  }
+
+  virtual void TearDown() {
+    std::remove(path_.c_str());
+  }
+  std::string path_;
+};
+
+TEST_F(TemplateBankTest, PendingTemplates) {
+  TemplateBank bank;
+  EXPECT_EQ(bank.Open(path_, kSceneHash), 0u);
+  EXPECT_TRUE(bank.IsOpen());
+
+  const TemplateKey key(7, 1, 2, 3, 0);
+  const DepthImageROI roi = MakeROI(10, 20, 3, 2, 1000);
+  DepthImageROI found;
+  EXPECT_FALSE(bank.Find(key, &found));
+
+  bank.Add(key, roi);
+  EXPECT_EQ(bank.size(), 1u);
+  ASSERT_TRUE(bank.Find(key, &found));
+  ExpectSameROI(roi, found);
+
+  EXPECT_FALSE(bank.Find(TemplateKey(7, 1, 2, 3, 1), &found));
+  EXPECT_FALSE(bank.Find(TemplateKey(8, 1, 2, 3, 0), &found));
+}
+
+TEST_F(TemplateBankTest, SaveAndReopen) {
+  const TemplateKey key1(7, 1, 2, 3, 0);
+  const TemplateKey key2(7, -4, 0, 15, 1);
+  const TemplateKey key3(3, 0, 0, 0, 0);
+  const DepthImageROI roi1 = MakeROI(10, 20, 3, 2, 1000);
+  const DepthImageROI roi2 = MakeROI(0, 0, 5, 4, 2000);
+  const DepthImageROI roi3 = MakeROI(100, 50, 1, 1, 3000);
+
+  {
+    TemplateBank bank;
+    bank.Open(path_, kSceneHash);
+    bank.Add(key1, roi1);
+    bank.Add(key2, roi2);
+    ASSERT_TRUE(bank.Save());
+    EXPECT_TRUE(bank.pending().empty());
+    EXPECT_EQ(bank.size(), 2u);
+  }
+
+  // Templates added on top of a mapped file are merged with it.
+  {
+    TemplateBank bank;
+    EXPECT_EQ(bank.Open(path_, kSceneHash), 2u);
+    bank.Add(key1, roi3);
+    EXPECT_TRUE(bank.pending().empty());
+    bank.Add(key3, roi3);
+    ASSERT_TRUE(bank.Save());
+  }
+
+  TemplateBank bank;
+  EXPECT_EQ(bank.Open(path_, kSceneHash), 3u);
+  DepthImageROI found;
+  ASSERT_TRUE(bank.Find(key1, &found));
+  ExpectSameROI(roi1, found);
+  ASSERT_TRUE(bank.Find(key2, &found));
+  ExpectSameROI(roi2, found);
+  ASSERT_TRUE(bank.Find(key3, &found));
+  ExpectSameROI(roi3, found);
+  EXPECT_FALSE(bank.Find(TemplateKey(7, 1, 2, 4, 0), &found));
+}
+
+TEST_F(TemplateBankTest, OtherSceneIsIgnored) {
+  {
+    TemplateBank bank;
+    bank.Open(path_, kSceneHash);
+    bank.Add(TemplateKey(7, 1, 2, 3, 0), MakeROI(10, 20, 3, 2, 1000));
+    ASSERT_TRUE(bank.Save());
+  }
+
+  TemplateBank bank;
+  EXPECT_EQ(bank.Open(path_, kSceneHash + 1), 0u);
+  DepthImageROI found;
+  EXPECT_FALSE(bank.Find(TemplateKey(7, 1, 2, 3, 0), &found));
+}
+
+TEST_F(TemplateBankTest, CorruptFileIsIgnored) {
+  {
+    TemplateBank bank;
+    bank.Open(path_, kSceneHash);
+    bank.Add(TemplateKey(7, 1, 2, 3, 0), MakeROI(10, 20, 3, 2, 1000));
+    bank.Add(TemplateKey(8, 1, 2, 3, 0), MakeROI(0, 0, 40, 30, 2000));
+    ASSERT_TRUE(bank.Save());
+  }
+
+  // Cut off the end of the depth values, as an interrupted copy would.
+  std::FILE *file = std::fopen(path_.c_str(), "rb");
+  ASSERT_NE(file, nullptr);
+  std::fseek(file, 0, SEEK_END);
+  std::vector<char> bytes(std::ftell(file));
+  std::rewind(file);
+  ASSERT_EQ(std::fread(bytes.data(), 1, bytes.size(), file), bytes.size());
+  std::fclose(file);
+
+  const size_t truncated_sizes[] = {bytes.size() - 1, bytes.size() / 2, 17};
+
+  for (const size_t truncated_size : truncated_sizes) {
+    file = std::fopen(path_.c_str(), "wb");
+    ASSERT_NE(file, nullptr);
+    std::fwrite(bytes.data(), 1, truncated_size, file);
+    std::fclose(file);
+
+    TemplateBank bank;
+    EXPECT_EQ(bank.Open(path_, kSceneHash), 0u) << truncated_size;
+    DepthImageROI found;
+    EXPECT_FALSE(bank.Find(TemplateKey(8, 1, 2, 3, 0), &found));
+  }
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}